@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include "agg.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * A submission mustn't hold up a measure for long if the aggregator hangs
+ */
+#define AGG_CONNECT_TIMEOUT_SEC 2
+
+/**
+ * How long an unreachable aggregator is left alone, doubling from the first
+ * to the last as it keeps failing
+ */
+#define AGG_FIRST_BACKOFF_SEC 1
+#define AGG_MAX_BACKOFF_SEC 64
+
+static int agg_connect(struct agg_client *client);
+static int send_all(int fd, const char *buf, size_t len);
+
+size_t agg_encode(const struct agg_snapshot *snap, char *dest, size_t size) {
+    struct in_addr addr = {.s_addr = snap->addr};
+    size_t len;
+    int n;
+
+    n = snprintf(dest, size, "S %s:%u %u %lu %lu %lu %lu %lu %lu %.17g", inet_ntoa(addr), ntohs(snap->port),
+        snap->payload_size, snap->time_sec, snap->sent, snap->lost, snap->hist.count, snap->hist.min,
+        snap->hist.max, snap->hist.sum);
+
+    if (n < 0 || (size_t)n >= size) {
+        return 0;
+    }
+
+    len = n;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        if (snap->hist.buckets[i] == 0) {
+            continue;
+        }
+
+        n = snprintf(dest + len, size - len, " %u:%lu", i, snap->hist.buckets[i]);
+
+        if (n < 0 || (size_t)n >= size - len) {
+            return 0;
+        }
+
+        len += n;
+    }
+
+    if (len + 1 >= size) {
+        return 0;
+    }
+
+    dest[len++] = '\n';
+    dest[len] = '\0';
+    return len;
+}
+
+int agg_decode(const char *line, struct agg_snapshot *dest) {
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    unsigned int port, idx;
+    unsigned long count, total = 0;
+    const char *p;
+    char *end;
+    int n;
+
+    hist_init(&(dest->hist));
+
+    if (sscanf(line, "S %15[0-9.]:%u %u %lu %lu %lu %lu %lu %lu %lf%n", addr, &port, &(dest->payload_size),
+            &(dest->time_sec), &(dest->sent), &(dest->lost), &(dest->hist.count), &(dest->hist.min),
+            &(dest->hist.max), &(dest->hist.sum), &n) != 10
+        || port < 1 || port > 65535 || inet_aton(addr, &in) == 0
+    ) {
+        return 0;
+    }
+
+    dest->addr = in.s_addr;
+    dest->port = htons(port);
+
+    for (p = line + n; *p == ' '; p = end) {
+        idx = strtoul(p, &end, 10);
+        if (*end != ':' || idx >= HIST_BUCKETS) {
+            return 0;
+        }
+
+        count = strtoul(end + 1, &end, 10);
+        if (*end != ' ' && *end != '\0') {
+            return 0;
+        }
+
+        dest->hist.buckets[idx] += count;
+        total += count;
+    }
+
+    // The buckets must account for every value, or merges would drift
+    return *p == '\0' && total == dest->hist.count;
+}
+
+int agg_client_init(struct agg_client *client, const char *spec) {
+    struct sockaddr_in *in = (struct sockaddr_in *)&(client->addr);
+    struct sockaddr_un *un = (struct sockaddr_un *)&(client->addr);
+    char host[INET_ADDRSTRLEN];
+    const char *colon;
+    int port;
+
+    memset(client, 0, sizeof(struct agg_client));
+    client->fd = -1;
+    client->backoff_ns = (uint64_t)AGG_FIRST_BACKOFF_SEC * 1000000000;
+
+    if (spec[0] == '/' || spec[0] == '.') {
+        if (strlen(spec) >= sizeof(un->sun_path)) {
+            return 0;
+        }
+
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec);
+        client->addr_len = sizeof(struct sockaddr_un);
+        return 1;
+    }
+
+    colon = strrchr(spec, ':');
+    if (colon == NULL || (size_t)(colon - spec) >= sizeof(host)) {
+        return 0;
+    }
+
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    port = atoi(colon + 1);
+
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    client->addr_len = sizeof(struct sockaddr_in);
+
+    return port >= 1 && port <= 65535 && inet_aton(host, &(in->sin_addr)) != 0;
+}
+
+int agg_submit(struct agg_client *client, const struct agg_snapshot *snap) {
+    static char line[AGG_MAX_LINE];
+    size_t len = agg_encode(snap, line, sizeof(line));
+    uint64_t now = now_ns();
+
+    if (len == 0) {
+        log_error("Snapshot too large for the aggregator");
+        return 0;
+    }
+
+    if (now < client->retry_ns) {
+        client->dropped += 1;
+        return 0;
+    }
+
+    // A connection gone stale since the last submission is worth a second one
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (client->fd == -1 && !agg_connect(client)) {
+            break;
+        }
+
+        if (send_all(client->fd, line, len)) {
+            if (client->retry_ns != 0) {
+                log_info("Aggregator reachable again, %lu submissions dropped meanwhile", client->dropped);
+            }
+
+            client->retry_ns = 0;
+            client->backoff_ns = (uint64_t)AGG_FIRST_BACKOFF_SEC * 1000000000;
+            client->dropped = 0;
+            return 1;
+        }
+
+        agg_client_close(client);
+    }
+
+    log_warn("Cannot reach the aggregator (%s), leaving it alone for %lu s", strerror(errno),
+        client->backoff_ns / 1000000000);
+
+    client->retry_ns = now_ns() + client->backoff_ns;
+    client->dropped += 1;
+
+    if (client->backoff_ns < (uint64_t)AGG_MAX_BACKOFF_SEC * 1000000000) {
+        client->backoff_ns *= 2;
+    }
+
+    return 0;
+}
+
+void agg_client_close(struct agg_client *client) {
+    if (client->fd != -1) {
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+static int agg_connect(struct agg_client *client) {
+    struct timeval timeout = {.tv_sec = AGG_CONNECT_TIMEOUT_SEC, .tv_usec = 0};
+    int one = 1;
+
+    client->fd = socket(client->addr.ss_family, SOCK_STREAM, 0);
+    if (client->fd == -1) {
+        return 0;
+    }
+
+    // Bounds the connect, sends don't wait anyway
+    setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (client->addr.ss_family == AF_INET) {
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (connect(client->fd, (struct sockaddr *)&(client->addr), client->addr_len) == -1) {
+        agg_client_close(client);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Gives up rather than wait for room in the socket buffer. The connection
+ * must be closed then: the line may have been cut short.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 1;
+}
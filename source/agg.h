@@ -0,0 +1,79 @@
+#ifndef AGG_H
+#define AGG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "stats.h"
+
+/**
+ * Longest line of the aggregator protocol. A snapshot only lists its non
+ * empty buckets, a full one would take ~40 KB.
+ */
+#define AGG_MAX_LINE (64 * 1024)
+
+/**
+ * Counters and RTT histogram of a run (or a daemon period) against a target.
+ * TIME_SEC is the CLOCK_REALTIME second it ended at.
+ * ADDR and PORT are in network byte order.
+ */
+struct agg_snapshot {
+    uint32_t addr;
+    uint16_t port;
+    uint32_t payload_size;
+    uint64_t time_sec;
+    uint64_t sent;
+    uint64_t lost;
+    histogram hist;
+};
+
+/**
+ * Connection to an aggregator, over TCP or a unix socket.
+ * FD is -1 while not connected. After a failure the aggregator is taken as
+ * down until RETRY_NS, BACKOFF_NS doubling each time it fails again.
+ * DROPPED counts the submissions given up meanwhile.
+ */
+struct agg_client {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;
+    uint64_t retry_ns;
+    uint64_t backoff_ns;
+    unsigned long dropped;
+};
+
+/**
+ * Write SNAP to DEST as a newline terminated line:
+ *   S ADDR:PORT SIZE TIME SENT LOST COUNT MIN MAX SUM [IDX:N ...]
+ * with a pair for every non empty bucket, so nothing is lost in the way.
+ * Returns its length, 0 if it doesn't fit in SIZE bytes.
+ */
+size_t agg_encode(const struct agg_snapshot *snap, char *dest, size_t size);
+
+/**
+ * Parse a line written by agg_encode(), the newline already stripped.
+ * Returns 0 if it's malformed.
+ */
+int agg_decode(const char *line, struct agg_snapshot *dest);
+
+/**
+ * Prepare a client for the aggregator at SPEC, ADDR:PORT or the path of a
+ * unix socket. Connects lazily, on the first submission.
+ * Returns 0 if SPEC is invalid.
+ */
+int agg_client_init(struct agg_client *client, const char *spec);
+
+/**
+ * Send SNAP, connecting first if needed. A broken connection is reopened
+ * once before giving up. Nothing is sent back, submissions are fire and forget.
+ * Never waits on a connected aggregator, only connecting can take a couple
+ * of seconds, and isn't tried again while it's taken as down: submissions
+ * are dropped right away then. Going down and back up is logged.
+ * Returns 0 if SNAP wasn't sent.
+ */
+int agg_submit(struct agg_client *client, const struct agg_snapshot *snap);
+
+void agg_client_close(struct agg_client *client);
+
+#endif
@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+
+#include "agg.h"
+#include "evloop.h"
+#include "stats.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <argp.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define MAX_CONNECTIONS 1024
+#define LISTEN_BACKLOG 128
+#define REPLY_SIZE 512
+#define DEFAULT_WINDOW_SEC 60
+#define DEFAULT_RETENTION_SEC 3600
+
+/**
+ * Every series takes a full histogram, ~11 KB, so this bounds memory at ~45 MB.
+ * With the default window and retention, 61 windows are kept, so that's 67 target
+ * and size pairs.
+ */
+#define DEFAULT_MAX_SERIES 4096
+
+struct aggregator_config {
+    int port;
+    const char *unix_path;
+    uint64_t window_sec;
+    uint64_t retention_sec;
+    unsigned int max_series;
+    enum log_levels log_level;
+};
+
+/**
+ * Everything submitted for a target and payload size in the time window
+ * starting at WINDOW (unix seconds). Only merged histograms are kept.
+ * Series are also listed from OLDER to NEWER in the order they were created.
+ */
+struct series {
+    uint32_t addr;
+    uint16_t port;
+    uint32_t payload_size;
+    uint64_t window;
+    unsigned long submissions;
+    uint64_t sent;
+    uint64_t lost;
+    histogram hist;
+    struct series *next;
+    struct series *older;
+    struct series *newer;
+};
+
+/**
+ * A client connection, BUF holds what was read past the last full line
+ */
+struct connection {
+    int fd;
+    struct ev_io io;
+    size_t len;
+    char buf[AGG_MAX_LINE];
+};
+
+static void on_accept(void *ctx, uint32_t events);
+static void on_connection_io(void *ctx, uint32_t events);
+static void on_evict_due(void *ctx);
+static int open_tcp(int port);
+static int open_unix(const char *path);
+static void connection_close(struct connection *c);
+static int handle_line(struct connection *c, char *line);
+static int handle_submit(const char *line);
+static void handle_query(struct connection *c, const char *line);
+static int parse_query_time(const char *arg, uint64_t now, uint64_t *dest);
+static void reply(struct connection *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static struct series **find_series(uint32_t addr, uint16_t port, uint32_t payload_size, uint64_t window);
+static void series_free(struct series *s);
+
+static error_t arg_parser(int key, char *arg, struct argp_state *state);
+static void parse_port(const char *arg, struct aggregator_config *config);
+static void parse_seconds(const char *arg, uint64_t *dest, const char *what);
+static void parse_max_series(const char *arg, struct aggregator_config *config);
+static void parse_log_level(const char *arg, struct aggregator_config *config);
+
+static char doc[] = "RTT and throughput tester. Aggregator of the clients' RTT histograms.\v"
+    "Clients submit their runs with --aggregator. Submissions for the same target and payload size within "
+    "a time window are merged into one histogram, bucket by bucket, so percentiles of the merged data are "
+    "as accurate as those of a single run.\n\n"
+    "Queries are lines sent to PORT (e.g. with nc):\n"
+    "  Q [TARGET [SIZE [FROM [TO]]]]\n"
+    "TARGET is ADDR:PORT, SIZE a payload size, both '*' for any. FROM and TO are unix seconds, -N for N "
+    "seconds ago or '*', the windows starting within [FROM, TO) are merged. The answer is a line with "
+    "the counters and the RTT percentiles in nanoseconds.";
+static char args_doc[] = "PORT";
+static struct argp_option options[] = {
+    {"unix", 'U', "PATH", 0, "Also accept submissions and queries on the unix socket PATH", 1},
+    {"window", 'w', "SEC", 0, "Width of the time windows submissions are merged by. Defaults to 60.", 2},
+    {"retention", 'k', "SEC", 0, "Drop windows older than SEC seconds. Defaults to 3600.", 2},
+    {"max-series", 'n', "NUM", 0, "Max target, payload size and window combinations kept, past it the oldest make room for new ones. Defaults to 4096.", 2},
+    {"log-level", 'L', "LEVEL", 0, "Most verbose messages to print (error | warn | info | debug). Defaults to 'info'.", 3},
+    {0}
+};
+static struct argp argp = {options, arg_parser, args_doc, doc, 0, 0, 0};
+static struct aggregator_config config;
+
+static struct evloop loop;
+static struct ev_io tcp_io;
+static struct ev_io unix_io;
+static struct ev_timer evict_timer;
+static struct series **table;
+static size_t table_mask;
+static struct series *oldest;
+static struct series *newest;
+static unsigned int n_series;
+static unsigned int n_displaced;
+static unsigned int n_connections;
+static histogram merged;
+static struct agg_snapshot snapshot;
+static unsigned long n_submitted;
+static unsigned long n_dropped;
+
+int main(int argc, char **argv) {
+    int fd;
+    size_t table_size = 1;
+    uint64_t windows_kept;
+
+    config.port = 0;
+    config.unix_path = NULL;
+    config.window_sec = DEFAULT_WINDOW_SEC;
+    config.retention_sec = DEFAULT_RETENTION_SEC;
+    config.max_series = DEFAULT_MAX_SERIES;
+    config.log_level = LOG_INFO;
+
+    if (!log_init(config.log_level)) {
+        exit(1);
+    }
+
+    if (argp_parse(&argp, argc, argv, 0, 0, &config) != 0) {
+        log_error("Some error occurred while parsing arguments");
+        exit(1);
+    }
+
+    log_set_level(config.log_level);
+
+    // Chains stay short with at least as many heads as series
+    while (table_size < config.max_series) {
+        table_size <<= 1;
+    }
+
+    table = calloc(table_size, sizeof(struct series *));
+    table_mask = table_size - 1;
+
+    if (table == NULL) {
+        log_error("Cannot allocate the series table");
+        exit(1);
+    }
+
+    if (!evloop_init(&loop, 0)) {
+        exit(1);
+    }
+
+    fd = open_tcp(config.port);
+    if (fd == -1 || !evloop_io_add(&loop, &tcp_io, fd, EPOLLIN, on_accept, &tcp_io)) {
+        exit(1);
+    }
+
+    if (config.unix_path != NULL) {
+        fd = open_unix(config.unix_path);
+        if (fd == -1 || !evloop_io_add(&loop, &unix_io, fd, EPOLLIN, on_accept, &unix_io)) {
+            exit(1);
+        }
+    }
+
+    evloop_timer_init(&evict_timer, on_evict_due, NULL);
+    evloop_timer_set(&loop, &evict_timer, now_ns() + config.window_sec * 1000000000);
+
+    log_info("Aggregating on port %d%s%s, %lu s windows kept for %lu s", config.port,
+        config.unix_path != NULL ? " and " : "", config.unix_path != NULL ? config.unix_path : "",
+        config.window_sec, config.retention_sec);
+
+    windows_kept = (config.retention_sec + config.window_sec - 1) / config.window_sec + 1;
+
+    if (config.max_series / windows_kept < 1) {
+        log_warn("%u series can't keep a target and size for the whole retention, older windows will be evicted early",
+            config.max_series);
+    } else {
+        log_info("Room for %lu target and size pairs over the retention", config.max_series / windows_kept);
+    }
+
+    while (evloop_run_once(&loop, -1)) {
+    }
+
+    return 1;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_accept(void *ctx, uint32_t events) {
+    struct ev_io *listen_io = ctx;
+    struct connection *c;
+    int fd;
+
+    while (1) {
+        fd = accept4(listen_io->fd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Cannot accept connection");
+            }
+            return;
+        }
+
+        c = n_connections < MAX_CONNECTIONS ? malloc(sizeof(struct connection)) : NULL;
+
+        if (c == NULL) {
+            log_warn("Too many connections, refusing one");
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->len = 0;
+
+        if (!evloop_io_add(&loop, &(c->io), fd, EPOLLIN, on_connection_io, c)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        n_connections += 1;
+    }
+}
+
+static void on_connection_io(void *ctx, uint32_t events) {
+    struct connection *c = ctx;
+    char *start, *nl;
+    ssize_t n;
+
+    while (1) {
+        n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            connection_close(c);
+            return;
+        }
+
+        c->len += n;
+        start = c->buf;
+
+        while ((nl = memchr(start, '\n', c->len - (start - c->buf))) != NULL) {
+            *nl = '\0';
+
+            if (nl > start && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+
+            if (!handle_line(c, start)) {
+                connection_close(c);
+                return;
+            }
+
+            start = nl + 1;
+        }
+
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+
+        if (c->len == sizeof(c->buf)) {
+            log_warn("Line too long, closing the connection");
+            connection_close(c);
+            return;
+        }
+    }
+}
+
+/**
+ * Drop the windows past retention, and say how busy the last one was
+ */
+static void on_evict_due(void *ctx) {
+    uint64_t now = time(NULL);
+    unsigned int n_evicted = 0;
+    struct series **link, *s;
+
+    evloop_timer_set(&loop, &evict_timer, evict_timer.due_ns + config.window_sec * 1000000000);
+
+    for (size_t i = 0; i <= table_mask; i++) {
+        for (link = &(table[i]); (s = *link) != NULL;) {
+            if (s->window + config.window_sec + config.retention_sec <= now) {
+                *link = s->next;
+                series_free(s);
+                n_evicted += 1;
+            } else {
+                link = &(s->next);
+            }
+        }
+    }
+
+    if (n_submitted > 0 || n_dropped > 0 || n_evicted > 0 || n_displaced > 0) {
+        log_info("%lu submissions (%.1f/s), %lu dropped, %u series, %u evicted, %u displaced, %u connections",
+            n_submitted, (double)n_submitted / config.window_sec, n_dropped, n_series, n_evicted, n_displaced,
+            n_connections);
+    }
+
+    n_submitted = 0;
+    n_dropped = 0;
+    n_displaced = 0;
+}
+#pragma GCC diagnostic pop
+
+static int open_tcp(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    bzero(&addr, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+
+    if (fd == -1) {
+        log_perror("Cannot create socket");
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_perror("Cannot bind socket");
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG)) {
+        log_perror("Cannot listen");
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    bzero(&addr, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Unix socket path too long");
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (fd == -1) {
+        log_perror("Cannot create unix socket");
+        return -1;
+    }
+
+    // Left behind by a previous run
+    unlink(path);
+
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_perror("Cannot bind unix socket");
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG)) {
+        log_perror("Cannot listen");
+        return -1;
+    }
+
+    return fd;
+}
+
+static void connection_close(struct connection *c) {
+    evloop_io_del(&loop, &(c->io));
+    close(c->fd);
+    free(c);
+    n_connections -= 1;
+}
+
+/**
+ * Returns 0 if the connection must be closed
+ */
+static int handle_line(struct connection *c, char *line) {
+    switch (line[0]) {
+        case 'S':
+            return handle_submit(line);
+
+        case 'Q':
+            handle_query(c, line);
+            return 1;
+
+        case '\0':
+            return 1;
+
+        default:
+            reply(c, "ERR unknown command\n");
+            return 1;
+    }
+}
+
+/**
+ * Submissions get no answer, a malformed one closes the connection.
+ * At the cap the series created first makes room, unless its window isn't
+ * older than the one submitted to: the submission is dropped then.
+ */
+static int handle_submit(const char *line) {
+    uint64_t now = time(NULL), window;
+    struct series **link, *s;
+
+    if (!agg_decode(line, &snapshot)) {
+        log_warn("Malformed submission, closing the connection");
+        return 0;
+    }
+
+    window = snapshot.time_sec - snapshot.time_sec % config.window_sec;
+
+    // Nothing older than retention, nor so far ahead it would never be evicted
+    if (window + config.window_sec + config.retention_sec <= now || window > now + config.retention_sec) {
+        n_dropped += 1;
+        return 1;
+    }
+
+    link = find_series(snapshot.addr, snapshot.port, snapshot.payload_size, window);
+
+    if (*link == NULL && n_series >= config.max_series && oldest->window < window) {
+        s = oldest;
+        *find_series(s->addr, s->port, s->payload_size, s->window) = s->next;
+        series_free(s);
+        n_displaced += 1;
+
+        // The chain may have been the one the new series goes in
+        link = find_series(snapshot.addr, snapshot.port, snapshot.payload_size, window);
+    }
+
+    if (*link == NULL) {
+        s = n_series < config.max_series ? malloc(sizeof(struct series)) : NULL;
+
+        if (s == NULL) {
+            n_dropped += 1;
+            return 1;
+        }
+
+        s->addr = snapshot.addr;
+        s->port = snapshot.port;
+        s->payload_size = snapshot.payload_size;
+        s->window = window;
+        s->submissions = 0;
+        s->sent = 0;
+        s->lost = 0;
+        s->next = NULL;
+        s->older = newest;
+        s->newer = NULL;
+        hist_init(&(s->hist));
+
+        if (newest != NULL) {
+            newest->newer = s;
+        } else {
+            oldest = s;
+        }
+
+        newest = s;
+        *link = s;
+        n_series += 1;
+    }
+
+    s = *link;
+    s->submissions += 1;
+    s->sent += snapshot.sent;
+    s->lost += snapshot.lost;
+    hist_merge(&(s->hist), &(snapshot.hist));
+
+    n_submitted += 1;
+    return 1;
+}
+
+/**
+ * Q [TARGET [SIZE [FROM [TO]]]], missing arguments match anything
+ */
+static void handle_query(struct connection *c, const char *line) {
+    char target[32] = "*", size[16] = "*", from[24] = "*", to[24] = "*";
+    char addr_str[INET_ADDRSTRLEN];
+    struct in_addr addr = {.s_addr = 0};
+    unsigned int port = 0;
+    unsigned long payload_size = 0, n_windows = 0, n_submissions = 0;
+    uint64_t now = time(NULL), from_sec, to_sec, sent = 0, lost = 0;
+    struct series *s;
+
+    sscanf(line + 1, "%31s %15s %23s %23s", target, size, from, to);
+
+    if ((line[1] != ' ' && line[1] != '\0')
+        || (strcmp(target, "*") != 0
+            && (sscanf(target, "%15[0-9.]:%u", addr_str, &port) != 2 || inet_aton(addr_str, &addr) == 0))
+        || (strcmp(size, "*") != 0 && sscanf(size, "%lu", &payload_size) != 1)
+        || !parse_query_time(from, now, &from_sec)
+        || !parse_query_time(to, now, &to_sec)
+    ) {
+        reply(c, "ERR usage: Q [ADDR:PORT|* [SIZE|* [FROM|* [TO|*]]]]\n");
+        return;
+    }
+
+    if (strcmp(to, "*") == 0) {
+        to_sec = UINT64_MAX;
+    }
+
+    hist_init(&merged);
+
+    for (size_t i = 0; i <= table_mask; i++) {
+        for (s = table[i]; s != NULL; s = s->next) {
+            if ((port == 0 || (s->addr == addr.s_addr && s->port == htons(port)))
+                && (payload_size == 0 || s->payload_size == payload_size)
+                && s->window >= from_sec && s->window < to_sec
+            ) {
+                hist_merge(&merged, &(s->hist));
+                sent += s->sent;
+                lost += s->lost;
+                n_submissions += s->submissions;
+                n_windows += 1;
+            }
+        }
+    }
+
+    reply(c, "OK windows=%lu submissions=%lu sent=%lu lost=%lu count=%lu min=%lu p50=%lu p90=%lu p99=%lu"
+        " p999=%lu max=%lu mean=%.0f\n", n_windows, n_submissions, sent, lost, merged.count,
+        merged.count > 0 ? merged.min : 0, hist_percentile(&merged, 50), hist_percentile(&merged, 90),
+        hist_percentile(&merged, 99), hist_percentile(&merged, 99.9), merged.max, hist_mean(&merged));
+}
+
+/**
+ * Unix seconds, -N seconds ago, or '*' for the beginning of time
+ */
+static int parse_query_time(const char *arg, uint64_t now, uint64_t *dest) {
+    char *end;
+    long value;
+
+    if (strcmp(arg, "*") == 0) {
+        *dest = 0;
+        return 1;
+    }
+
+    value = strtol(arg, &end, 10);
+
+    if (*end != '\0') {
+        return 0;
+    }
+
+    *dest = value < 0 ? now + value : (uint64_t)value;
+    return 1;
+}
+
+/**
+ * Answers are short, a client that doesn't read them only loses them
+ */
+static void reply(struct connection *c, const char *fmt, ...) {
+    char buf[REPLY_SIZE];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (n > 0 && send(c->fd, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+        log_debug("Answer not sent: %s", strerror(errno));
+    }
+}
+
+/**
+ * The link pointing to the series, or to where it would go if there's none
+ */
+static struct series **find_series(uint32_t addr, uint16_t port, uint32_t payload_size, uint64_t window) {
+    uint64_t h = ((uint64_t)addr << 32 | (uint64_t)port << 16) ^ ((uint64_t)payload_size << 20) ^ window;
+    struct series **link;
+
+    // splitmix64 finalizer, windows and addresses differ in few bits
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    for (link = &(table[h & table_mask]); *link != NULL; link = &((*link)->next)) {
+        if ((*link)->window == window && (*link)->addr == addr && (*link)->port == port
+            && (*link)->payload_size == payload_size
+        ) {
+            break;
+        }
+    }
+
+    return link;
+}
+
+/**
+ * Take S out of the age list and free it, it must be out of its chain already
+ */
+static void series_free(struct series *s) {
+    if (s->older != NULL) {
+        s->older->newer = s->newer;
+    } else {
+        oldest = s->newer;
+    }
+
+    if (s->newer != NULL) {
+        s->newer->older = s->older;
+    } else {
+        newest = s->older;
+    }
+
+    free(s);
+    n_series -= 1;
+}
+
+static error_t arg_parser(int key, char *arg, struct argp_state *state) {
+    struct aggregator_config *config = state->input;
+
+    switch (key) {
+        case 'U': config->unix_path = arg; break;
+        case 'w': parse_seconds(arg, &(config->window_sec), "window"); break;
+        case 'k': parse_seconds(arg, &(config->retention_sec), "retention"); break;
+        case 'n': parse_max_series(arg, config); break;
+        case 'L': parse_log_level(arg, config); break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 1) {
+                argp_usage(state);
+            }
+            parse_port(arg, config);
+            break;
+
+        case ARGP_KEY_END:
+            if (state->arg_num < 1) {
+                argp_usage(state);
+            }
+    }
+
+    return 0;
+}
+
+static void parse_port(const char *arg, struct aggregator_config *config) {
+    config->port = atoi(arg);
+
+    if (config->port < 1 || config->port > 65535) {
+        log_error("Invalid port");
+        exit(1);
+    }
+}
+
+static void parse_seconds(const char *arg, uint64_t *dest, const char *what) {
+    long value = atol(arg);
+
+    if (value < 1) {
+        log_error("Invalid %s", what);
+        exit(1);
+    }
+
+    *dest = value;
+}
+
+static void parse_max_series(const char *arg, struct aggregator_config *config) {
+    int value = atoi(arg);
+
+    if (value < 1) {
+        log_error("Invalid max series");
+        exit(1);
+    }
+
+    config->max_series = value;
+}
+
+static void parse_log_level(const char *arg, struct aggregator_config *config) {
+    if (!log_level_from_string(arg, &(config->log_level))) {
+        log_error("Invalid log level");
+        exit(1);
+    }
+}
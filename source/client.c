@@ -2,6 +2,19 @@
 
 #include "utils.h"
 #include "protocol.h"
+#include "stats.h"
+#include "tuning.h"
+#include "preflight.h"
+#include "sweep.h"
+#include "mesh.h"
+#include "daemon.h"
+#include "scenario.h"
+#include "store.h"
+#include "agg.h"
+#include "stream.h"
+#include "log.h"
+#include "prof.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,6 +25,8 @@
 #include <string.h>
 #include <argp.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,6 +37,31 @@
 #define RECV_BUF_SIZE 33 * 1024
 #define SOCK_TIMEOUT_SEC 5
 
+/**
+ * Adaptive probe count: 95% confidence intervals, never stopping on
+ * fewer than ADAPTIVE_MIN_PROBES, and default budgets
+ */
+#define CI_Z 1.96
+#define ADAPTIVE_MIN_PROBES 10
+#define ADAPTIVE_MAX_PROBES 10000
+#define ADAPTIVE_MAX_SEC 30
+
+/**
+ * Warm-up by time or until the congestion window settles can't go on for more
+ * than this many probes, the auto one for more than WARMUP_AUTO_MAX_SEC either.
+ * The window is settled once it's unchanged for WARMUP_CWND_STABLE probes in a row.
+ */
+#define WARMUP_MAX_PROBES 100000
+#define WARMUP_AUTO_MAX_SEC 10
+#define WARMUP_CWND_STABLE 16
+
+enum warmup_modes {
+    WARMUP_NONE,
+    WARMUP_PROBES,
+    WARMUP_TIME,
+    WARMUP_AUTO
+};
+
 enum client_states {
     STATE_HELLO = 1,
     STATE_MEASURE,
@@ -30,25 +70,96 @@ enum client_states {
     STATE_CLOSE
 };
 
+/**
+ * In low-latency mode each payload size is measured twice,
+ * first with blocking sockets and then busy polling.
+ */
+enum measure_passes {
+    PASS_BLOCKING = 1,
+    PASS_BUSY_POLL
+};
+
 struct client_config {
     struct sockaddr_in server_addr;
     enum measure_types measure_type;
     int n_probes;
+    double adaptive_rel;
+    double ci_percentile;
+    int max_probes;
+    int max_sec;
+    enum warmup_modes warmup;
+    unsigned int warmup_probes;
+    uint64_t warmup_ns;
     size_t *payload_sizes;
     int n_sizes;
     unsigned int server_delay;
-    char quiet;
+    enum log_levels log_level;
+    char low_latency;
+    int cpu;
+    char mlock;
+    char profile;
+    char fastopen;
+    int connect_test;
+    char sweep;
+    int concurrency;
+    double slo_ms;
+    struct mesh_target *targets;
+    int n_targets;
+    double jitter_ms;
+    unsigned int seed;
+    double daemon_sec;
+    double summary_sec;
+    int window;
+    FILE *output;
+    const char *results_path;
+    const char *tag;
+    const char *aggregator;
+    const char *scenario_path;
+    char auto_tune;
+    char has_tuning;
+    struct sock_tuning tuning;
 };
 
 static char doc[] = "RTT and throughput tester. Client software.";
-static char args_doc[] = "SERVER_ADDR PORT";
+static char args_doc[] = "SERVER_ADDR PORT\n--targets=LIST\n--scenario=FILE";
 
 static struct argp_option options[] = {
-    {"measure", 'm', "TYPE", 0, "Type of measure to perform (rtt | thput). Defaults to 'rtt'.", 1},
+    {"measure", 'm', "TYPE", 0, "Type of measure to perform (rtt | thput | sink | source | bidir). Defaults to 'rtt'.", 1},
     {"n-probes", 'n', "NUM", 0, "Number of probes to send, Defaults to 20.", 1},
     {"size", 's', "BYTES", 0, "Size of the probe's payload.", 1},
     {"server-delay", 'd', "MS", 0, "Server artificial delay in milliseconds. Defaults to 0.", 1},
-    {"quiet", 'q', 0, 0, "Print less info", 1},
+    {"quiet", 'q', 0, 0, "Only print results and problems. Same as --log-level warn", 1},
+    {"log-level", 'L', "LEVEL", 0, "Most verbose messages to print (error | warn | info | debug). Defaults to 'info'.", 1},
+    {"adaptive", 'a', "REL", 0, "Instead of a fixed number of probes, stop once the 95% confidence interval of the estimate is within +/- REL of it (e.g. 0.05). rtt and thput only.", 1},
+    {"estimate", 'e', "STAT", 0, "Estimate adaptive mode stops on: 'mean' or a percentile like 'p99'. Percentiles can't be resolved finer than ~3%. Defaults to 'mean'.", 1},
+    {"max-probes", 'P', "NUM", 0, "Adaptive mode probe budget. Defaults to 10000.", 1},
+    {"max-time", 'T', "SEC", 0, "Adaptive mode time budget. Defaults to 30.", 1},
+    {"warmup", 'u', "SPEC", 0, "Probes to leave out of the results at the start of each measure: a count (e.g. 100), a time (e.g. 500ms, 2s) or 'auto' to wait until the congestion window settles. rtt and thput only.", 1},
+    {"low-latency", 'l', 0, 0, "Busy poll non-blocking sockets and compare against the blocking path", 2},
+    {"cpu", 'c', "CPU", 0, "Pin the client to CPU", 2},
+    {"mlock", 'M', 0, 0, "Lock all memory pages to avoid page faults while measuring", 2},
+    {"profile", 'p', 0, 0, "Count cycles, instructions, cache misses and context switches of each probe phase", 2},
+    {"tune", 't', 0, 0, "Size socket buffers on both ends to the path's bandwidth-delay product, estimated with a pre-flight run", 3},
+    {"sndbuf", 'S', "BYTES", 0, "Send buffer size for both ends", 3},
+    {"rcvbuf", 'R', "BYTES", 0, "Receive buffer size for both ends", 3},
+    {"congestion", 'C', "ALGO", 0, "TCP congestion control algorithm for both ends", 3},
+    {"notsent-lowat", 'w', "BYTES", 0, "TCP_NOTSENT_LOWAT for the client socket", 3},
+    {"fastopen", 'F', 0, 0, "Send the Hello in the SYN with TCP Fast Open", 4},
+    {"connect-test", 'x', "NUM", 0, "Open NUM connections in a row and report connections/sec and setup latency. With --fastopen, compare against a regular connect", 4},
+    {"sweep", 'W', 0, 0, "Ramp up the probe rate for each payload size to find where latency inflates or goodput flattens", 5},
+    {"concurrency", 'N', "NUM", 0, "Spread the sweep's probes over NUM connections (defaults to 1), or measure NUM mesh targets at a time (defaults to 32)", 5},
+    {"slo", 'O', "MS", 0, "p99 RTT the sweep's max sustainable load must stay within", 5},
+    {"targets", 'G', "LIST", 0, "Measure the RTT of all targets at once instead of a single server. LIST is ADDR:PORT[,ADDR:PORT...] or @FILE with one per line", 6},
+    {"jitter", 'J', "MS", 0, "Delay each mesh target's start and probes by a random time up to MS, so they don't go out in bursts. Defaults to 0.", 6},
+    {"seed", 'E', "NUM", 0, "Seed of the mesh jitter, to repeat a run's timing. Defaults to one drawn from the time, which is printed", 6},
+    {"daemon", 'D', "SEC", 0, "Run until killed, keeping a session open to each target and sending it n_probes probes every SEC seconds", 7},
+    {"summary", 'Y', "SEC", 0, "How often daemon mode writes its summary. Defaults to 60.", 7},
+    {"window", 'K', "NUM", 0, "Daemon summaries cover the last NUM summary periods. Defaults to 5.", 7},
+    {"output", 'o', "FILE", 0, "Append daemon, mesh or scenario summaries to FILE instead of printing them", 7},
+    {"results", 'r', "FILE", 0, "Append the RTT distribution of every rtt and thput run (each mesh target, each daemon summary period) to the results store FILE, see rtt-query", 8},
+    {"tag", 'g', "LABEL", 0, "Label stored with the results, e.g. a build or a path, to tell runs apart", 8},
+    {"scenario", 'X', "FILE", 0, "Run the test matrices described in FILE and print a row per scenario (to --output if given). See the scenario file format in design/specs.md", 9},
+    {"aggregator", 'z', "ADDR:PORT", 0, "Submit the RTT histogram and counters of every rtt and thput run (each mesh target, each daemon summary period) to the aggregator at ADDR:PORT, or at the unix socket path given instead", 8},
     {0}
 };
 
@@ -60,6 +171,35 @@ static void state_bye();
 static void state_wait_bye_resp();
 static void state_close();
 
+static void measure_echo();
+static double relative_error(moments *m, histogram *h, double *estimate, double *half_width);
+static char adaptive_done(moments *m, histogram *h, uint64_t time_start, unsigned int n_done);
+static void print_precision(moments *m, histogram *h, unsigned int n_done);
+static void print_jitter(jitter_tracker *t, jitter_stats *s);
+static char warmup_done(unsigned int n_sent, uint64_t time_start, uint32_t *last_cwnd, unsigned int *n_stable);
+static void measure_stream(char transmit, char receive);
+static void print_goodput(msg_closing *closing);
+static void print_cpu_cost(msg_closing *closing);
+static void print_usage_row(const char *end, struct prof_usage *usage, uint64_t bytes);
+static void print_low_latency_gain();
+static void print_hist_comparison(const char *title, const char *label_a, histogram *a, const char *label_b, histogram *b);
+static int new_socket();
+static int open_connection(int fd, const char *hello_str, size_t hello_len);
+static void run_connect_test();
+static int connect_cycle(char fastopen, uint64_t *setup_ns);
+static void print_tuning();
+static void run_preflight();
+static void run_sweep();
+static void run_mesh();
+static void run_daemon();
+static void run_scenarios();
+static void on_scenario_run(const struct scenario *sc, const struct mesh_target *target, const histogram *rtt,
+    unsigned int echoed, double thput_bps, void *ctx);
+static void lone_target();
+static void store_run(struct sockaddr_in *addr, histogram *h, unsigned int n_probes, size_t payload_size, double thput_bps,
+    enum measure_types measure_type, unsigned int server_delay);
+static void submit_run(struct sockaddr_in *addr, histogram *h, unsigned int n_probes, size_t payload_size);
+
 static void handle_terminate(int sig);
 
 static error_t arg_parser(int key, char *arg, struct argp_state *state);
@@ -69,6 +209,26 @@ static void parse_payload_size(const char *arg, struct client_config *config);
 static void parse_server_addr(const char *arg, struct client_config *config);
 static void parse_server_port(const char *arg, struct client_config *config);
 static void parse_server_delay(const char *arg, struct client_config *config);
+static void parse_cpu(const char *arg, struct client_config *config);
+static void parse_buf_size(const char *arg, int *dest);
+static void parse_connect_test(const char *arg, struct client_config *config);
+static void parse_congestion(const char *arg, struct client_config *config);
+static void parse_log_level(const char *arg, struct client_config *config);
+static void parse_adaptive(const char *arg, struct client_config *config);
+static void parse_estimate(const char *arg, struct client_config *config);
+static void parse_max_probes(const char *arg, struct client_config *config);
+static void parse_max_time(const char *arg, struct client_config *config);
+static void parse_warmup(const char *arg, struct client_config *config);
+static void parse_concurrency(const char *arg, struct client_config *config);
+static void parse_slo(const char *arg, struct client_config *config);
+static void parse_targets(const char *arg, struct client_config *config);
+static void parse_jitter(const char *arg, struct client_config *config);
+static void parse_seed(const char *arg, struct client_config *config);
+static void parse_daemon(const char *arg, struct client_config *config);
+static void parse_summary(const char *arg, struct client_config *config);
+static void parse_window(const char *arg, struct client_config *config);
+static void parse_output(const char *arg, struct client_config *config);
+static void parse_aggregator(const char *arg, struct client_config *config);
 
 
 
@@ -79,29 +239,143 @@ static int sock;
 static char recv_buf[RECV_BUF_SIZE];
 static msg_hello hello_message;
 static int curr_payload_size_idx;
+static enum measure_passes current_pass;
+static histogram rtt_hist;
+static histogram baseline_rtt_hist;
+static jitter_stats rtt_jitter;
+static msg_ready ready_message;
+static struct stream_counters stream_counters;
+static struct prof_report prof_report;
+static struct prof_probe prof_probe;
+static struct prof_usage measure_usage;
+static uint64_t measure_bytes;
+static unsigned long measure_probes;
+static struct store results;
+static struct agg_client aggregator;
+static struct agg_snapshot snapshot;
 
 int main(int argc, char **argv) {
     config.n_probes = 20;
+    config.adaptive_rel = 0;
+    config.ci_percentile = 0;
+    config.max_probes = ADAPTIVE_MAX_PROBES;
+    config.max_sec = ADAPTIVE_MAX_SEC;
+    config.warmup = WARMUP_NONE;
     config.server_delay = 0;
     config.measure_type = MEASURE_RTT;
     config.payload_sizes = default_payload_size_rtt;
     config.n_sizes = sizeof default_payload_size_rtt / sizeof default_payload_size_rtt[0];
-    config.quiet = 0;
+    config.log_level = LOG_INFO;
+    config.low_latency = 0;
+    config.cpu = -1;
+    config.mlock = 0;
+    config.profile = 0;
+    config.fastopen = 0;
+    config.connect_test = 0;
+    config.sweep = 0;
+    config.concurrency = 0;
+    config.slo_ms = 0;
+    config.targets = NULL;
+    config.n_targets = 0;
+    config.jitter_ms = 0;
+    config.seed = time(NULL) ^ getpid();
+    config.daemon_sec = 0;
+    config.summary_sec = 60;
+    config.window = 5;
+    config.output = stdout;
+    config.results_path = NULL;
+    config.tag = NULL;
+    config.aggregator = NULL;
+    config.scenario_path = NULL;
+    config.auto_tune = 0;
+    config.has_tuning = 0;
+    bzero(&(config.tuning), sizeof(struct sock_tuning));
 
     bzero(&(config.server_addr), sizeof(struct sockaddr_in));
     config.server_addr.sin_family = AF_INET;
     curr_payload_size_idx = 0;
 
+    if (!log_init(config.log_level)) {
+        exit(1);
+    }
+
     if (argp_parse(&argp, argc, argv, 0, 0, &config) != 0) {
-        fprintf(stderr, "Some error occurred while parsing arguments\n");
+        log_error("Some error occurred while parsing arguments");
+        exit(1);
+    }
+
+    log_set_level(config.log_level);
+
+    if (config.cpu >= 0 && !tune_pin_cpu(config.cpu)) {
+        exit(1);
+    }
+
+    if (config.mlock && !tune_mlock()) {
+        exit(1);
+    }
+
+    if (config.profile) {
+        prof_init();
+    }
+
+    if (config.adaptive_rel > 0 && config.measure_type != MEASURE_RTT && config.measure_type != MEASURE_THPUT) {
+        log_error("Adaptive probe count only applies to rtt and thput");
+        exit(1);
+    }
+
+    if (config.warmup != WARMUP_NONE && config.measure_type != MEASURE_RTT && config.measure_type != MEASURE_THPUT) {
+        log_error("Warm-up only applies to rtt and thput");
+        exit(1);
+    }
+
+    if ((config.n_targets > 0 || config.daemon_sec > 0)
+        && config.measure_type != MEASURE_RTT && config.measure_type != MEASURE_THPUT
+    ) {
+        log_error("Mesh and daemon measures only apply to rtt and thput");
+        exit(1);
+    }
+
+    if (config.results_path != NULL && !store_open(&results, config.results_path, 1)) {
         exit(1);
     }
 
+    if (config.auto_tune) {
+        run_preflight();
+    }
+
     signal(SIGINT, handle_terminate);
 
+    if (config.connect_test > 0) {
+        run_connect_test();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (config.sweep) {
+        run_sweep();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (config.scenario_path != NULL) {
+        run_scenarios();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (config.daemon_sec > 0) {
+        run_daemon();
+        exit(1);
+    }
+
+    if (config.n_targets > 0) {
+        run_mesh();
+        exit(EXIT_SUCCESS);
+    }
+
     current_state = STATE_HELLO;
+    current_pass = PASS_BLOCKING;
 
     while(1) {
+        TRACE2(client_state, current_state, config.payload_sizes[curr_payload_size_idx]);
+
         switch (current_state) {
             case STATE_HELLO        : state_hello(); break;
             case STATE_MEASURE      : state_measure(); break;
@@ -115,74 +389,126 @@ int main(int argc, char **argv) {
 }
 
 static void state_hello() {
-    struct timeval timeout;
     char addr_str[INET_ADDRSTRLEN];
     size_t msg_str_len;
     char msg_str[MAX_SIZE_HELLO];
+    uint64_t time_start, time_connected, time_hello_sent, time_ready;
+    struct path_info path;
 
     hello_message.protocol_phase = PHASE_HELLO;
     hello_message.measure_type = config.measure_type;
-    hello_message.n_probes = config.n_probes;
+    // In adaptive mode or with a warm-up of unknown length the server is told
+    // the budget, we may say Bye earlier
+    hello_message.n_probes = config.adaptive_rel > 0 ? config.max_probes : config.n_probes;
+    switch (config.warmup) {
+        case WARMUP_PROBES: hello_message.n_probes += config.warmup_probes; break;
+        case WARMUP_TIME  :
+        case WARMUP_AUTO  : hello_message.n_probes += WARMUP_MAX_PROBES; break;
+        default           : break;
+    }
     hello_message.msg_size = config.payload_sizes[curr_payload_size_idx];
     hello_message.server_delay = config.server_delay;
+    hello_message.has_tuning = config.has_tuning;
+    hello_message.tuning = config.tuning;
+    hello_message.wants_usage = 1;
 
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-    // Timeout recv operations after SOCK_TIMEOUT_SEC seconds
-    timeout.tv_usec = 0;
-    timeout.tv_sec = SOCK_TIMEOUT_SEC;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Cannot set socket options");
-        current_state = STATE_CLOSE;
-        return;
-    }
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Cannot set socket options");
+    if (!hello_to_string(&hello_message, msg_str, &msg_str_len)) {
+        log_error("Cannot serialize Hello message");
         current_state = STATE_CLOSE;
         return;
     }
 
+    sock = new_socket();
     if (sock == -1) {
-        perror("Cannot create socket");
         exit(errno);
     }
 
-    if (connect(sock, &(config.server_addr), sizeof(config.server_addr)) == -1) {
-        perror("Cannot connect host");
+    time_start = now_ns();
+
+    if (!open_connection(sock, msg_str, msg_str_len)) {
         exit(errno);
     }
 
+    time_connected = now_ns();
+
     inet_ntop(AF_INET, &(config.server_addr.sin_addr), addr_str, INET_ADDRSTRLEN);
-    printf("Connected to %s on port %d\n", addr_str, config.server_addr.sin_port);
+    log_info("Connected to %s on port %d", addr_str, config.server_addr.sin_port);
 
-    if (!hello_to_string(&hello_message, msg_str, &msg_str_len)) {
-        fprintf(stderr, "Cannot serialize Hello message");
-        current_state = STATE_CLOSE;
-        return;
+    if (current_pass == PASS_BUSY_POLL) {
+        if (!tune_low_latency(sock)) {
+            current_state = STATE_CLOSE;
+            return;
+        }
+        log_info("Busy polling enabled");
     }
+    set_recv_spin(current_pass == PASS_BUSY_POLL, SOCK_TIMEOUT_SEC);
 
-    printf("Sending hello message. (%lu bytes)\n", msg_str_len);
-    if (!config.quiet) print_send(msg_str);
-    send(sock, msg_str, msg_str_len, 0);
+    if (config.fastopen) {
+        log_info("Hello sent with the SYN. (%lu bytes)", msg_str_len);
+        log_debug(">> %s", msg_str);
+        time_hello_sent = time_start;
+    } else {
+        log_info("Sending hello message. (%lu bytes)", msg_str_len);
+        log_debug(">> %s", msg_str);
+        time_hello_sent = now_ns();
+        sock_send(sock, msg_str, msg_str_len);
+    }
 
-    if (recv(sock, recv_buf, RECV_BUF_SIZE, 0) == -1) {
-        perror("Error occurred while waiting for Hello response");
+    if (recv_response(sock, recv_buf, RECV_BUF_SIZE) == -1) {
+        log_perror("Error occurred while waiting for Hello response");
         current_state = STATE_CLOSE;
         return;
     }
 
-    if (!config.quiet) print_recv(recv_buf);
+    time_ready = now_ns();
+
+    log_debug("<< %s", recv_buf);
 
-    if (!response_is(recv_buf, RESP_READY)) {
-        fprintf(stderr, "Invalid response");
+    if (!ready_from_string(recv_buf, &ready_message)) {
+        log_error("Invalid response");
         current_state = STATE_CLOSE;
         return;
     }
 
+    log_flush();
+
+    if (config.fastopen) {
+        tune_path_info(sock, &path);
+        printf("Connect + Hello = %.6f ms (Hello in SYN: %s)\n",
+            (time_ready - time_start) / 1000000.0, path.syn_data ? "yes" : "no");
+    } else {
+        printf("Handshake = %.6f ms, Hello RTT = %.6f ms\n",
+            (time_connected - time_start) / 1000000.0, (time_ready - time_hello_sent) / 1000000.0);
+    }
+
+    fflush(stdout);
+
     current_state = STATE_MEASURE;
 }
 
 static void state_measure() {
+    struct prof_usage usage_start;
+
+    log_info("Starting measure. measure_type=%s n_probes=%d msg_size=%lu server_delay=%d",
+        measure_types_strings[hello_message.measure_type], hello_message.n_probes,
+        hello_message.msg_size, hello_message.server_delay);
+
+    memset(&measure_usage, 0, sizeof(struct prof_usage));
+    measure_bytes = 0;
+    measure_probes = 0;
+    prof_usage_read(&usage_start);
+
+    switch (hello_message.measure_type) {
+        case MEASURE_SINK  : measure_stream(1, 0); break;
+        case MEASURE_SOURCE: measure_stream(0, 1); break;
+        case MEASURE_BIDIR : measure_stream(1, 1); break;
+        default            : measure_echo();
+    }
+
+    prof_usage_add_since(&measure_usage, &usage_start);
+}
+
+static void measure_echo() {
     char *payload;
     msg_probe probe, echoed_probe;
     char probe_str[MAX_SIZE_PROBE];
@@ -190,14 +516,24 @@ static void state_measure() {
     char probe_buf[RECV_BUF_SIZE];
     ssize_t echoed_probe_size = 0;
     size_t recv_idx = 0;
-    struct timeval time_before, time_after;
+    uint64_t time_before, time_after;
     double curr_rtt, rtt_sum = 0, rtt_min = DBL_MAX, rtt_max = 0;
-    double avg_rtt_sec, probe_kbits;
-
-    printf("Starting measure. measure_type=%s n_probes=%d msg_size=%lu server_delay=%d\n",
-        measure_types_strings[hello_message.measure_type], hello_message.n_probes,
-        hello_message.msg_size, hello_message.server_delay);
-
+    struct prof_sample prof_start;
+    moments rtt_moments;
+    jitter_tracker tracker;
+    unsigned int n_done = 0, n_warmup = 0, n_stable = 0;
+    uint32_t last_cwnd = 0;
+    char warming = config.warmup != WARMUP_NONE;
+    unsigned short next_state = STATE_CLOSE;
+    uint64_t time_start = now_ns(), measure_start = time_start, measure_end = time_start;
+    uint64_t measured_bytes = 0;
+
+    hist_init(&rtt_hist);
+    moments_init(&rtt_moments);
+    jitter_tracker_init(&tracker);
+    jitter_stats_init(&rtt_jitter);
+    prof_report_init(&prof_report);
+    memset(&prof_probe, 0, sizeof(struct prof_probe));
     payload = new_payload(hello_message.msg_size);
     probe.protocol_phase = PHASE_MEASURE;
     probe.payload = payload;
@@ -205,73 +541,292 @@ static void state_measure() {
     for (unsigned int i = 1; i <= hello_message.n_probes; i++) {
         probe.probe_seq_num = i;
 
+        // Throughput is timed from the first measured probe leaving
+        if (i == n_warmup + 1) {
+            measure_start = now_ns();
+        }
+
+        if (config.profile) prof_read(&prof_start);
+
         if (!probe_to_string(&probe, probe_str, &probe_str_len)) {
-            fprintf(stderr, "Cannot serialize probe");
-            free(payload);
-            current_state = STATE_CLOSE;
-            return;
+            log_error("Cannot serialize probe");
+            goto done;
         }
 
         #ifdef DEBUG
-        print_send(probe_str);
+        log_debug(">> %s", probe_str);
         #endif
 
-        send(sock, probe_str, probe_str_len, 0);
-        gettimeofday(&time_before, NULL);
+        sock_send(sock, probe_str, probe_str_len);
+        time_before = now_ns();
+        TRACE3(probe_sent, probe.probe_seq_num, probe_str_len, time_before);
 
-        if (!config.quiet) {
-            printf("Sent probe seq %d / %d (%lu bytes) ... ", probe.probe_seq_num, hello_message.n_probes, probe_str_len);
-            fflush(stdout);
-        }
+        // Reading the counters is a syscall, on one CPU the echo may well be
+        // handled meanwhile so it must come after taking the time
+        if (config.profile) prof_since(&prof_start, &prof_probe, PROF_SEND);
 
         // Wait and check echoed probe
         echoed_probe_size = recv_until(sock, recv_buf, RECV_BUF_SIZE, &recv_idx, probe_buf, RECV_BUF_SIZE, '\n');
-        gettimeofday(&time_after, NULL);
+        time_after = now_ns();
+        if (config.profile) prof_since(&prof_start, &prof_probe, PROF_RECV);
 
         if (echoed_probe_size == -1) {
-            perror("Receive error");
-            free(payload);
-            current_state = STATE_CLOSE;
-            return;
+            log_perror("Receive error");
+            goto done;
         }
 
         if (echoed_probe_size == -2) {
-            fprintf(stderr, "Probe buffer too small\n");
-            free(payload);
-            current_state = STATE_CLOSE;
-            return;
+            log_error("Probe buffer too small");
+            goto done;
         }
 
+        TRACE3(probe_received, probe.probe_seq_num, echoed_probe_size, time_after);
+
         #ifdef DEBUG
-        print_recv(probe_buf);
+        log_debug("<< %s", probe_buf);
         #endif
 
         if (!probe_from_string(probe_buf, &echoed_probe)
             || !is_valid_probe(&echoed_probe, probe.probe_seq_num)
         ) {
-            fprintf(stderr, "Received invalid echoed probe\n");
-            free(payload);
-            current_state = STATE_CLOSE;
-            return;
+            log_error("Received invalid echoed probe");
+            goto done;
         }
 
-        curr_rtt = get_diff_ms(&time_before, &time_after);
+        TRACE2(probe_validated, probe.probe_seq_num, time_after - time_before);
+
+        // Warm-up included, CPU time is taken over the whole phase
+        measure_bytes += probe_str_len + echoed_probe_size;
+        measure_probes += 1;
+
+        if (warming) {
+            log_debug("Warm-up probe seq %d (%lu bytes) ... RTT = %.6f ms",
+                probe.probe_seq_num, probe_str_len, (time_after - time_before) / 1000000.0);
+
+            if (warmup_done(i, time_start, &last_cwnd, &n_stable)) {
+                warming = 0;
+                n_warmup = i;
+                log_info("Warm-up over after %u probes, %.3f ms", n_warmup, (time_after - time_start) / 1000000.0);
+            }
+            continue;
+        }
+
+        if (config.profile) {
+            prof_since(&prof_start, &prof_probe, PROF_PARSE);
+            prof_record(&prof_report, &prof_probe);
+        }
+
+        hist_record(&rtt_hist, time_after - time_before);
+        jitter_record(&tracker, &rtt_jitter, time_after - time_before);
+        curr_rtt = (time_after - time_before) / 1000000.0;
         rtt_sum += curr_rtt;
         rtt_min = double_min(rtt_min, curr_rtt);
         rtt_max = double_max(rtt_max, curr_rtt);
 
-        if (!config.quiet) printf("RTT = %.6f ms\n", curr_rtt);
+        log_debug("Sent probe seq %d / %d (%lu bytes) ... RTT = %.6f ms",
+            probe.probe_seq_num, hello_message.n_probes, probe_str_len, curr_rtt);
+
+        n_done = i - n_warmup;
+        moments_add(&rtt_moments, curr_rtt);
+        measured_bytes += echoed_probe_size;
+        measure_end = time_after;
+
+        if (n_done == (unsigned int)config.n_probes && config.adaptive_rel == 0) {
+            break;
+        }
+
+        if (config.adaptive_rel > 0 && adaptive_done(&rtt_moments, &rtt_hist, measure_start, n_done)) {
+            break;
+        }
+    }
+
+    if (n_done == 0) {
+        log_error("Warm-up never ended, nothing measured");
+        goto done;
+    }
+
+    // Results go to stdout directly, the log may drop messages
+    log_flush();
+    printf("\nRTT min / max / avg = %.6f / %.6f / %.6f ms\n", rtt_min, rtt_max, rtt_sum / n_done);
+    print_jitter(&tracker, &rtt_jitter);
+
+    if (config.adaptive_rel > 0) {
+        print_precision(&rtt_moments, &rtt_hist, n_done);
+    }
+
+    if (config.results_path != NULL) {
+        store_run(&(config.server_addr), &rtt_hist, n_done, hello_message.msg_size,
+            hello_message.measure_type == MEASURE_THPUT
+            ? measured_bytes * 8 / ((measure_end - measure_start) / 1000000000.0) : 0,
+            config.measure_type, config.server_delay);
     }
 
-    printf("\nRTT min / max / avg = %.6f / %.6f / %.6f ms\n\n", rtt_min, rtt_max, rtt_sum / hello_message.n_probes);
+    if (config.aggregator != NULL) {
+        submit_run(&(config.server_addr), &rtt_hist, n_done, hello_message.msg_size);
+    }
 
     if (hello_message.measure_type == MEASURE_THPUT) {
-        avg_rtt_sec = rtt_sum / hello_message.n_probes / 1000.0;
-        probe_kbits = echoed_probe_size * 8 / 1000.0;
-        printf("THROUGHPUT = %.3f kbits/sec\n", probe_kbits / avg_rtt_sec);
+        printf("THROUGHPUT = %.3f kbits/sec (%lu bytes echoed in %.6f ms)\n",
+            measured_bytes * 8 / 1000.0 / ((measure_end - measure_start) / 1000000000.0),
+            measured_bytes, (measure_end - measure_start) / 1000000.0);
+
+        // Throughput is the inverse of the mean RTT, so is its relative error to first order
+        if (config.adaptive_rel > 0 && config.ci_percentile == 0) {
+            printf("THROUGHPUT +/- %.2f%% (95%% CI)\n", moments_ci(&rtt_moments, CI_Z) / rtt_moments.mean * 100);
+        }
+    }
+
+    if (config.has_tuning) {
+        print_tuning();
+    }
+
+    if (config.profile) {
+        prof_print(&prof_report, "");
+        printf("\n");
     }
 
+    if (config.low_latency) {
+        if (current_pass == PASS_BLOCKING) {
+            baseline_rtt_hist = rtt_hist;
+        } else {
+            print_low_latency_gain();
+        }
+    }
+
+    fflush(stdout);
+    next_state = STATE_BYE;
+
+done:
+    // On every way out, the profile's histograms are allocated as probes are recorded
+    prof_report_free(&prof_report);
     free(payload);
+    current_state = next_state;
+}
+
+/**
+ * Relative half width of the confidence interval of the estimate adaptive mode
+ * is after. Through the mean RTT it's also the one of the throughput.
+ */
+static double relative_error(moments *m, histogram *h, double *estimate, double *half_width) {
+    uint64_t lower, upper;
+
+    if (config.ci_percentile == 0) {
+        *estimate = m->mean;
+        *half_width = moments_ci(m, CI_Z);
+    } else {
+        *estimate = hist_percentile(h, config.ci_percentile) / 1000000.0;
+        *half_width = hist_percentile_ci(h, config.ci_percentile, CI_Z, &lower, &upper)
+            ? (upper - lower) / 2000000.0 : INFINITY;
+    }
+
+    return *estimate > 0 ? *half_width / *estimate : INFINITY;
+}
+
+/**
+ * Adaptive mode stops once the estimate is precise enough or a budget runs out
+ */
+static char adaptive_done(moments *m, histogram *h, uint64_t time_start, unsigned int n_done) {
+    double estimate, half_width;
+
+    if (n_done >= (unsigned int)config.max_probes || now_ns() - time_start >= (uint64_t)config.max_sec * 1000000000) {
+        return 1;
+    }
+
+    return n_done >= ADAPTIVE_MIN_PROBES && relative_error(m, h, &estimate, &half_width) <= config.adaptive_rel;
+}
+
+static void print_precision(moments *m, histogram *h, unsigned int n_done) {
+    double estimate, half_width, rel;
+    char stat[16];
+
+    rel = relative_error(m, h, &estimate, &half_width);
+
+    if (config.ci_percentile == 0) {
+        snprintf(stat, sizeof(stat), "mean");
+    } else {
+        snprintf(stat, sizeof(stat), "p%g", config.ci_percentile);
+    }
+
+    printf("Stopped after %u probes, %s\n", n_done,
+        rel <= config.adaptive_rel ? "precision reached"
+        : n_done >= (unsigned int)config.max_probes ? "probe budget exhausted" : "time budget exhausted");
+    printf("RTT %s = %.6f ms +/- %.6f ms (+/- %.2f%%, 95%% CI, target +/- %.2f%%)\n\n", stat,
+        estimate, half_width, rel * 100, config.adaptive_rel * 100);
+}
+
+/**
+ * Over a TCP session probes are echoed in order or not at all, so there
+ * are no loss runs to report
+ */
+static void print_jitter(jitter_tracker *t, jitter_stats *s) {
+    histogram *ipdv = &(s->ipdv);
+
+    printf("RTT stddev = %.6f ms, jitter (RFC 3550) = %.6f ms\n", sqrt(moments_variance(&(s->delay))) / 1000000.0,
+        t->jitter / 1000000.0);
+
+    if (ipdv->count > 0) {
+        printf("IPDV p50 / p90 / p99 / max = %.6f / %.6f / %.6f / %.6f ms\n",
+            hist_percentile(ipdv, 50) / 1000000.0, hist_percentile(ipdv, 90) / 1000000.0,
+            hist_percentile(ipdv, 99) / 1000000.0, ipdv->max / 1000000.0);
+    }
+
+    printf("\n");
+}
+
+/**
+ * Whether the warm-up is over after N_SENT probes echoed since TIME_START.
+ * In auto mode the congestion window seen last and for how many probes it
+ * stayed the same are kept in LAST_CWND and N_STABLE.
+ */
+static char warmup_done(unsigned int n_sent, uint64_t time_start, uint32_t *last_cwnd, unsigned int *n_stable) {
+    struct path_info path;
+
+    switch (config.warmup) {
+        case WARMUP_PROBES:
+            return n_sent >= config.warmup_probes;
+
+        case WARMUP_TIME:
+            return n_sent >= WARMUP_MAX_PROBES || now_ns() - time_start >= config.warmup_ns;
+
+        case WARMUP_AUTO:
+            if (n_sent >= WARMUP_MAX_PROBES || now_ns() - time_start >= (uint64_t)WARMUP_AUTO_MAX_SEC * 1000000000) {
+                log_warn("Congestion window still changing, warm-up stopped");
+                return 1;
+            }
+
+            if (!tune_path_info(sock, &path)) {
+                log_warn("TCP_INFO not available, warm-up stopped");
+                return 1;
+            }
+
+            *n_stable = path.snd_cwnd == *last_cwnd ? *n_stable + 1 : 0;
+            *last_cwnd = path.snd_cwnd;
+            return *n_stable >= WARMUP_CWND_STABLE;
+
+        default:
+            return 1;
+    }
+}
+
+/**
+ * One-directional (or both at once) transfer with no echo.
+ * Goodput is computed when the server reports its own counters at Bye.
+ */
+static void measure_stream(char transmit, char receive) {
+    size_t leftover_len;
+
+    // Nagle would hold back the tail of every probe waiting for an ACK
+    tune_nodelay(sock);
+
+    if (!stream_probes(sock, transmit, receive, hello_message.n_probes, hello_message.msg_size,
+            SOCK_TIMEOUT_SEC, &stream_counters, recv_buf, RECV_BUF_SIZE, &leftover_len)
+    ) {
+        current_state = STATE_CLOSE;
+        return;
+    }
+
+    measure_bytes = stream_counters.rx_bytes + stream_counters.tx_bytes;
+    measure_probes = (unsigned long)hello_message.n_probes * (transmit + receive);
     current_state = STATE_BYE;
 }
 
@@ -280,40 +835,59 @@ static void state_bye() {
     char bye_str[MAX_SIZE_BYE];
     size_t bye_str_len;
 
-    printf("Sending bye message\n");
+    log_info("Sending bye message");
 
     bye.protocol_phase = PHASE_BYE;
     bye_to_string(&bye, bye_str, &bye_str_len);
 
-    print_send(bye_str);
-    send(sock, bye_str, bye_str_len, 0);
+    log_debug(">> %s", bye_str);
+    sock_send(sock, bye_str, bye_str_len);
 
     current_state = STATE_WAIT_BYE_RESP;
 }
 
 static void state_wait_bye_resp() {
-    printf("Waiting bye response\n");
+    msg_closing closing;
 
-    if (recv(sock, recv_buf, RECV_BUF_SIZE, 0) == -1) {
+    log_info("Waiting bye response");
+
+    if (sock_recv(sock, recv_buf, RECV_BUF_SIZE, 0) == -1) {
         if (errno == ETIMEDOUT) {
-            printf(".");
+            log_info(".");
         } else {
-            perror("Receive error");
+            log_perror("Receive error");
             current_state = STATE_CLOSE;
             return;
         }
     }
 
-    print_recv(recv_buf);
+    log_debug("<< %s", recv_buf);
 
-    if (!response_is(recv_buf, RESP_CLOSING)) {
-        fprintf(stderr, "Invalid Bye response\n");
+    if (!closing_from_string(recv_buf, &closing)) {
+        log_error("Invalid Bye response");
         current_state = STATE_CLOSE;
         return;
     }
 
+    log_flush();
+
+    if (closing.has_counters) {
+        print_goodput(&closing);
+    }
+
+    print_cpu_cost(&closing);
+    fflush(stdout);
+
+    if (config.low_latency && current_pass == PASS_BLOCKING) {
+        current_pass = PASS_BUSY_POLL;
+        current_state = STATE_HELLO;
+        close(sock);
+        return;
+    }
+
     if (curr_payload_size_idx < config.n_sizes - 1) {
         curr_payload_size_idx += 1;
+        current_pass = PASS_BLOCKING;
         current_state = STATE_HELLO;
         close(sock);
         return;
@@ -323,15 +897,554 @@ static void state_wait_bye_resp() {
 }
 
 static void state_close() {
-    printf("Closing\n");
+    log_info("Closing");
     close(sock);
     exit(EXIT_SUCCESS);
 }
 
+static void print_goodput(msg_closing *closing) {
+    if (stream_counters.tx_bytes > 0) {
+        printf("\nUPSTREAM   client sent %lu bytes in %.3f ms, server received %lu bytes in %.3f ms\n",
+            stream_counters.tx_bytes, stream_tx_usec(&stream_counters) / 1000.0,
+            closing->rx_bytes, closing->rx_usec / 1000.0);
+
+        if (closing->rx_usec > 0) {
+            printf("UPSTREAM   GOODPUT = %.3f kbits/sec\n", closing->rx_bytes * 8.0 / closing->rx_usec * 1000);
+        }
+    }
+
+    if (stream_counters.rx_bytes > 0) {
+        printf("\nDOWNSTREAM server sent %lu bytes in %.3f ms, client received %lu bytes in %.3f ms\n",
+            closing->tx_bytes, closing->tx_usec / 1000.0,
+            stream_counters.rx_bytes, stream_rx_usec(&stream_counters) / 1000.0);
+
+        if (stream_rx_usec(&stream_counters) > 0) {
+            printf("DOWNSTREAM GOODPUT = %.3f kbits/sec\n",
+                stream_counters.rx_bytes * 8.0 / stream_rx_usec(&stream_counters) * 1000);
+        }
+    }
+
+    printf("\n");
+}
+
+/**
+ * CPU time the measurement phase took at each end, per payload gigabit moved
+ * and per probe. Each end moves the same bytes: probes are echoed, and streams
+ * are counted by both ends.
+ */
+static void print_cpu_cost(msg_closing *closing) {
+    uint64_t server_bytes = closing->has_counters ? closing->rx_bytes + closing->tx_bytes : measure_bytes;
+
+    if (measure_probes == 0) {
+        return;
+    }
+
+    printf("CPU COST  %10s %10s %10s %10s %10s %10s %12s %14s\n", "user ms", "sys ms", "vol cs", "invol cs",
+        "min flt", "maj flt", "CPU-s/Gbit", "probes/CPU-s");
+
+    print_usage_row("client", &measure_usage, measure_bytes);
+
+    // The server's figures are its thread's, only its own if no other session was measured meanwhile
+    if (closing->has_usage && closing->usage_sessions <= 1) {
+        print_usage_row("server", &(closing->usage), server_bytes);
+    } else if (closing->has_usage) {
+        print_usage_row("server", &(closing->usage), 0);
+        printf("Server figures are for its whole thread, shared with %lu other sessions\n", closing->usage_sessions - 1);
+    } else {
+        printf("%-9s (not reported)\n", "server");
+    }
+
+    printf("\n");
+}
+
+static void print_usage_row(const char *end, struct prof_usage *usage, uint64_t bytes) {
+    double cpu_sec = (usage->user_usec + usage->sys_usec) / 1000000.0;
+    char per_gbit[16] = "-", per_sec[16] = "-";
+
+    if (cpu_sec > 0 && bytes > 0) {
+        snprintf(per_gbit, sizeof(per_gbit), "%.4f", cpu_sec / (bytes * 8 / 1e9));
+        snprintf(per_sec, sizeof(per_sec), "%.0f", measure_probes / cpu_sec);
+    }
+
+    printf("%-9s %10.3f %10.3f %10lu %10lu %10lu %10lu %12s %14s\n", end, usage->user_usec / 1000.0,
+        usage->sys_usec / 1000.0, usage->vcsw, usage->ivcsw, usage->minflt, usage->majflt, per_gbit, per_sec);
+}
+
+static void print_low_latency_gain() {
+    print_hist_comparison("Low-latency gain over blocking path (ms)",
+        "blocking", &baseline_rtt_hist, "busy-poll", &rtt_hist);
+}
+
+/**
+ * Print distributions A and B side by side, along with how much B removed from A
+ */
+static void print_hist_comparison(const char *title, const char *label_a, histogram *a, const char *label_b, histogram *b) {
+    const char *labels[] = {"min", "p50", "p90", "p99", "max"};
+    const double percentiles[] = {0, 50, 90, 99, 100};
+    double value_a, value_b;
+
+    printf("%s:\n", title);
+    printf("     %11s %11s     removed\n", label_a, label_b);
+
+    for (unsigned int i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++) {
+        value_a = hist_percentile(a, percentiles[i]) / 1000000.0;
+        value_b = hist_percentile(b, percentiles[i]) / 1000000.0;
+
+        printf("  %-4s %11.6f %11.6f %11.6f (%5.1f%%)\n", labels[i], value_a, value_b,
+            value_a - value_b, value_a > 0 ? 100 * (value_a - value_b) / value_a : 0);
+    }
+
+    value_a = hist_mean(a) / 1000000.0;
+    value_b = hist_mean(b) / 1000000.0;
+    printf("  %-4s %11.6f %11.6f %11.6f (%5.1f%%)\n\n", "avg", value_a, value_b,
+        value_a - value_b, value_a > 0 ? 100 * (value_a - value_b) / value_a : 0);
+}
+
+/**
+ * Create a client socket with timeouts and the configured tuning applied
+ */
+static int new_socket() {
+    int fd;
+    struct timeval timeout;
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (fd == -1) {
+        log_perror("Cannot create socket");
+        return -1;
+    }
+
+    // Timeout recv operations after SOCK_TIMEOUT_SEC seconds
+    timeout.tv_usec = 0;
+    timeout.tv_sec = SOCK_TIMEOUT_SEC;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1
+        || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1
+    ) {
+        log_perror("Cannot set socket options");
+        close(fd);
+        return -1;
+    }
+
+    // Buffer sizes need to be known before the handshake to get the right window scale
+    if (config.has_tuning && !tune_apply(fd, &(config.tuning))) {
+        log_error("Some socket options could not be applied");
+    }
+
+    return fd;
+}
+
+/**
+ * Connect FD to the server.
+ * With TCP Fast Open the Hello is sent along with the SYN, otherwise
+ * the caller has to send it once connected.
+ */
+static int open_connection(int fd, const char *hello_str, size_t hello_len) {
+    if (!config.fastopen) {
+        if (connect(fd, (struct sockaddr *)&(config.server_addr), sizeof(config.server_addr)) == -1) {
+            log_perror("Cannot connect host");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (sendto(fd, hello_str, hello_len, MSG_FASTOPEN,
+            (struct sockaddr *)&(config.server_addr), sizeof(config.server_addr)) == -1
+    ) {
+        log_perror("Cannot connect host with TCP Fast Open (check net.ipv4.tcp_fastopen)");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Open and close CONNECT_TEST connections in a row, each one doing
+ * handshake, Hello with no probes and Bye, and report setup latency.
+ * With TCP Fast Open the run is repeated with it, to compare the two.
+ */
+static void run_connect_test() {
+    histogram setup_hist, regular_hist;
+    uint64_t setup_ns, time_start;
+    double elapsed_sec;
+    char fastopen = config.fastopen;
+
+    for (char pass_fastopen = 0; pass_fastopen <= fastopen; pass_fastopen++) {
+        config.fastopen = pass_fastopen;
+        hist_init(&setup_hist);
+
+        log_info("Opening %d connections%s", config.connect_test, pass_fastopen ? " with TCP Fast Open" : "");
+        time_start = now_ns();
+
+        for (int i = 0; i < config.connect_test; i++) {
+            if (!connect_cycle(pass_fastopen, &setup_ns)) {
+                exit(1);
+            }
+            hist_record(&setup_hist, setup_ns);
+        }
+
+        elapsed_sec = (now_ns() - time_start) / 1000000000.0;
+
+        log_flush();
+        printf("%s: %.1f connections/sec\n", pass_fastopen ? "TFO" : "Regular", config.connect_test / elapsed_sec);
+        printf("Setup latency min / p50 / p90 / p99 / max = %.6f / %.6f / %.6f / %.6f / %.6f ms\n\n",
+            hist_percentile(&setup_hist, 0) / 1000000.0,
+            hist_percentile(&setup_hist, 50) / 1000000.0,
+            hist_percentile(&setup_hist, 90) / 1000000.0,
+            hist_percentile(&setup_hist, 99) / 1000000.0,
+            hist_percentile(&setup_hist, 100) / 1000000.0);
+
+        if (pass_fastopen) {
+            print_hist_comparison("TCP Fast Open gain over regular connect (ms)",
+                "regular", &regular_hist, "tfo", &setup_hist);
+        } else {
+            regular_hist = setup_hist;
+        }
+
+        fflush(stdout);
+    }
+}
+
+/**
+ * A single connect test cycle. SETUP_NS is the time from connect() to the Ready response.
+ */
+static int connect_cycle(char fastopen, uint64_t *setup_ns) {
+    int fd;
+    msg_hello hello;
+    msg_bye bye;
+    char hello_str[MAX_SIZE_HELLO];
+    char bye_str[MAX_SIZE_BYE];
+    char response[MAX_SIZE_READY];
+    size_t hello_len, bye_len;
+    uint64_t time_start;
+    int ok = 0;
+
+    hello.protocol_phase = PHASE_HELLO;
+    hello.measure_type = config.measure_type;
+    hello.n_probes = 0;
+    hello.msg_size = 1;
+    hello.server_delay = 0;
+    hello.has_tuning = config.has_tuning;
+    hello.tuning = config.tuning;
+    hello.wants_usage = 0;
+    hello_to_string(&hello, hello_str, &hello_len);
+
+    bye.protocol_phase = PHASE_BYE;
+    bye_to_string(&bye, bye_str, &bye_len);
+
+    fd = new_socket();
+    if (fd == -1) {
+        return 0;
+    }
+
+    bzero(response, sizeof(response));
+    time_start = now_ns();
+
+    if (open_connection(fd, hello_str, hello_len)
+        && (fastopen || send(fd, hello_str, hello_len, 0) != -1)
+        && recv(fd, response, sizeof(response) - 1, 0) > 0
+    ) {
+        *setup_ns = now_ns() - time_start;
+        ok = response_is(response, RESP_READY);
+    }
+
+    if (!ok) {
+        log_error("Connection setup failed");
+        close(fd);
+        return 0;
+    }
+
+    bzero(response, sizeof(response));
+    if (send(fd, bye_str, bye_len, 0) == -1
+        || recv(fd, response, sizeof(response) - 1, 0) <= 0
+        || !response_is(response, RESP_CLOSING)
+    ) {
+        log_error("Connection teardown failed");
+        ok = 0;
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void print_tuning() {
+    struct sock_tuning local;
+
+    tune_effective(sock, &local);
+
+    if (!ready_message.has_tuning) {
+        printf("Socket settings  client: sndbuf=%d rcvbuf=%d cc=%s\n\n", local.sndbuf, local.rcvbuf, local.congestion);
+        return;
+    }
+
+    printf("Socket settings  client: sndbuf=%d rcvbuf=%d cc=%s  server: sndbuf=%d rcvbuf=%d cc=%s\n\n",
+        local.sndbuf, local.rcvbuf, local.congestion,
+        ready_message.tuning.sndbuf, ready_message.tuning.rcvbuf, ready_message.tuning.congestion);
+}
+
+static void run_preflight() {
+    struct preflight_result result;
+
+    log_info("Running pre-flight to estimate the bandwidth-delay product");
+
+    if (!preflight_run(&(config.server_addr), SOCK_TIMEOUT_SEC, &result)) {
+        log_error("Pre-flight failed, keeping default socket buffers");
+        return;
+    }
+
+    log_flush();
+    printf("Pre-flight: RTT = %.3f ms, rate up / down = %.3f / %.3f kbits/sec, BDP = %d bytes, buffers = %d bytes\n\n",
+        result.rtt_sec * 1000, result.rate_up * 8 / 1000, result.rate_down * 8 / 1000, result.bdp, result.buf_size);
+    fflush(stdout);
+
+    // Explicitly requested sizes win over the estimate
+    if (config.tuning.sndbuf == 0) config.tuning.sndbuf = result.buf_size;
+    if (config.tuning.rcvbuf == 0) config.tuning.rcvbuf = result.buf_size;
+}
+
+/**
+ * Find the saturation knee for each payload size
+ */
+static void run_sweep() {
+    struct sweep_config sweep_config;
+    struct sweep_result *result;
+
+    result = malloc(sizeof(struct sweep_result));
+
+    if (result == NULL) {
+        log_error("Cannot allocate sweep results");
+        exit(1);
+    }
+
+    sweep_config.server_addr = &(config.server_addr);
+    sweep_config.concurrency = config.concurrency > 0 ? config.concurrency : 1;
+    sweep_config.server_delay = config.server_delay;
+    sweep_config.slo_ns = config.slo_ms * 1000000;
+    sweep_config.timeout_sec = SOCK_TIMEOUT_SEC;
+    sweep_config.tuning = config.tuning;
+
+    for (int i = 0; i < config.n_sizes; i++) {
+        sweep_config.payload_size = config.payload_sizes[i];
+
+        log_info("Sweeping load with %lu bytes payload over %d connections",
+            sweep_config.payload_size, sweep_config.concurrency);
+
+        if (!sweep_run(&sweep_config, result)) {
+            log_error("Sweep failed");
+            exit(1);
+        }
+
+        log_flush();
+        printf("\nLatency / throughput curve, %lu bytes payload:\n", sweep_config.payload_size);
+        sweep_print(result);
+        fflush(stdout);
+    }
+
+    free(result);
+}
+
+static void run_mesh() {
+    struct mesh_config mesh_config;
+    struct mesh_result *results;
+    size_t max_size = 0;
+
+    results = malloc(config.n_targets * sizeof(struct mesh_result));
+
+    if (results == NULL) {
+        log_error("Cannot allocate mesh results");
+        exit(1);
+    }
+
+    mesh_config.targets = config.targets;
+    mesh_config.n_targets = config.n_targets;
+    mesh_config.n_probes = config.n_probes;
+    mesh_config.server_delay = config.server_delay;
+    mesh_config.params = NULL;
+    mesh_config.concurrency = config.concurrency > 0 ? config.concurrency : MESH_DEFAULT_CONCURRENCY;
+    mesh_config.jitter_ns = config.jitter_ms * 1000000;
+    mesh_config.seed = config.seed;
+    mesh_config.timeout_sec = SOCK_TIMEOUT_SEC;
+
+    if (mesh_config.concurrency > config.n_targets) {
+        mesh_config.concurrency = config.n_targets;
+    }
+
+    if (mesh_config.jitter_ns > 0) {
+        log_info("Jitter up to %.3f ms, seed %u", config.jitter_ms, config.seed);
+    }
+
+    for (int i = 0; i < config.n_sizes; i++) {
+        if (config.payload_sizes[i] > max_size) {
+            max_size = config.payload_sizes[i];
+        }
+    }
+
+    if (!mesh_init(mesh_config.concurrency, max_size)) {
+        exit(1);
+    }
+
+    for (int i = 0; i < config.n_sizes; i++) {
+        mesh_config.payload_size = config.payload_sizes[i];
+
+        log_info("Measuring %d targets with %lu bytes payload, %d at a time",
+            mesh_config.n_targets, mesh_config.payload_size, mesh_config.concurrency);
+
+        if (!mesh_run(&mesh_config, results)) {
+            log_error("Mesh measure failed");
+            exit(1);
+        }
+
+        log_flush();
+        fprintf(config.output, "\nRTT by target, %lu bytes payload:\n", mesh_config.payload_size);
+        mesh_print(&mesh_config, results, config.output);
+
+        for (int j = 0; j < config.n_targets; j++) {
+            if (results[j].rtt.count > 0 && config.results_path != NULL) {
+                store_run(&(config.targets[j].addr), &(results[j].rtt), results[j].echoed, mesh_config.payload_size, 0,
+                    config.measure_type, config.server_delay);
+            }
+            if (results[j].rtt.count > 0 && config.aggregator != NULL) {
+                submit_run(&(config.targets[j].addr), &(results[j].rtt), results[j].echoed, mesh_config.payload_size);
+            }
+        }
+    }
+
+    mesh_free();
+    free(results);
+}
+
+static void run_daemon() {
+    struct daemon_config daemon_config;
+
+    lone_target();
+
+    if (config.n_sizes > 1) {
+        log_warn("Daemon mode sends a single payload size, using %lu bytes", config.payload_sizes[0]);
+    }
+
+    daemon_config.targets = config.targets;
+    daemon_config.n_targets = config.n_targets;
+    daemon_config.payload_size = config.payload_sizes[0];
+    daemon_config.burst_probes = config.n_probes;
+    daemon_config.interval_ns = config.daemon_sec * 1000000000;
+    daemon_config.jitter_ns = config.jitter_ms * 1000000;
+    daemon_config.summary_ns = config.summary_sec * 1000000000;
+    daemon_config.window = config.window;
+    daemon_config.timeout_sec = SOCK_TIMEOUT_SEC;
+    daemon_config.output = config.output;
+    daemon_config.results = config.results_path != NULL ? &results : NULL;
+    daemon_config.tag = config.tag;
+    daemon_config.aggregator = config.aggregator != NULL ? &aggregator : NULL;
+
+    daemon_run(&daemon_config);
+    log_error("Daemon stopped");
+}
+
+static void run_scenarios() {
+    struct scenario_defaults defaults;
+    struct scenario_plan plan;
+
+    // Targets given on the command line are the default ones
+    if (config.server_addr.sin_port != 0) {
+        lone_target();
+    }
+
+    defaults.n_probes = config.n_probes;
+    defaults.server_delay = config.server_delay;
+    defaults.targets = config.targets;
+    defaults.n_targets = config.n_targets;
+
+    if (!scenario_parse(config.scenario_path, &defaults, &plan)) {
+        exit(1);
+    }
+
+    plan.timeout_sec = SOCK_TIMEOUT_SEC;
+
+    if (!scenario_run(&plan, on_scenario_run, NULL)) {
+        log_error("Scenario run failed");
+        exit(1);
+    }
+
+    scenario_print(&plan, config.output);
+    scenario_free(&plan);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_scenario_run(const struct scenario *sc, const struct mesh_target *target, const histogram *rtt,
+    unsigned int echoed, double thput_bps, void *ctx
+) {
+    struct sockaddr_in addr = target->addr;
+
+    if (config.results_path != NULL) {
+        store_run(&addr, (histogram *)rtt, echoed, sc->params.payload_size, thput_bps,
+            sc->params.measure_type, sc->params.server_delay);
+    }
+
+    if (config.aggregator != NULL) {
+        submit_run(&addr, (histogram *)rtt, echoed, sc->params.payload_size);
+    }
+}
+#pragma GCC diagnostic pop
+
+/**
+ * A lone server is a mesh of one
+ */
+static void lone_target() {
+    if (config.n_targets > 0) {
+        return;
+    }
+
+    config.targets = malloc(sizeof(struct mesh_target));
+
+    if (config.targets == NULL) {
+        log_error("Cannot allocate target");
+        exit(1);
+    }
+
+    config.targets[0].addr = config.server_addr;
+    snprintf(config.targets[0].name, MESH_NAME_SIZE, "%s:%d",
+        inet_ntoa(config.server_addr.sin_addr), ntohs(config.server_addr.sin_port));
+    config.n_targets = 1;
+}
+
+static void store_run(struct sockaddr_in *addr, histogram *h, unsigned int n_probes, size_t payload_size, double thput_bps,
+    enum measure_types measure_type, unsigned int server_delay
+) {
+    struct store_record rec;
+
+    store_init_record(&rec, addr, config.tag);
+    rec.measure_type = measure_type;
+    rec.n_probes = n_probes;
+    rec.payload_size = payload_size;
+    rec.server_delay = server_delay;
+    rec.thput_bps = thput_bps;
+    store_fill(&rec, h);
+
+    if (!store_append(&results, &rec)) {
+        log_warn("Results not stored");
+    }
+}
+
+/**
+ * Echoes come back over TCP, nothing is lost unless the session fails
+ */
+static void submit_run(struct sockaddr_in *addr, histogram *h, unsigned int n_probes, size_t payload_size) {
+    snapshot.addr = addr->sin_addr.s_addr;
+    snapshot.port = addr->sin_port;
+    snapshot.payload_size = payload_size;
+    snapshot.time_sec = time(NULL);
+    snapshot.sent = n_probes;
+    snapshot.lost = 0;
+    snapshot.hist = *h;
+
+    // A failure is logged by the aggregator client, a run is no worse without it
+    agg_submit(&aggregator, &snapshot);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 static void handle_terminate(int sig) {
-    printf("Interrupt caught. Exiting.\n");
+    log_info("Interrupt caught. Exiting.");
     close(sock);
     exit(EXIT_SUCCESS);
 }
@@ -345,7 +1458,38 @@ static error_t arg_parser(int key, char *arg, struct argp_state *state) {
         case 'n': parse_probe_num(arg, config); break;
         case 's': parse_payload_size(arg, config); break;
         case 'd': parse_server_delay(arg, config); break;
-        case 'q': config->quiet = 1; break;
+        case 'q': config->log_level = LOG_WARN; break;
+        case 'L': parse_log_level(arg, config); break;
+        case 'l': config->low_latency = 1; break;
+        case 'c': parse_cpu(arg, config); break;
+        case 'M': config->mlock = 1; break;
+        case 'p': config->profile = 1; break;
+        case 'F': config->fastopen = 1; break;
+        case 'x': parse_connect_test(arg, config); break;
+        case 'a': parse_adaptive(arg, config); break;
+        case 'e': parse_estimate(arg, config); break;
+        case 'P': parse_max_probes(arg, config); break;
+        case 'T': parse_max_time(arg, config); break;
+        case 'u': parse_warmup(arg, config); break;
+        case 'W': config->sweep = 1; break;
+        case 'N': parse_concurrency(arg, config); break;
+        case 'O': parse_slo(arg, config); break;
+        case 'G': parse_targets(arg, config); break;
+        case 'J': parse_jitter(arg, config); break;
+        case 'E': parse_seed(arg, config); break;
+        case 'D': parse_daemon(arg, config); break;
+        case 'Y': parse_summary(arg, config); break;
+        case 'K': parse_window(arg, config); break;
+        case 'o': parse_output(arg, config); break;
+        case 'r': config->results_path = arg; break;
+        case 'g': config->tag = arg; break;
+        case 'z': parse_aggregator(arg, config); break;
+        case 'X': config->scenario_path = arg; break;
+        case 't': config->auto_tune = 1; config->has_tuning = 1; break;
+        case 'S': parse_buf_size(arg, &(config->tuning.sndbuf)); config->has_tuning = 1; break;
+        case 'R': parse_buf_size(arg, &(config->tuning.rcvbuf)); config->has_tuning = 1; break;
+        case 'C': parse_congestion(arg, config); break;
+        case 'w': parse_buf_size(arg, &(config->tuning.notsent_lowat)); config->has_tuning = 1; break;
 
         case ARGP_KEY_ARG:
             if (state->arg_num >= 2) {
@@ -358,7 +1502,7 @@ static error_t arg_parser(int key, char *arg, struct argp_state *state) {
             break;
 
         case ARGP_KEY_END:
-            if (state->arg_num < 2) {
+            if (state->arg_num < 2 && config->n_targets == 0 && config->scenario_path == NULL) {
                 argp_usage(state);
             }
     }
@@ -371,12 +1515,21 @@ static void parse_measure_type(const char *arg, struct client_config *config) {
         config->measure_type = MEASURE_RTT;
         config->payload_sizes = default_payload_size_rtt;
         config->n_sizes = sizeof default_payload_size_rtt / sizeof default_payload_size_rtt[0];
-    } else if (strcmp("thput", arg) == 0) {
-        config->measure_type = MEASURE_THPUT;
+        return;
+    }
+
+    config->measure_type = 0;
+    for (int i = MEASURE_THPUT; i < N_MEASURE_TYPES; i++) {
+        if (strcmp(measure_types_strings[i], arg) == 0) {
+            config->measure_type = i;
+        }
+    }
+
+    if (config->measure_type != 0) {
         config->payload_sizes = default_payload_size_thput;
         config->n_sizes = sizeof default_payload_size_thput / sizeof default_payload_size_thput[0];
     } else {
-        fprintf(stderr, "Invalid measure type\n");
+        log_error("Invalid measure type");
         exit(1);
     }
 }
@@ -384,7 +1537,7 @@ static void parse_measure_type(const char *arg, struct client_config *config) {
 static void parse_probe_num(const char *arg, struct client_config *config) {
     config->n_probes = atoi(arg);
     if (config->n_probes < 1) {
-        fprintf(stderr, "Invalid n_probes\n");
+        log_error("Invalid n_probes");
         exit(1);
     }
 }
@@ -394,7 +1547,7 @@ static void parse_payload_size(const char *arg, struct client_config *config) {
     *payload_size = atol(arg);
 
     if (*payload_size < 1 || *payload_size > 32 K) {
-        fprintf(stderr, "Invalid payload size\n");
+        log_error("Invalid payload size");
         exit(1);
     }
 
@@ -404,7 +1557,7 @@ static void parse_payload_size(const char *arg, struct client_config *config) {
 
 static void parse_server_addr(const char *arg, struct client_config *config) {
     if (inet_aton(arg, &(config->server_addr.sin_addr)) == 0) {
-        fprintf(stderr, "Invalid address\n");
+        log_error("Invalid address");
         exit(1);
     }
 }
@@ -413,7 +1566,7 @@ static void parse_server_port(const char *arg, struct client_config *config) {
     int port = atoi(arg);
 
     if (port < 1 || port > 65535) {
-        fprintf(stderr, "Invalid port\n");
+        log_error("Invalid port");
         exit(1);
     }
 
@@ -424,9 +1577,202 @@ static void parse_server_delay(const char *arg, struct client_config *config) {
     int delay = atoi(arg);
 
     if (delay < 0) {
-        fprintf(stderr, "Invalid server delay\n");
+        log_error("Invalid server delay");
         exit(1);
     }
 
     config->server_delay = delay;
 }
+
+static void parse_cpu(const char *arg, struct client_config *config) {
+    config->cpu = atoi(arg);
+
+    if (config->cpu < 0) {
+        log_error("Invalid CPU");
+        exit(1);
+    }
+}
+
+static void parse_buf_size(const char *arg, int *dest) {
+    *dest = atoi(arg);
+
+    if (*dest < 1) {
+        log_error("Invalid buffer size");
+        exit(1);
+    }
+}
+
+static void parse_congestion(const char *arg, struct client_config *config) {
+    if (strlen(arg) >= TUNE_CC_MAX || strchr(arg, ' ') != NULL) {
+        log_error("Invalid congestion control algorithm");
+        exit(1);
+    }
+
+    strcpy(config->tuning.congestion, arg);
+    config->has_tuning = 1;
+}
+
+static void parse_connect_test(const char *arg, struct client_config *config) {
+    config->connect_test = atoi(arg);
+
+    if (config->connect_test < 1) {
+        log_error("Invalid number of connections");
+        exit(1);
+    }
+}
+
+static void parse_log_level(const char *arg, struct client_config *config) {
+    if (!log_level_from_string(arg, &(config->log_level))) {
+        log_error("Invalid log level");
+        exit(1);
+    }
+}
+
+static void parse_concurrency(const char *arg, struct client_config *config) {
+    config->concurrency = atoi(arg);
+    if (config->concurrency < 1) {
+        log_error("Invalid concurrency");
+        exit(1);
+    }
+}
+
+static void parse_slo(const char *arg, struct client_config *config) {
+    config->slo_ms = atof(arg);
+    if (config->slo_ms <= 0) {
+        log_error("Invalid SLO");
+        exit(1);
+    }
+}
+
+static void parse_adaptive(const char *arg, struct client_config *config) {
+    config->adaptive_rel = atof(arg);
+    if (config->adaptive_rel <= 0 || config->adaptive_rel >= 1) {
+        log_error("Invalid relative error, must be between 0 and 1");
+        exit(1);
+    }
+}
+
+static void parse_estimate(const char *arg, struct client_config *config) {
+    if (strcmp("mean", arg) == 0) {
+        config->ci_percentile = 0;
+        return;
+    }
+
+    if (arg[0] != 'p' || (config->ci_percentile = atof(arg + 1)) <= 0 || config->ci_percentile >= 100) {
+        log_error("Invalid estimate, must be 'mean' or a percentile like 'p99'");
+        exit(1);
+    }
+}
+
+static void parse_max_probes(const char *arg, struct client_config *config) {
+    config->max_probes = atoi(arg);
+    if (config->max_probes < ADAPTIVE_MIN_PROBES) {
+        log_error("Invalid max probes, must be at least %d", ADAPTIVE_MIN_PROBES);
+        exit(1);
+    }
+}
+
+static void parse_max_time(const char *arg, struct client_config *config) {
+    config->max_sec = atoi(arg);
+    if (config->max_sec < 1) {
+        log_error("Invalid max time");
+        exit(1);
+    }
+}
+
+static void parse_warmup(const char *arg, struct client_config *config) {
+    char *unit;
+    double value;
+
+    if (strcmp("auto", arg) == 0) {
+        config->warmup = WARMUP_AUTO;
+        return;
+    }
+
+    value = strtod(arg, &unit);
+    if (value <= 0) {
+        log_error("Invalid warm-up, must be a number of probes, a time or 'auto'");
+        exit(1);
+    }
+
+    if (*unit == '\0') {
+        config->warmup = WARMUP_PROBES;
+        config->warmup_probes = value;
+    } else if (strcmp("s", unit) == 0) {
+        config->warmup = WARMUP_TIME;
+        config->warmup_ns = value * 1000000000;
+    } else if (strcmp("ms", unit) == 0) {
+        config->warmup = WARMUP_TIME;
+        config->warmup_ns = value * 1000000;
+    } else {
+        log_error("Invalid warm-up unit, must be 's' or 'ms'");
+        exit(1);
+    }
+}
+
+static void parse_targets(const char *arg, struct client_config *config) {
+    if (!mesh_parse_targets(arg, &(config->targets), &(config->n_targets))) {
+        exit(1);
+    }
+}
+
+static void parse_jitter(const char *arg, struct client_config *config) {
+    config->jitter_ms = atof(arg);
+    if (config->jitter_ms < 0) {
+        log_error("Invalid jitter");
+        exit(1);
+    }
+}
+
+static void parse_seed(const char *arg, struct client_config *config) {
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || value > UINT_MAX) {
+        log_error("Invalid seed");
+        exit(1);
+    }
+
+    config->seed = value;
+}
+
+static void parse_daemon(const char *arg, struct client_config *config) {
+    config->daemon_sec = atof(arg);
+    if (config->daemon_sec <= 0) {
+        log_error("Invalid daemon interval");
+        exit(1);
+    }
+}
+
+static void parse_summary(const char *arg, struct client_config *config) {
+    config->summary_sec = atof(arg);
+    if (config->summary_sec <= 0) {
+        log_error("Invalid summary interval");
+        exit(1);
+    }
+}
+
+static void parse_window(const char *arg, struct client_config *config) {
+    config->window = atoi(arg);
+    if (config->window < 1 || config->window > DAEMON_MAX_WINDOW) {
+        log_error("Invalid window, must be between 1 and %d", DAEMON_MAX_WINDOW);
+        exit(1);
+    }
+}
+
+static void parse_output(const char *arg, struct client_config *config) {
+    config->output = fopen(arg, "a");
+    if (config->output == NULL) {
+        log_perror("Cannot open output file");
+        exit(1);
+    }
+}
+
+static void parse_aggregator(const char *arg, struct client_config *config) {
+    if (!agg_client_init(&aggregator, arg)) {
+        log_error("Invalid aggregator, must be ADDR:PORT or a unix socket path");
+        exit(1);
+    }
+
+    config->aggregator = arg;
+}
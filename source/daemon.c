@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "evloop.h"
+#include "protocol.h"
+#include "stats.h"
+#include "utils.h"
+#include "log.h"
+
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+enum daemon_states {
+    DAEMON_DOWN,
+    DAEMON_CONNECTING,
+    DAEMON_HELLO,
+    DAEMON_IDLE,
+    DAEMON_PROBE,
+    DAEMON_BYE
+};
+
+/**
+ * Counters of a summary period
+ */
+struct daemon_period {
+    histogram rtt;
+    jitter_stats variation;
+    unsigned long sent;
+    unsigned long lost;
+    unsigned long skipped;
+    unsigned long sessions;
+};
+
+/**
+ * A target and its persistent session. BURST_LEFT is how many probes of the
+ * current burst are still to be echoed, 0 between bursts.
+ * The burst timer ticks at a fixed cadence, the session timer times out
+ * whatever the socket is being waited on for or sends the next keepalive.
+ * The jitter tracker goes on across periods and sessions.
+ */
+struct daemon_session {
+    struct mesh_target *target;
+    enum daemon_states state;
+    int fd;
+    char up;
+    struct ev_io io;
+    struct ev_timer burst_timer;
+    struct ev_timer timer;
+    char *out;
+    size_t out_size;
+    size_t out_len;
+    size_t out_sent;
+    size_t in_len;
+    char response[MAX_SIZE_CLOSING];
+    unsigned int seq;
+    unsigned int burst_left;
+    char keepalive;
+    uint64_t sent_ns;
+    jitter_tracker jitter;
+    struct daemon_period *periods;
+};
+
+static void on_burst_due(void *ctx);
+static void on_session_timer(void *ctx);
+static void on_session_io(void *ctx, uint32_t events);
+static void on_summary_due(void *ctx);
+static void start_connect(struct daemon_session *s);
+static void connected(struct daemon_session *s);
+static void send_probe(struct daemon_session *s, char keepalive);
+static void send_bye(struct daemon_session *s);
+static void flush(struct daemon_session *s);
+static void on_readable(struct daemon_session *s);
+static void on_echo(struct daemon_session *s, const char *data, size_t len);
+static void on_response(struct daemon_session *s);
+static void next_step(struct daemon_session *s);
+static void wait_socket(struct daemon_session *s, uint32_t events);
+static void go_idle(struct daemon_session *s);
+static void session_down(struct daemon_session *s, const char *error);
+static void session_close(struct daemon_session *s);
+static void write_summary(struct daemon_session *s, const char *timestamp);
+static void write_loss_runs(const jitter_stats *variation);
+static void store_period(struct daemon_session *s);
+static void submit_period(struct daemon_session *s);
+
+static struct evloop loop;
+static struct daemon_config *cfg;
+static struct daemon_session *sessions;
+static struct ev_timer summary_timer;
+static char *payload;
+static int curr_period;
+static struct agg_snapshot snapshot;
+
+int daemon_run(struct daemon_config *config) {
+    uint64_t now, offset;
+
+    cfg = config;
+    curr_period = 0;
+
+    sessions = calloc(config->n_targets, sizeof(struct daemon_session));
+    payload = new_payload(config->payload_size);
+
+    if (sessions == NULL || payload == NULL || !evloop_init(&loop, 0)) {
+        log_error("Daemon: cannot allocate sessions");
+        return 0;
+    }
+
+    now = now_ns();
+
+    for (int i = 0; i < config->n_targets; i++) {
+        struct daemon_session *s = &(sessions[i]);
+
+        s->target = &(config->targets[i]);
+        s->fd = -1;
+        s->up = 1;
+        s->out_size = config->payload_size + MAX_SIZE_HELLO;
+        s->out = malloc(s->out_size);
+        s->periods = calloc(config->window, sizeof(struct daemon_period));
+
+        if (s->out == NULL || s->periods == NULL) {
+            log_error("Daemon: cannot allocate sessions");
+            return 0;
+        }
+
+        for (int j = 0; j < config->window; j++) {
+            hist_init(&(s->periods[j].rtt));
+            jitter_stats_init(&(s->periods[j].variation));
+        }
+
+        jitter_tracker_init(&(s->jitter));
+
+        evloop_timer_init(&(s->burst_timer), on_burst_due, s);
+        evloop_timer_init(&(s->timer), on_session_timer, s);
+
+        // Bursts are spread over the interval, so targets don't all go at once
+        offset = config->interval_ns / config->n_targets * i;
+        if (config->jitter_ns > 0) {
+            offset += (uint64_t)((double)rand() / ((double)RAND_MAX + 1) * config->jitter_ns);
+        }
+
+        evloop_timer_set(&loop, &(s->burst_timer), now + offset);
+        start_connect(s);
+    }
+
+    evloop_timer_init(&summary_timer, on_summary_due, NULL);
+    evloop_timer_set(&loop, &summary_timer, now + config->summary_ns);
+
+    log_info("Monitoring %d targets: %u probes of %lu bytes every %.3f s, summary every %.3f s over the last %d",
+        config->n_targets, config->burst_probes, config->payload_size,
+        config->interval_ns / 1000000000.0, config->summary_ns / 1000000000.0, config->window);
+
+    while (evloop_run_once(&loop, -1));
+
+    return 0;
+}
+
+static void on_burst_due(void *ctx) {
+    struct daemon_session *s = ctx;
+    struct daemon_period *period = &(s->periods[curr_period]);
+
+    // Fixed cadence, a late burst doesn't push the following ones
+    evloop_timer_set(&loop, &(s->burst_timer), s->burst_timer.due_ns + cfg->interval_ns);
+
+    if (s->burst_left > 0) {
+        period->skipped += 1;
+        log_debug("%s: previous burst still running, skipping one", s->target->name);
+        return;
+    }
+
+    s->burst_left = cfg->burst_probes;
+
+    switch (s->state) {
+        case DAEMON_IDLE: next_step(s); break;
+        case DAEMON_DOWN: start_connect(s); break;
+
+        // The burst starts as soon as the session is ready
+        default: break;
+    }
+}
+
+static void on_session_timer(void *ctx) {
+    struct daemon_session *s = ctx;
+
+    switch (s->state) {
+        case DAEMON_IDLE: send_probe(s, 1); break;
+        case DAEMON_DOWN: break;
+        default         : session_down(s, "timed out");
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_session_io(void *ctx, uint32_t events) {
+    struct daemon_session *s = ctx;
+
+    switch (s->state) {
+        case DAEMON_CONNECTING:
+            connected(s);
+            return;
+
+        case DAEMON_HELLO:
+        case DAEMON_PROBE:
+        case DAEMON_BYE:
+            if (events & EPOLLOUT) {
+                flush(s);
+            }
+            if (s->state != DAEMON_DOWN && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                on_readable(s);
+            }
+            return;
+
+        // Nothing is watched between bursts, but hang ups are always reported
+        case DAEMON_IDLE:
+            session_down(s, "connection closed");
+            return;
+
+        default:
+            return;
+    }
+}
+
+/**
+ * Write a line per target, then start a new period dropping the oldest one
+ */
+static void on_summary_due(void *ctx) {
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    evloop_timer_set(&loop, &summary_timer, summary_timer.due_ns + cfg->summary_ns);
+
+    gmtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    for (int i = 0; i < cfg->n_targets; i++) {
+        write_summary(&(sessions[i]), timestamp);
+
+        if (cfg->results != NULL) {
+            store_period(&(sessions[i]));
+        }
+
+        if (cfg->aggregator != NULL) {
+            submit_period(&(sessions[i]));
+        }
+    }
+
+    fflush(cfg->output);
+
+    curr_period = (curr_period + 1) % cfg->window;
+
+    for (int i = 0; i < cfg->n_targets; i++) {
+        memset(&(sessions[i].periods[curr_period]), 0, sizeof(struct daemon_period));
+        hist_init(&(sessions[i].periods[curr_period].rtt));
+        jitter_stats_init(&(sessions[i].periods[curr_period].variation));
+    }
+}
+#pragma GCC diagnostic pop
+
+static void start_connect(struct daemon_session *s) {
+    int one = 1;
+
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (s->fd == -1) {
+        session_down(s, strerror(errno));
+        return;
+    }
+
+    // One probe in flight at a time, the last segment of a large one mustn't wait for an ACK
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!evloop_io_add(&loop, &(s->io), s->fd, EPOLLOUT, on_session_io, s)) {
+        session_down(s, "cannot watch socket");
+        return;
+    }
+
+    s->state = DAEMON_CONNECTING;
+
+    if (connect(s->fd, (struct sockaddr *)&(s->target->addr), sizeof(struct sockaddr_in)) == -1
+        && errno != EINPROGRESS
+    ) {
+        session_down(s, strerror(errno));
+        return;
+    }
+
+    wait_socket(s, EPOLLOUT);
+}
+
+static void connected(struct daemon_session *s) {
+    msg_hello hello;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        session_down(s, strerror(err != 0 ? err : errno));
+        return;
+    }
+
+    memset(&hello, 0, sizeof(msg_hello));
+    hello.protocol_phase = PHASE_HELLO;
+    hello.measure_type = MEASURE_RTT;
+    hello.n_probes = DAEMON_SESSION_PROBES;
+    hello.msg_size = cfg->payload_size;
+
+    hello_to_string(&hello, s->out, &(s->out_len));
+    s->out_sent = 0;
+    s->in_len = 0;
+    s->seq = 0;
+    s->state = DAEMON_HELLO;
+    s->periods[curr_period].sessions += 1;
+    flush(s);
+}
+
+static void send_probe(struct daemon_session *s, char keepalive) {
+    msg_probe probe;
+
+    if (s->seq == DAEMON_SESSION_PROBES) {
+        send_bye(s);
+        return;
+    }
+
+    probe.protocol_phase = PHASE_MEASURE;
+    probe.probe_seq_num = ++(s->seq);
+    probe.payload = payload;
+
+    if (!probe_to_string(&probe, s->out, &(s->out_len))) {
+        session_down(s, "cannot serialize probe");
+        return;
+    }
+
+    s->keepalive = keepalive;
+    s->out_sent = 0;
+    s->in_len = 0;
+    s->state = DAEMON_PROBE;
+    s->sent_ns = now_ns();
+
+    if (!keepalive) {
+        s->periods[curr_period].sent += 1;
+    }
+
+    flush(s);
+}
+
+/**
+ * The session's probes are used up, a new one is opened once it's closed
+ */
+static void send_bye(struct daemon_session *s) {
+    msg_bye bye;
+
+    bye.protocol_phase = PHASE_BYE;
+    bye_to_string(&bye, s->out, &(s->out_len));
+    s->out_sent = 0;
+    s->in_len = 0;
+    s->state = DAEMON_BYE;
+    flush(s);
+}
+
+static void flush(struct daemon_session *s) {
+    ssize_t sent = 0;
+
+    if (s->out_sent < s->out_len) {
+        sent = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+    }
+
+    if (sent == -1 && errno != EAGAIN) {
+        session_down(s, strerror(errno));
+        return;
+    }
+
+    if (sent > 0) {
+        s->out_sent += sent;
+    }
+
+    wait_socket(s, EPOLLIN | (s->out_sent < s->out_len ? EPOLLOUT : 0));
+}
+
+static void on_readable(struct daemon_session *s) {
+    char chunk[16 * 1024];
+    ssize_t len;
+
+    // Responses are read whole, probes just compared with what was sent
+    if (s->state == DAEMON_PROBE) {
+        len = recv(s->fd, chunk, sizeof(chunk), 0);
+    } else {
+        len = recv(s->fd, s->response + s->in_len, sizeof(s->response) - 1 - s->in_len, 0);
+    }
+
+    if (len == -1 && errno == EAGAIN) {
+        return;
+    }
+
+    if (len <= 0) {
+        session_down(s, len == 0 ? "connection closed" : strerror(errno));
+        return;
+    }
+
+    if (s->state == DAEMON_PROBE) {
+        on_echo(s, chunk, len);
+        return;
+    }
+
+    s->in_len += len;
+    s->response[s->in_len] = '\0';
+    on_response(s);
+}
+
+static void on_echo(struct daemon_session *s, const char *data, size_t len) {
+    uint64_t now = now_ns();
+
+    if (s->in_len + len > s->out_len || memcmp(s->out + s->in_len, data, len) != 0) {
+        session_down(s, "invalid echo");
+        return;
+    }
+
+    s->in_len += len;
+
+    if (s->in_len < s->out_len) {
+        return;
+    }
+
+    if (!s->keepalive) {
+        hist_record(&(s->periods[curr_period].rtt), now - s->sent_ns);
+        jitter_record(&(s->jitter), &(s->periods[curr_period].variation), now - s->sent_ns);
+        s->burst_left -= 1;
+    }
+
+    next_step(s);
+}
+
+/**
+ * Like the client's, a response is assumed to come in a single read
+ */
+static void on_response(struct daemon_session *s) {
+    if (s->state == DAEMON_HELLO) {
+        if (!response_is(s->response, RESP_READY)) {
+            session_down(s, "Hello refused");
+            return;
+        }
+
+        if (!s->up) {
+            log_info("%s: up", s->target->name);
+            s->up = 1;
+        }
+
+        next_step(s);
+        return;
+    }
+
+    if (!response_is(s->response, RESP_CLOSING)) {
+        session_down(s, "Bye refused");
+        return;
+    }
+
+    session_close(s);
+    start_connect(s);
+}
+
+/**
+ * Carry on with the burst, if any is running
+ */
+static void next_step(struct daemon_session *s) {
+    if (s->burst_left > 0) {
+        send_probe(s, 0);
+    } else {
+        go_idle(s);
+    }
+}
+
+static void wait_socket(struct daemon_session *s, uint32_t events) {
+    if (s->state == DAEMON_DOWN) {
+        return;
+    }
+
+    evloop_io_set(&loop, &(s->io), events);
+    evloop_timer_set(&loop, &(s->timer), now_ns() + (uint64_t)cfg->timeout_sec * 1000000000);
+}
+
+static void go_idle(struct daemon_session *s) {
+    s->state = DAEMON_IDLE;
+    evloop_io_set(&loop, &(s->io), 0);
+    evloop_timer_set(&loop, &(s->timer), now_ns() + (uint64_t)DAEMON_KEEPALIVE_SEC * 1000000000);
+}
+
+/**
+ * Probes of the running burst are lost, the session is opened again on the next one
+ */
+static void session_down(struct daemon_session *s, const char *error) {
+    struct daemon_period *period = &(s->periods[curr_period]);
+
+    if (s->up) {
+        log_warn("%s: down, %s", s->target->name, error);
+        s->up = 0;
+    }
+
+    // A probe sent but not echoed was counted as sent, the ones not sent yet weren't
+    if (s->burst_left > 0) {
+        period->lost += s->burst_left;
+        period->sent += s->burst_left - (s->state == DAEMON_PROBE && !s->keepalive ? 1 : 0);
+        jitter_lost(&(s->jitter), s->burst_left);
+        s->burst_left = 0;
+    }
+
+    session_close(s);
+}
+
+static void session_close(struct daemon_session *s) {
+    evloop_timer_stop(&loop, &(s->timer));
+
+    if (s->fd != -1) {
+        evloop_io_del(&loop, &(s->io));
+        close(s->fd);
+        s->fd = -1;
+    }
+
+    s->state = DAEMON_DOWN;
+}
+
+static void write_summary(struct daemon_session *s, const char *timestamp) {
+    struct daemon_period window;
+    histogram *h = &(window.rtt);
+    histogram *ipdv = &(window.variation.ipdv);
+
+    memset(&window, 0, sizeof(struct daemon_period));
+    hist_init(h);
+    jitter_stats_init(&(window.variation));
+
+    for (int i = 0; i < cfg->window; i++) {
+        hist_merge(h, &(s->periods[i].rtt));
+        jitter_stats_merge(&(window.variation), &(s->periods[i].variation));
+        window.sent += s->periods[i].sent;
+        window.lost += s->periods[i].lost;
+        window.skipped += s->periods[i].skipped;
+        window.sessions += s->periods[i].sessions;
+    }
+
+    if (h->count == 0) {
+        fprintf(cfg->output, "%s %s %s sent=%lu lost=%lu\n", timestamp, s->target->name,
+            s->up ? "up" : "down", window.sent, window.lost);
+        return;
+    }
+
+    fprintf(cfg->output, "%s %s %s sent=%lu lost=%lu min=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f avg=%.3f"
+        " stddev=%.3f jitter=%.3f ipdv_p50=%.3f ipdv_p99=%.3f skipped=%lu sessions=%lu",
+        timestamp, s->target->name, s->up ? "up" : "down",
+        window.sent, window.lost, h->min / 1000000.0, hist_percentile(h, 50) / 1000000.0,
+        hist_percentile(h, 90) / 1000000.0, hist_percentile(h, 99) / 1000000.0,
+        h->max / 1000000.0, hist_mean(h) / 1000000.0, sqrt(moments_variance(&(window.variation.delay))) / 1000000.0,
+        s->jitter.jitter / 1000000.0, hist_percentile(ipdv, 50) / 1000000.0, hist_percentile(ipdv, 99) / 1000000.0,
+        window.skipped, window.sessions);
+
+    write_loss_runs(&(window.variation));
+    fputc('\n', cfg->output);
+}
+
+/**
+ * As loss_runs=N1,N2,N4,... the runs of 1, 2 to 3, 4 to 7 probes and so on,
+ * up to the longest one. Nothing if none ended in the window.
+ */
+static void write_loss_runs(const jitter_stats *variation) {
+    int last = -1;
+
+    for (int i = 0; i < LOSS_RUN_BUCKETS; i++) {
+        if (variation->loss_runs[i] > 0) {
+            last = i;
+        }
+    }
+
+    for (int i = 0; i <= last; i++) {
+        fprintf(cfg->output, "%s%lu", i == 0 ? " loss_runs=" : ",", variation->loss_runs[i]);
+    }
+}
+
+static void store_period(struct daemon_session *s) {
+    struct daemon_period *period = &(s->periods[curr_period]);
+    struct store_record rec;
+
+    if (period->rtt.count == 0) {
+        return;
+    }
+
+    store_init_record(&rec, &(s->target->addr), cfg->tag);
+    rec.measure_type = MEASURE_RTT;
+    rec.n_probes = period->sent;
+    rec.payload_size = cfg->payload_size;
+    store_fill(&rec, &(period->rtt));
+
+    if (!store_append(cfg->results, &rec)) {
+        log_warn("Results not stored");
+    }
+}
+
+static void submit_period(struct daemon_session *s) {
+    struct daemon_period *period = &(s->periods[curr_period]);
+
+    if (period->sent == 0) {
+        return;
+    }
+
+    snapshot.addr = s->target->addr.sin_addr.s_addr;
+    snapshot.port = s->target->addr.sin_port;
+    snapshot.payload_size = cfg->payload_size;
+    snapshot.time_sec = time(NULL);
+    snapshot.sent = period->sent;
+    snapshot.lost = period->lost;
+    snapshot.hist = period->rtt;
+
+    // A failure is logged by the aggregator client, probing goes on regardless
+    agg_submit(cfg->aggregator, &snapshot);
+}
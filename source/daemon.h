@@ -0,0 +1,60 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mesh.h"
+#include "store.h"
+#include "agg.h"
+
+/**
+ * Probes a session is opened for. Once they're used up the session is
+ * closed with a Bye and a new one is opened right away.
+ */
+#define DAEMON_SESSION_PROBES 1000000
+
+/**
+ * A session idle for this long gets a keepalive probe, so the server's idle
+ * timeout (5 seconds by default) doesn't close it between bursts.
+ * Keepalive RTTs are left out of the statistics.
+ */
+#define DAEMON_KEEPALIVE_SEC 2
+
+/**
+ * Max summary periods a rolling window can span
+ */
+#define DAEMON_MAX_WINDOW 60
+
+struct daemon_config {
+    struct mesh_target *targets;
+    int n_targets;
+    size_t payload_size;
+    unsigned int burst_probes;
+    uint64_t interval_ns;
+    uint64_t jitter_ns;
+    uint64_t summary_ns;
+    int window;
+    int timeout_sec;
+    FILE *output;
+    struct store *results;
+    const char *tag;
+    struct agg_client *aggregator;
+};
+
+/**
+ * Keep a session open to every target and send each a burst of BURST_PROBES
+ * probes every INTERVAL_NS, the targets' bursts spread over the interval and
+ * shifted by a random time up to JITTER_NS.
+ * Every SUMMARY_NS a line per target is written to OUTPUT with the RTT
+ * percentiles, delay variation and losses of the last WINDOW summary periods
+ * (the RFC 3550 jitter is the running estimate), and if RESULTS
+ * isn't NULL the RTTs of the period just ended are stored there, labeled TAG.
+ * If AGGREGATOR isn't NULL they're submitted to it, with the period's counters.
+ * Memory is allocated up front, none is while running.
+ * Only returns on failure.
+ */
+int daemon_run(struct daemon_config *config);
+
+#endif
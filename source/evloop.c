@@ -0,0 +1,231 @@
+#include "evloop.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static void heap_swap(struct evloop *loop, size_t a, size_t b);
+static void heap_up(struct evloop *loop, size_t idx);
+static void heap_down(struct evloop *loop, size_t idx);
+static void heap_remove(struct evloop *loop, size_t idx);
+static int next_timeout_ms(struct evloop *loop, int max_wait_ms);
+
+int evloop_init(struct evloop *loop, char busy_poll) {
+    memset(loop, 0, sizeof(struct evloop));
+
+    loop->busy_poll = busy_poll;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epfd == -1) {
+        log_perror("Cannot create epoll instance");
+        return 0;
+    }
+
+    return 1;
+}
+
+void evloop_free(struct evloop *loop) {
+    close(loop->epfd);
+    free(loop->heap);
+    memset(loop, 0, sizeof(struct evloop));
+    loop->epfd = -1;
+}
+
+int evloop_io_add(struct evloop *loop, struct ev_io *io, int fd, uint32_t events, ev_io_cb cb, void *ctx) {
+    struct epoll_event ev;
+
+    io->fd = fd;
+    io->events = events;
+    io->cb = cb;
+    io->ctx = ctx;
+
+    ev.events = events;
+    ev.data.ptr = io;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_perror("Cannot watch socket");
+        return 0;
+    }
+
+    return 1;
+}
+
+int evloop_io_set(struct evloop *loop, struct ev_io *io, uint32_t events) {
+    struct epoll_event ev;
+
+    if (io->events == events) {
+        return 1;
+    }
+
+    io->events = events;
+    ev.events = events;
+    ev.data.ptr = io;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, io->fd, &ev) == -1) {
+        log_perror("Cannot change watched events");
+        return 0;
+    }
+
+    return 1;
+}
+
+void evloop_io_del(struct evloop *loop, struct ev_io *io) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+}
+
+void evloop_timer_init(struct ev_timer *timer, ev_timer_cb cb, void *ctx) {
+    timer->due_ns = 0;
+    timer->heap_idx = -1;
+    timer->cb = cb;
+    timer->ctx = ctx;
+}
+
+int evloop_timer_set(struct evloop *loop, struct ev_timer *timer, uint64_t due_ns) {
+    struct ev_timer **heap;
+    size_t cap;
+
+    if (timer->heap_idx != -1) {
+        timer->due_ns = due_ns;
+        heap_up(loop, timer->heap_idx);
+        heap_down(loop, timer->heap_idx);
+        return 1;
+    }
+
+    if (loop->heap_len == loop->heap_cap) {
+        cap = loop->heap_cap == 0 ? 64 : loop->heap_cap * 2;
+        heap = realloc(loop->heap, cap * sizeof(struct ev_timer *));
+
+        if (heap == NULL) {
+            return 0;
+        }
+
+        loop->heap = heap;
+        loop->heap_cap = cap;
+    }
+
+    timer->due_ns = due_ns;
+    timer->heap_idx = loop->heap_len;
+    loop->heap[loop->heap_len] = timer;
+    loop->heap_len += 1;
+    heap_up(loop, timer->heap_idx);
+
+    return 1;
+}
+
+void evloop_timer_stop(struct evloop *loop, struct ev_timer *timer) {
+    if (timer->heap_idx != -1) {
+        heap_remove(loop, timer->heap_idx);
+    }
+}
+
+int evloop_run_once(struct evloop *loop, int max_wait_ms) {
+    int n_events;
+    struct ev_io *io;
+    struct ev_timer *timer;
+    uint64_t now;
+
+    n_events = epoll_wait(loop->epfd, loop->events, EVLOOP_MAX_EVENTS, next_timeout_ms(loop, max_wait_ms));
+
+    if (n_events == -1) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        log_perror("epoll_wait error");
+        return 0;
+    }
+
+    for (int i = 0; i < n_events; i++) {
+        io = loop->events[i].data.ptr;
+        io->cb(io->ctx, loop->events[i].events);
+    }
+
+    // Callbacks may arm timers that are already due, they'll run on the next round
+    now = now_ns();
+    while (loop->heap_len > 0 && loop->heap[0]->due_ns <= now) {
+        timer = loop->heap[0];
+        heap_remove(loop, 0);
+        timer->cb(timer->ctx);
+    }
+
+    return 1;
+}
+
+static int next_timeout_ms(struct evloop *loop, int max_wait_ms) {
+    uint64_t now, wait_ms;
+
+    if (loop->busy_poll) {
+        return 0;
+    }
+
+    if (loop->heap_len == 0) {
+        return max_wait_ms;
+    }
+
+    now = now_ns();
+    if (loop->heap[0]->due_ns <= now) {
+        return 0;
+    }
+
+    // Round up, waking up early would just spin until the timer is due
+    wait_ms = (loop->heap[0]->due_ns - now + 999999) / 1000000;
+
+    if (max_wait_ms >= 0 && wait_ms > (uint64_t)max_wait_ms) {
+        return max_wait_ms;
+    }
+
+    return wait_ms;
+}
+
+static void heap_swap(struct evloop *loop, size_t a, size_t b) {
+    struct ev_timer *tmp = loop->heap[a];
+
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = tmp;
+    loop->heap[a]->heap_idx = a;
+    loop->heap[b]->heap_idx = b;
+}
+
+static void heap_up(struct evloop *loop, size_t idx) {
+    while (idx > 0 && loop->heap[(idx - 1) / 2]->due_ns > loop->heap[idx]->due_ns) {
+        heap_swap(loop, idx, (idx - 1) / 2);
+        idx = (idx - 1) / 2;
+    }
+}
+
+static void heap_down(struct evloop *loop, size_t idx) {
+    size_t smallest, left, right;
+
+    while (1) {
+        smallest = idx;
+        left = 2 * idx + 1;
+        right = 2 * idx + 2;
+
+        if (left < loop->heap_len && loop->heap[left]->due_ns < loop->heap[smallest]->due_ns) smallest = left;
+        if (right < loop->heap_len && loop->heap[right]->due_ns < loop->heap[smallest]->due_ns) smallest = right;
+
+        if (smallest == idx) {
+            return;
+        }
+
+        heap_swap(loop, idx, smallest);
+        idx = smallest;
+    }
+}
+
+static void heap_remove(struct evloop *loop, size_t idx) {
+    struct ev_timer *timer = loop->heap[idx];
+
+    loop->heap_len -= 1;
+
+    if (idx != loop->heap_len) {
+        loop->heap[idx] = loop->heap[loop->heap_len];
+        loop->heap[idx]->heap_idx = idx;
+        heap_up(loop, idx);
+        heap_down(loop, loop->heap[idx]->heap_idx);
+    }
+
+    timer->heap_idx = -1;
+}
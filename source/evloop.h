@@ -0,0 +1,96 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+/**
+ * Max events handled per epoll_wait() call
+ */
+#define EVLOOP_MAX_EVENTS 256
+
+typedef void (*ev_io_cb)(void *ctx, uint32_t events);
+typedef void (*ev_timer_cb)(void *ctx);
+
+/**
+ * A file descriptor watched by the loop
+ */
+struct ev_io {
+    int fd;
+    uint32_t events;
+    ev_io_cb cb;
+    void *ctx;
+};
+
+/**
+ * A one-shot timer, times are CLOCK_MONOTONIC nanoseconds.
+ * HEAP_IDX is -1 while the timer is not armed.
+ */
+struct ev_timer {
+    uint64_t due_ns;
+    int heap_idx;
+    ev_timer_cb cb;
+    void *ctx;
+};
+
+/**
+ * epoll based event loop with a min-heap of timers
+ */
+struct evloop {
+    int epfd;
+    char busy_poll;
+    struct ev_timer **heap;
+    size_t heap_len;
+    size_t heap_cap;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+};
+
+/**
+ * Initialize LOOP. With BUSY_POLL the loop never sleeps in epoll_wait().
+ * Returns 0 on failure.
+ */
+int evloop_init(struct evloop *loop, char busy_poll);
+
+/**
+ * Release what LOOP holds. Watched file descriptors are left open.
+ */
+void evloop_free(struct evloop *loop);
+
+/**
+ * Start watching FD for EVENTS, calling CB with CTX when any of them happen
+ */
+int evloop_io_add(struct evloop *loop, struct ev_io *io, int fd, uint32_t events, ev_io_cb cb, void *ctx);
+
+/**
+ * Change the events watched for IO. No syscall is made if they didn't change.
+ */
+int evloop_io_set(struct evloop *loop, struct ev_io *io, uint32_t events);
+
+/**
+ * Stop watching IO. Must be called before closing its file descriptor.
+ */
+void evloop_io_del(struct evloop *loop, struct ev_io *io);
+
+/**
+ * Prepare a timer, not armed yet
+ */
+void evloop_timer_init(struct ev_timer *timer, ev_timer_cb cb, void *ctx);
+
+/**
+ * Arm TIMER to fire at DUE_NS, re-arming it if already armed
+ */
+int evloop_timer_set(struct evloop *loop, struct ev_timer *timer, uint64_t due_ns);
+
+/**
+ * Disarm TIMER, if armed
+ */
+void evloop_timer_stop(struct evloop *loop, struct ev_timer *timer);
+
+/**
+ * Wait for events for at most MAX_WAIT_MS (-1 = until a timer is due) and run the callbacks.
+ * Returns 0 on failure.
+ */
+int evloop_run_once(struct evloop *loop, int max_wait_ms);
+
+#endif
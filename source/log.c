@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/**
+ * Bytes collected by the writer before issuing a write()
+ */
+#define OUT_BUF_SIZE (64 * 1024)
+
+/**
+ * How long log_flush() sleeps between checks
+ */
+#define FLUSH_WAIT_NS 100000
+
+struct log_slot {
+    enum log_levels level;
+    size_t len;
+    char text[LOG_MSG_SIZE];
+};
+
+/**
+ * Single producer, single consumer ring. HEAD is only written by the thread
+ * owning the ring, TAIL, FLUSHED and DROPPED_REPORTED only by the writer.
+ * FLUSHED is where TAIL was when the writer last wrote out what it had.
+ */
+struct log_ring {
+    struct log_slot slots[LOG_RING_SLOTS];
+    unsigned long head;
+    unsigned long tail;
+    unsigned long flushed;
+    unsigned long dropped;
+    unsigned long dropped_reported;
+    struct log_ring *next;
+};
+
+struct out_buf {
+    int fd;
+    size_t len;
+    char data[OUT_BUF_SIZE];
+};
+
+static void log_write(enum log_levels level, const char *fmt, va_list args);
+static struct log_ring *own_ring(void);
+static void *writer_main(void *arg);
+static int drain(void);
+static void out_append(struct out_buf *out, const char *data, size_t len);
+static void out_flush(struct out_buf *out);
+static void log_shutdown(void);
+
+static const char *level_strings[] = {"", "error", "warn", "info", "debug"};
+
+static enum log_levels max_level = LOG_INFO;
+static struct log_ring *rings;
+static __thread struct log_ring *thread_ring;
+static unsigned long lost;
+static char stopping;
+static char started;
+static pthread_t writer;
+static struct out_buf out_stdout = {STDOUT_FILENO, 0, {0}};
+static struct out_buf out_stderr = {STDERR_FILENO, 0, {0}};
+
+int log_init(enum log_levels level) {
+    max_level = level;
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Cannot start log writer\n");
+        return 0;
+    }
+
+    started = 1;
+    atexit(log_shutdown);
+
+    return 1;
+}
+
+void log_set_level(enum log_levels level) {
+    __atomic_store_n(&max_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level_from_string(const char *str, enum log_levels *level) {
+    for (int i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+        if (strcmp(str, level_strings[i]) == 0) {
+            *level = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void log_error(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_write(LOG_ERROR, fmt, args);
+    va_end(args);
+}
+
+void log_warn(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_write(LOG_WARN, fmt, args);
+    va_end(args);
+}
+
+void log_info(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_write(LOG_INFO, fmt, args);
+    va_end(args);
+}
+
+void log_debug(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_write(LOG_DEBUG, fmt, args);
+    va_end(args);
+}
+
+void log_perror(const char *msg) {
+    int err = errno;
+    char desc[128];
+
+    if (strerror_r(err, desc, sizeof(desc)) != 0) {
+        snprintf(desc, sizeof(desc), "Error %d", err);
+    }
+
+    log_error("%s: %s", msg, desc);
+    errno = err;
+}
+
+void log_flush(void) {
+    struct log_ring *ring = thread_ring;
+    struct timespec wait = {0, FLUSH_WAIT_NS};
+
+    if (ring == NULL || !started) {
+        return;
+    }
+
+    while (__atomic_load_n(&(ring->flushed), __ATOMIC_ACQUIRE) != ring->head) {
+        nanosleep(&wait, NULL);
+    }
+}
+
+unsigned long log_dropped(void) {
+    unsigned long total = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+    struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+    for (; ring != NULL; ring = ring->next) {
+        total += __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+    }
+
+    return total;
+}
+
+static void log_write(enum log_levels level, const char *fmt, va_list args) {
+    struct log_ring *ring;
+    struct log_slot *slot;
+    unsigned long head;
+    int len;
+
+    if (level > __atomic_load_n(&max_level, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    ring = own_ring();
+
+    if (ring == NULL) {
+        __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    head = ring->head;
+
+    if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_store_n(&(ring->dropped), ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    slot = &(ring->slots[head % LOG_RING_SLOTS]);
+    len = vsnprintf(slot->text, LOG_MSG_SIZE, fmt, args);
+
+    slot->level = level;
+    slot->len = len < 0 ? 0 : (len >= LOG_MSG_SIZE ? LOG_MSG_SIZE - 1 : len);
+
+    // Publish the slot only once it's complete
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * The calling thread's ring, created and linked for the writer on first use
+ */
+static struct log_ring *own_ring(void) {
+    struct log_ring *ring = thread_ring;
+
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(struct log_ring));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &(ring->next), ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    thread_ring = ring;
+
+    return ring;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void *writer_main(void *arg) {
+    struct timespec sleep_time = {0, LOG_WRITER_SLEEP_MS * 1000000L};
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (!drain()) {
+            nanosleep(&sleep_time, NULL);
+        }
+    }
+
+    // Whatever was queued before stopping
+    drain();
+
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+/**
+ * Write out everything queued in all rings.
+ * Returns the number of messages written.
+ */
+static int drain(void) {
+    struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    struct log_slot *slot;
+    struct out_buf *out;
+    unsigned long head, tail, dropped;
+    char note[64];
+    int note_len, written = 0;
+
+    for (; ring != NULL; ring = ring->next) {
+        head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+
+        for (tail = ring->tail; tail != head; tail++) {
+            slot = &(ring->slots[tail % LOG_RING_SLOTS]);
+            out = slot->level <= LOG_WARN ? &out_stderr : &out_stdout;
+
+            out_append(out, slot->text, slot->len);
+            out_append(out, "\n", 1);
+            written += 1;
+        }
+
+        // Free the slots for the producer
+        __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+
+        if (dropped != ring->dropped_reported) {
+            note_len = snprintf(note, sizeof(note), "Warning: %lu log messages dropped\n",
+                dropped - ring->dropped_reported);
+            out_append(&out_stderr, note, note_len);
+            ring->dropped_reported = dropped;
+        }
+    }
+
+    out_flush(&out_stdout);
+    out_flush(&out_stderr);
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        __atomic_store_n(&(ring->flushed), ring->tail, __ATOMIC_RELEASE);
+    }
+
+    return written;
+}
+
+static void out_append(struct out_buf *out, const char *data, size_t len) {
+    if (out->len + len > OUT_BUF_SIZE) {
+        out_flush(out);
+    }
+
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+static void out_flush(struct out_buf *out) {
+    size_t sent = 0;
+    ssize_t res;
+
+    while (sent < out->len) {
+        res = write(out->fd, out->data + sent, out->len - sent);
+
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        sent += res;
+    }
+
+    out->len = 0;
+}
+
+static void log_shutdown(void) {
+    if (!started) {
+        return;
+    }
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    started = 0;
+}
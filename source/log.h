@@ -0,0 +1,71 @@
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * Messages each thread can have queued before new ones are dropped
+ */
+#define LOG_RING_SLOTS 1024
+
+/**
+ * Max length of a message, longer ones are truncated
+ */
+#define LOG_MSG_SIZE 256
+
+/**
+ * How long the writer sleeps when there is nothing to write
+ */
+#define LOG_WRITER_SLEEP_MS 10
+
+enum log_levels {
+    LOG_ERROR = 1,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+/**
+ * Start the background writer and show messages up to LEVEL.
+ * The writer is stopped and the queued messages flushed at exit().
+ * Returns 0 on failure.
+ */
+int log_init(enum log_levels level);
+
+/**
+ * Change the most verbose level shown
+ */
+void log_set_level(enum log_levels level);
+
+/**
+ * Parse a level name (error, warn, info, debug) into LEVEL.
+ * Returns 0 if the name is not valid.
+ */
+int log_level_from_string(const char *str, enum log_levels *level);
+
+/**
+ * Queue a message for the writer. Never blocks: when the calling thread's ring
+ * is full the message is dropped and counted, so this is for diagnostics only.
+ * Errors and warnings go to stderr, everything else to stdout.
+ */
+void log_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_warn(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_info(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Log MSG followed by the description of errno, like perror()
+ */
+void log_perror(const char *msg);
+
+/**
+ * Wait until the messages the calling thread queued so far are written out.
+ * Results are printed with stdio right after, so they're never dropped and
+ * come after the messages that led to them. Flush stdout once done.
+ */
+void log_flush(void);
+
+/**
+ * Messages dropped so far because a ring was full
+ */
+unsigned long log_dropped(void);
+
+#endif
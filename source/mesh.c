@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+
+#include "mesh.h"
+#include "evloop.h"
+#include "protocol.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+enum mesh_states {
+    MESH_FREE,
+    MESH_WAITING,
+    MESH_CONNECTING,
+    MESH_HELLO,
+    MESH_PAUSE,
+    MESH_PROBE,
+    MESH_BYE
+};
+
+/**
+ * A session slot. Slots are reused for the next target once one is done,
+ * and across runs, so buffers are only ever allocated for as many of them
+ * as mesh_init() was given.
+ * The timer either starts the next step or, while waiting on the socket,
+ * times the session out.
+ */
+struct mesh_session {
+    enum mesh_states state;
+    int target;
+    int fd;
+    struct ev_io io;
+    struct ev_timer timer;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t in_len;
+    char response[MAX_SIZE_CLOSING];
+    unsigned int seq;
+    uint64_t started_ns;
+    uint64_t sent_ns;
+};
+
+static int parse_target(char *str, struct mesh_target *dest);
+static int add_target(const char *str, struct mesh_target **dest, int *n);
+static void start_next(struct mesh_session *s);
+static void start_connect(struct mesh_session *s);
+static void connected(struct mesh_session *s);
+static void send_next(struct mesh_session *s);
+static void flush(struct mesh_session *s);
+static void on_readable(struct mesh_session *s);
+static void on_response(struct mesh_session *s);
+static void on_echo(struct mesh_session *s, const char *data, size_t len);
+static void on_session_io(void *ctx, uint32_t events);
+static void on_session_timer(void *ctx);
+static void wait_socket(struct mesh_session *s, uint32_t events);
+static void pause_or_send(struct mesh_session *s);
+static void finish(struct mesh_session *s, const char *error);
+static uint64_t jitter_ns();
+static const struct mesh_params *params_of(int target);
+
+static struct evloop loop;
+static char loop_ready;
+static struct mesh_session *sessions;
+static int n_slots;
+static struct mesh_config *cfg;
+static struct mesh_result *res;
+static struct mesh_params common;
+static char *payload;
+static size_t payload_size;
+static int next_target;
+static int n_finished;
+
+int mesh_parse_targets(const char *spec, struct mesh_target **dest, int *n) {
+    FILE *file;
+    char line[256], *list, *item, *save;
+    int ok = 1;
+
+    if (spec[0] != '@') {
+        list = strdup(spec);
+
+        for (item = strtok_r(list, ",", &save); ok && item != NULL; item = strtok_r(NULL, ",", &save)) {
+            ok = add_target(item, dest, n);
+        }
+
+        free(list);
+        return ok;
+    }
+
+    file = fopen(spec + 1, "r");
+    if (file == NULL) {
+        log_perror("Cannot open targets file");
+        return 0;
+    }
+
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+
+        if (line[0] != '\0' && line[0] != '#') {
+            ok = add_target(line, dest, n);
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+int mesh_init(int max_concurrency, size_t max_payload_size) {
+    n_slots = max_concurrency;
+    payload_size = max_payload_size;
+
+    sessions = calloc(n_slots, sizeof(struct mesh_session));
+    payload = new_payload(payload_size);
+
+    if (sessions == NULL || payload == NULL) {
+        log_error("Mesh: out of memory");
+        mesh_free();
+        return 0;
+    }
+
+    for (int i = 0; i < n_slots; i++) {
+        sessions[i].fd = -1;
+        sessions[i].out = malloc(MAX_SIZE_PROBE);
+        evloop_timer_init(&(sessions[i].timer), on_session_timer, &(sessions[i]));
+
+        if (sessions[i].out == NULL) {
+            log_error("Mesh: out of memory");
+            mesh_free();
+            return 0;
+        }
+    }
+
+    if (!evloop_init(&loop, 0)) {
+        mesh_free();
+        return 0;
+    }
+
+    loop_ready = 1;
+    return 1;
+}
+
+int mesh_run(struct mesh_config *config, struct mesh_result *results) {
+    int ok = 1;
+
+    cfg = config;
+    res = results;
+    next_target = 0;
+    n_finished = 0;
+
+    memset(results, 0, config->n_targets * sizeof(struct mesh_result));
+    for (int i = 0; i < config->n_targets; i++) {
+        hist_init(&(results[i].rtt));
+    }
+
+    common.measure_type = MEASURE_RTT;
+    common.payload_size = config->payload_size;
+    common.n_probes = config->n_probes;
+    common.server_delay = config->server_delay;
+
+    if (config->concurrency > n_slots) {
+        log_error("Mesh: %d sessions at a time, room for %d", config->concurrency, n_slots);
+        return 0;
+    }
+
+    for (int i = 0; i < config->n_targets; i++) {
+        if (params_of(i)->payload_size > payload_size) {
+            log_error("Mesh: %lu bytes payload, room for %lu", params_of(i)->payload_size, payload_size);
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < config->concurrency; i++) {
+        start_next(&(sessions[i]));
+    }
+
+    while (ok && n_finished < config->n_targets) {
+        ok = evloop_run_once(&loop, -1);
+    }
+
+    // Only left behind if the loop failed, the slots must be clean for the next run
+    for (int i = 0; i < config->concurrency; i++) {
+        evloop_timer_stop(&loop, &(sessions[i].timer));
+
+        if (sessions[i].fd != -1) {
+            evloop_io_del(&loop, &(sessions[i].io));
+            close(sessions[i].fd);
+            sessions[i].fd = -1;
+        }
+
+        sessions[i].state = MESH_FREE;
+    }
+
+    return ok;
+}
+
+void mesh_free() {
+    if (loop_ready) {
+        evloop_free(&loop);
+        loop_ready = 0;
+    }
+
+    for (int i = 0; sessions != NULL && i < n_slots; i++) {
+        free(sessions[i].out);
+    }
+
+    free(sessions);
+    free(payload);
+    sessions = NULL;
+    payload = NULL;
+    n_slots = 0;
+}
+
+void mesh_print(struct mesh_config *config, struct mesh_result *results, FILE *output) {
+    struct mesh_result *r;
+    char probes[24];
+
+    fprintf(output, "%-21s %11s %11s %11s %11s %11s %11s %11s  %s\n", "target", "probes", "connect ms",
+        "min ms", "p50 ms", "p99 ms", "max ms", "avg ms", "status");
+
+    for (int i = 0; i < config->n_targets; i++) {
+        r = &(results[i]);
+        snprintf(probes, sizeof(probes), "%u/%u", r->echoed,
+            config->params != NULL ? config->params[i].n_probes : config->n_probes);
+
+        if (r->rtt.count == 0) {
+            fprintf(output, "%-21s %11s %11s %11s %11s %11s %11s %11s  %s\n", config->targets[i].name, probes,
+                "-", "-", "-", "-", "-", "-", r->error[0] != '\0' ? r->error : "no echoes");
+            continue;
+        }
+
+        fprintf(output, "%-21s %11s %11.6f %11.6f %11.6f %11.6f %11.6f %11.6f  %s\n", config->targets[i].name, probes,
+            r->connect_ns / 1000000.0, r->rtt.min / 1000000.0, hist_percentile(&(r->rtt), 50) / 1000000.0,
+            hist_percentile(&(r->rtt), 99) / 1000000.0, r->rtt.max / 1000000.0,
+            hist_mean(&(r->rtt)) / 1000000.0, r->error[0] != '\0' ? r->error : "ok");
+    }
+
+    fflush(output);
+}
+
+static int add_target(const char *str, struct mesh_target **dest, int *n) {
+    struct mesh_target *targets;
+    char *copy;
+    int ok;
+
+    targets = realloc(*dest, (*n + 1) * sizeof(struct mesh_target));
+    if (targets == NULL) {
+        log_error("Mesh: out of memory");
+        return 0;
+    }
+
+    *dest = targets;
+    copy = strdup(str);
+    ok = parse_target(copy, &(targets[*n]));
+    free(copy);
+
+    if (!ok) {
+        log_error("Invalid target '%s', must be ADDR:PORT", str);
+        return 0;
+    }
+
+    *n += 1;
+    return 1;
+}
+
+static int parse_target(char *str, struct mesh_target *dest) {
+    char *colon = strrchr(str, ':');
+    int port;
+
+    if (colon == NULL) {
+        return 0;
+    }
+
+    *colon = '\0';
+    port = atoi(colon + 1);
+
+    memset(dest, 0, sizeof(struct mesh_target));
+    dest->addr.sin_family = AF_INET;
+    dest->addr.sin_port = htons(port);
+
+    if (port < 1 || port > 65535 || inet_aton(str, &(dest->addr.sin_addr)) == 0) {
+        return 0;
+    }
+
+    snprintf(dest->name, MESH_NAME_SIZE, "%s:%d", str, port);
+    return 1;
+}
+
+/**
+ * Give the slot S to the next target, or leave it free if none is left
+ */
+static void start_next(struct mesh_session *s) {
+    if (next_target == cfg->n_targets) {
+        s->state = MESH_FREE;
+        return;
+    }
+
+    s->target = next_target++;
+    s->state = MESH_WAITING;
+    s->seq = 0;
+    evloop_timer_set(&loop, &(s->timer), now_ns() + jitter_ns());
+}
+
+static void start_connect(struct mesh_session *s) {
+    int one = 1;
+
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (s->fd == -1) {
+        log_perror("Mesh: cannot create socket");
+        finish(s, "no socket");
+        return;
+    }
+
+    // One probe in flight at a time, the last segment of a large one mustn't wait for an ACK
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!evloop_io_add(&loop, &(s->io), s->fd, EPOLLOUT, on_session_io, s)) {
+        finish(s, "cannot watch socket");
+        return;
+    }
+
+    s->state = MESH_CONNECTING;
+    s->started_ns = now_ns();
+
+    if (connect(s->fd, (struct sockaddr *)&(cfg->targets[s->target].addr), sizeof(struct sockaddr_in)) == -1
+        && errno != EINPROGRESS
+    ) {
+        finish(s, strerror(errno));
+        return;
+    }
+
+    wait_socket(s, EPOLLOUT);
+}
+
+static void connected(struct mesh_session *s) {
+    const struct mesh_params *params = params_of(s->target);
+    msg_hello hello;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        finish(s, strerror(err != 0 ? err : errno));
+        return;
+    }
+
+    res[s->target].connect_ns = now_ns() - s->started_ns;
+
+    memset(&hello, 0, sizeof(msg_hello));
+    hello.protocol_phase = PHASE_HELLO;
+    hello.measure_type = params->measure_type;
+    hello.n_probes = params->n_probes;
+    hello.msg_size = params->payload_size;
+    hello.server_delay = params->server_delay;
+
+    hello_to_string(&hello, s->out, &(s->out_len));
+    s->out_sent = 0;
+    s->in_len = 0;
+    s->state = MESH_HELLO;
+    flush(s);
+}
+
+/**
+ * Send the next probe, or the Bye after the last one
+ */
+static void send_next(struct mesh_session *s) {
+    const struct mesh_params *params = params_of(s->target);
+    msg_probe probe;
+    msg_bye bye;
+
+    if (s->seq == params->n_probes) {
+        bye.protocol_phase = PHASE_BYE;
+        bye_to_string(&bye, s->out, &(s->out_len));
+        s->state = MESH_BYE;
+    } else {
+        probe.protocol_phase = PHASE_MEASURE;
+        probe.probe_seq_num = ++(s->seq);
+        probe.payload = payload + payload_size - params->payload_size;
+        probe_to_string(&probe, s->out, &(s->out_len));
+        s->state = MESH_PROBE;
+    }
+
+    s->out_sent = 0;
+    s->in_len = 0;
+    s->sent_ns = now_ns();
+
+    if (s->seq == 1 && s->state == MESH_PROBE) {
+        res[s->target].first_sent_ns = s->sent_ns;
+    }
+
+    flush(s);
+}
+
+static void flush(struct mesh_session *s) {
+    ssize_t sent = 0;
+
+    if (s->out_sent < s->out_len) {
+        sent = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+    }
+
+    if (sent == -1 && errno != EAGAIN) {
+        finish(s, strerror(errno));
+        return;
+    }
+
+    if (sent > 0) {
+        s->out_sent += sent;
+    }
+
+    wait_socket(s, EPOLLIN | (s->out_sent < s->out_len ? EPOLLOUT : 0));
+}
+
+static void on_readable(struct mesh_session *s) {
+    char chunk[16 * 1024];
+    ssize_t len;
+    size_t room;
+
+    // Responses are read whole, probes just compared with what was sent
+    if (s->state == MESH_PROBE) {
+        len = recv(s->fd, chunk, sizeof(chunk), 0);
+    } else {
+        room = sizeof(s->response) - 1 - s->in_len;
+        len = recv(s->fd, s->response + s->in_len, room, 0);
+    }
+
+    if (len == -1 && errno == EAGAIN) {
+        return;
+    }
+
+    if (len == -1) {
+        finish(s, strerror(errno));
+        return;
+    }
+
+    if (len == 0) {
+        finish(s, "connection closed");
+        return;
+    }
+
+    if (s->state == MESH_PROBE) {
+        on_echo(s, chunk, len);
+        return;
+    }
+
+    s->in_len += len;
+    s->response[s->in_len] = '\0';
+    on_response(s);
+}
+
+/**
+ * Like the client's, a response is assumed to come in a single read
+ */
+static void on_response(struct mesh_session *s) {
+    if (s->state == MESH_HELLO) {
+        if (!response_is(s->response, RESP_READY)) {
+            finish(s, "Hello refused");
+            return;
+        }
+
+        pause_or_send(s);
+        return;
+    }
+
+    finish(s, response_is(s->response, RESP_CLOSING) ? NULL : "Bye refused");
+}
+
+/**
+ * The echo must be exactly the probe that was sent, so nothing needs to be kept
+ */
+static void on_echo(struct mesh_session *s, const char *data, size_t len) {
+    uint64_t now = now_ns();
+
+    if (s->in_len + len > s->out_len || memcmp(s->out + s->in_len, data, len) != 0) {
+        finish(s, "invalid echo");
+        return;
+    }
+
+    s->in_len += len;
+
+    if (s->in_len < s->out_len) {
+        return;
+    }
+
+    hist_record(&(res[s->target].rtt), now - s->sent_ns);
+    res[s->target].echoed = s->seq;
+    res[s->target].echoed_bytes += s->out_len;
+    res[s->target].last_echo_ns = now;
+    pause_or_send(s);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_session_io(void *ctx, uint32_t events) {
+    struct mesh_session *s = ctx;
+
+    switch (s->state) {
+        case MESH_CONNECTING:
+            connected(s);
+            return;
+
+        case MESH_HELLO:
+        case MESH_PROBE:
+        case MESH_BYE:
+            if (events & EPOLLOUT) {
+                flush(s);
+            }
+            if (s->state != MESH_FREE && s->state != MESH_WAITING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                on_readable(s);
+            }
+            return;
+
+        // Nothing is watched while pausing, but hang ups are always reported
+        case MESH_PAUSE:
+            finish(s, "connection closed");
+            return;
+
+        // Events of a session that was already finished in this round
+        default:
+            return;
+    }
+}
+#pragma GCC diagnostic pop
+
+static void on_session_timer(void *ctx) {
+    struct mesh_session *s = ctx;
+
+    switch (s->state) {
+        case MESH_WAITING: start_connect(s); break;
+        case MESH_PAUSE  : send_next(s); break;
+        case MESH_FREE   : break;
+        default          : finish(s, "timed out");
+    }
+}
+
+/**
+ * Watch the socket for EVENTS, timing out if nothing happens for too long
+ */
+static void wait_socket(struct mesh_session *s, uint32_t events) {
+    if (s->state == MESH_FREE || s->state == MESH_WAITING) {
+        return;
+    }
+
+    evloop_io_set(&loop, &(s->io), events);
+    evloop_timer_set(&loop, &(s->timer), now_ns() + (uint64_t)cfg->timeout_sec * 1000000000);
+}
+
+static void pause_or_send(struct mesh_session *s) {
+    uint64_t pause = jitter_ns();
+
+    if (pause == 0 || s->seq == params_of(s->target)->n_probes) {
+        send_next(s);
+        return;
+    }
+
+    s->state = MESH_PAUSE;
+    evloop_io_set(&loop, &(s->io), 0);
+    evloop_timer_set(&loop, &(s->timer), now_ns() + pause);
+}
+
+/**
+ * Record how the target ended up and move the slot to the next one
+ */
+static void finish(struct mesh_session *s, const char *error) {
+    if (error != NULL) {
+        snprintf(res[s->target].error, MESH_ERROR_SIZE, "%s", error);
+        log_warn("%s: %s", cfg->targets[s->target].name, error);
+    } else {
+        log_debug("%s: done", cfg->targets[s->target].name);
+    }
+
+    evloop_timer_stop(&loop, &(s->timer));
+
+    if (s->fd != -1) {
+        evloop_io_del(&loop, &(s->io));
+        close(s->fd);
+        s->fd = -1;
+    }
+
+    n_finished += 1;
+    start_next(s);
+}
+
+static uint64_t jitter_ns() {
+    if (cfg->jitter_ns == 0) {
+        return 0;
+    }
+
+    return (uint64_t)((double)rand_r(&(cfg->seed)) / ((double)RAND_MAX + 1) * cfg->jitter_ns);
+}
+
+static const struct mesh_params *params_of(int target) {
+    return cfg->params != NULL ? &(cfg->params[target]) : &common;
+}
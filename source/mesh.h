@@ -0,0 +1,106 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "stats.h"
+#include "protocol.h"
+
+/**
+ * Targets measured at the same time when no concurrency is given
+ */
+#define MESH_DEFAULT_CONCURRENCY 32
+
+/**
+ * Room for "255.255.255.255:65535"
+ */
+#define MESH_NAME_SIZE (INET_ADDRSTRLEN + 6)
+
+#define MESH_ERROR_SIZE 64
+
+struct mesh_target {
+    struct sockaddr_in addr;
+    char name[MESH_NAME_SIZE];
+};
+
+/**
+ * What a target's session measures, rtt or thput
+ */
+struct mesh_params {
+    enum measure_types measure_type;
+    size_t payload_size;
+    unsigned int n_probes;
+    unsigned int server_delay;
+};
+
+/**
+ * PARAMS gives each target its own measure, when NULL they all get an rtt
+ * one with PAYLOAD_SIZE, N_PROBES and SERVER_DELAY.
+ * SEED drives the jitter and is updated as it's drawn, so the next run goes
+ * on with the sequence.
+ */
+struct mesh_config {
+    struct mesh_target *targets;
+    int n_targets;
+    size_t payload_size;
+    unsigned int n_probes;
+    unsigned int server_delay;
+    struct mesh_params *params;
+    int concurrency;
+    uint64_t jitter_ns;
+    unsigned int seed;
+    int timeout_sec;
+};
+
+/**
+ * What a target got to. ERROR is empty if all probes were echoed.
+ * ECHOED_BYTES were echoed between FIRST_SENT_NS and LAST_ECHO_NS.
+ */
+struct mesh_result {
+    histogram rtt;
+    uint64_t connect_ns;
+    unsigned int echoed;
+    uint64_t echoed_bytes;
+    uint64_t first_sent_ns;
+    uint64_t last_echo_ns;
+    char error[MESH_ERROR_SIZE];
+};
+
+/**
+ * Parse a comma separated list of ADDR:PORT targets, or a file with one per
+ * line when SPEC is @FILE. Blank lines and lines starting with # are skipped.
+ * The targets are appended to DEST, which is reallocated, and N is updated.
+ * Returns 0 on failure.
+ */
+int mesh_parse_targets(const char *spec, struct mesh_target **dest, int *n);
+
+/**
+ * Prepare the event loop, MAX_CONCURRENCY session slots and a payload of
+ * MAX_PAYLOAD_SIZE bytes, smaller ones being its tail. They're reused by every
+ * mesh_run() until mesh_free().
+ * Returns 0 on failure.
+ */
+int mesh_init(int max_concurrency, size_t max_payload_size);
+
+/**
+ * Measure the RTT of all targets from one event loop, with at most CONCURRENCY
+ * sessions open at the same time. Each session starts after a random delay of
+ * up to JITTER_NS and waits as much again between probes, so targets sharing a
+ * path don't get their probes in synchronized bursts.
+ * CONCURRENCY and the payload sizes must fit what mesh_init() was given.
+ * RESULTS must have room for N_TARGETS entries.
+ * Returns 0 on failure, a target failing is not one.
+ */
+int mesh_run(struct mesh_config *config, struct mesh_result *results);
+
+void mesh_free(void);
+
+/**
+ * Print a row for each target to OUTPUT
+ */
+void mesh_print(struct mesh_config *config, struct mesh_result *results, FILE *output);
+
+#endif
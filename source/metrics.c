@@ -0,0 +1,310 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "metrics.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REQUEST_MAX_SIZE 1024
+#define REQUEST_TIMEOUT_SEC 1
+
+/**
+ * Page being rendered. Output past SIZE is dropped, LEN keeps counting.
+ */
+struct page {
+    char *data;
+    size_t size;
+    size_t len;
+};
+
+static void *serve_main(void *arg);
+static void handle_request(int fd);
+static void aggregate(struct metrics *total);
+static void aggregate_hist(struct metrics_hist *total, struct metrics_hist *h);
+static void render(struct page *page);
+static void render_counter(struct page *page, const char *name, const char *help, uint64_t value);
+static void render_hist(struct page *page, const char *name, const char *help, struct metrics_hist *h);
+static void page_printf(struct page *page, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * From 1 us to 1 s, in nanoseconds
+ */
+static const uint64_t hist_bounds[METRICS_HIST_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000
+};
+
+/**
+ * Label values for enum responses, only the error ones are exported
+ */
+static const char *response_labels[] = {"none", "ready", "closing", "invalid_hello", "invalid_probe"};
+
+static struct metrics *workers;
+static int listen_fd;
+static pthread_t server;
+
+struct metrics *metrics_register(void) {
+    struct metrics *m = calloc(1, sizeof(struct metrics));
+
+    if (m == NULL) {
+        return NULL;
+    }
+
+    m->next = __atomic_load_n(&workers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&workers, &(m->next), m, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return m;
+}
+
+void metrics_add(uint64_t *counter, uint64_t n) {
+    // Single writer, no need for an atomic read-modify-write
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(struct metrics_hist *h, uint64_t ns) {
+    int idx = 0;
+
+    while (idx < METRICS_HIST_BUCKETS && ns > hist_bounds[idx]) {
+        idx++;
+    }
+
+    metrics_add(&(h->buckets[idx]), 1);
+    metrics_add(&(h->sum_ns), ns);
+}
+
+int metrics_serve(int port) {
+    struct sockaddr_in addr;
+    int enable = 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (listen_fd == -1) {
+        log_perror("Cannot create metrics socket");
+        return 0;
+    }
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_perror("Cannot bind metrics socket");
+        close(listen_fd);
+        return 0;
+    }
+
+    if (listen(listen_fd, 16) == -1) {
+        log_perror("Cannot listen on metrics socket");
+        close(listen_fd);
+        return 0;
+    }
+
+    if (pthread_create(&server, NULL, serve_main, NULL) != 0) {
+        log_error("Cannot start metrics server");
+        close(listen_fd);
+        return 0;
+    }
+
+    pthread_detach(server);
+
+    return 1;
+}
+
+/**
+ * One request at a time is enough for a scraper and keeps this
+ * thread from competing with the workers for CPU.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void *serve_main(void *arg) {
+    int fd;
+
+    while (1) {
+        fd = accept(listen_fd, NULL, NULL);
+
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_perror("Cannot accept metrics connection");
+            }
+            continue;
+        }
+
+        handle_request(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+static void handle_request(int fd) {
+    static char page_data[METRICS_PAGE_SIZE];
+    char request[REQUEST_MAX_SIZE];
+    char header[128];
+    struct timeval timeout = {REQUEST_TIMEOUT_SEC, 0};
+    struct page page = {page_data, METRICS_PAGE_SIZE, 0};
+    size_t len = 0;
+    ssize_t res;
+    int header_len;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    request[0] = '\0';
+
+    // Only the request line matters, but read the headers to not reset the connection
+    while (strstr(request, "\r\n\r\n") == NULL) {
+        if (len == REQUEST_MAX_SIZE - 1) {
+            return;
+        }
+
+        res = recv(fd, request + len, REQUEST_MAX_SIZE - 1 - len, 0);
+
+        if (res <= 0) {
+            return;
+        }
+
+        len += res;
+        request[len] = '\0';
+    }
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        sock_send(fd, header, header_len);
+        return;
+    }
+
+    render(&page);
+
+    if (page.len > page.size) {
+        log_warn("Metrics page truncated, %lu bytes needed", page.len);
+        page.len = page.size;
+    }
+
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+        page.len);
+
+    if (sock_send(fd, header, header_len) == -1) {
+        return;
+    }
+
+    sock_send(fd, page.data, page.len);
+}
+
+static void aggregate(struct metrics *total) {
+    struct metrics *m = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+
+    memset(total, 0, sizeof(struct metrics));
+
+    for (; m != NULL; m = m->next) {
+        total->sessions_accepted += __atomic_load_n(&(m->sessions_accepted), __ATOMIC_RELAXED);
+        total->sessions_closed += __atomic_load_n(&(m->sessions_closed), __ATOMIC_RELAXED);
+        total->probes_echoed += __atomic_load_n(&(m->probes_echoed), __ATOMIC_RELAXED);
+        total->bytes_echoed += __atomic_load_n(&(m->bytes_echoed), __ATOMIC_RELAXED);
+
+        for (int i = 0; i < N_RESPONSES; i++) {
+            total->failures[i] += __atomic_load_n(&(m->failures[i]), __ATOMIC_RELAXED);
+        }
+
+        aggregate_hist(&(total->echo_service), &(m->echo_service));
+        aggregate_hist(&(total->delay_error), &(m->delay_error));
+        aggregate_hist(&(total->queue_delay), &(m->queue_delay));
+    }
+}
+
+static void aggregate_hist(struct metrics_hist *total, struct metrics_hist *h) {
+    for (int i = 0; i <= METRICS_HIST_BUCKETS; i++) {
+        total->buckets[i] += __atomic_load_n(&(h->buckets[i]), __ATOMIC_RELAXED);
+    }
+
+    total->sum_ns += __atomic_load_n(&(h->sum_ns), __ATOMIC_RELAXED);
+}
+
+static void render(struct page *page) {
+    struct metrics total;
+
+    aggregate(&total);
+
+    render_counter(page, "rtt_server_sessions_accepted_total", "Client connections accepted",
+        total.sessions_accepted);
+    render_counter(page, "rtt_server_sessions_closed_total", "Client connections closed",
+        total.sessions_closed);
+
+    page_printf(page, "# HELP rtt_server_sessions_open Client connections currently open\n");
+    page_printf(page, "# TYPE rtt_server_sessions_open gauge\n");
+    page_printf(page, "rtt_server_sessions_open %lu\n",
+        total.sessions_accepted > total.sessions_closed ? total.sessions_accepted - total.sessions_closed : 0);
+
+    page_printf(page, "# HELP rtt_server_validation_failures_total Sessions closed with an error response\n");
+    page_printf(page, "# TYPE rtt_server_validation_failures_total counter\n");
+    for (int i = RESP_INVALID_HELLO; i < N_RESPONSES; i++) {
+        page_printf(page, "rtt_server_validation_failures_total{response=\"%s\"} %lu\n",
+            response_labels[i], total.failures[i]);
+    }
+
+    render_counter(page, "rtt_server_probes_echoed_total", "Probes echoed back", total.probes_echoed);
+    render_counter(page, "rtt_server_bytes_echoed_total", "Probe bytes echoed back", total.bytes_echoed);
+
+    render_hist(page, "rtt_server_echo_service_seconds",
+        "Time from a probe being received to its echo being handed to the socket, server delay excluded",
+        &(total.echo_service));
+    render_hist(page, "rtt_server_delay_timer_error_seconds",
+        "How late the server delay timer fired",
+        &(total.delay_error));
+    render_hist(page, "rtt_server_echo_queue_seconds",
+        "Time a probe waited for the echo scheduler, rate caps included",
+        &(total.queue_delay));
+}
+
+static void render_counter(struct page *page, const char *name, const char *help, uint64_t value) {
+    page_printf(page, "# HELP %s %s\n", name, help);
+    page_printf(page, "# TYPE %s counter\n", name);
+    page_printf(page, "%s %lu\n", name, value);
+}
+
+static void render_hist(struct page *page, const char *name, const char *help, struct metrics_hist *h) {
+    uint64_t cumulative = 0;
+
+    page_printf(page, "# HELP %s %s\n", name, help);
+    page_printf(page, "# TYPE %s histogram\n", name);
+
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        cumulative += h->buckets[i];
+        page_printf(page, "%s_bucket{le=\"%g\"} %lu\n", name, hist_bounds[i] / 1e9, cumulative);
+    }
+
+    // Count is derived from the buckets so that it always matches +Inf
+    cumulative += h->buckets[METRICS_HIST_BUCKETS];
+    page_printf(page, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    page_printf(page, "%s_sum %.9f\n", name, h->sum_ns / 1e9);
+    page_printf(page, "%s_count %lu\n", name, cumulative);
+}
+
+static void page_printf(struct page *page, const char *fmt, ...) {
+    va_list args;
+    int res;
+
+    va_start(args, fmt);
+    res = vsnprintf(page->data + (page->len < page->size ? page->len : page->size),
+        page->len < page->size ? page->size - page->len : 0, fmt, args);
+    va_end(args);
+
+    if (res > 0) {
+        page->len += res;
+    }
+}
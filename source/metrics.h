@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "protocol.h"
+
+#include <stdint.h>
+
+/**
+ * Number of finite histogram buckets, their upper bounds are in metrics.c
+ */
+#define METRICS_HIST_BUCKETS 19
+
+/**
+ * Max size of a rendered scrape
+ */
+#define METRICS_PAGE_SIZE (16 * 1024)
+
+/**
+ * Histogram with fixed bucket bounds, in the shape Prometheus expects.
+ * The extra bucket counts observations above the last bound.
+ */
+struct metrics_hist {
+    uint64_t buckets[METRICS_HIST_BUCKETS + 1];
+    uint64_t sum_ns;
+};
+
+/**
+ * Metrics of a single worker. Only the owning thread updates them, the
+ * scraper reads them concurrently and sums all workers up.
+ */
+struct metrics {
+    uint64_t sessions_accepted;
+    uint64_t sessions_closed;
+    uint64_t failures[N_RESPONSES];
+    uint64_t probes_echoed;
+    uint64_t bytes_echoed;
+    struct metrics_hist echo_service;
+    struct metrics_hist delay_error;
+    struct metrics_hist queue_delay;
+    struct metrics *next;
+};
+
+/**
+ * Create the metrics of the calling worker and make them visible to scrapes.
+ * Returns NULL on failure.
+ */
+struct metrics *metrics_register(void);
+
+/**
+ * Add N to COUNTER. Must only be called by the worker owning it.
+ */
+void metrics_add(uint64_t *counter, uint64_t n);
+
+/**
+ * Record a duration in H. Must only be called by the worker owning it.
+ */
+void metrics_observe(struct metrics_hist *h, uint64_t ns);
+
+/**
+ * Serve the aggregated metrics over HTTP on PORT from a background thread.
+ * Returns 0 on failure.
+ */
+int metrics_serve(int port);
+
+#endif
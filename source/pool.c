@@ -0,0 +1,140 @@
+#include "pool.h"
+
+#include <string.h>
+
+/**
+ * From what an idle connection needs to hold a Hello or Bye,
+ * up to a full 32K probe plus its header and terminator.
+ */
+static const size_t class_sizes[POOL_N_CLASSES] = {256, 2 * 1024, 8 * 1024, 36 * 1024};
+
+static int class_for(size_t size);
+static int refill(struct pool *p, struct pool_class *c);
+
+void pool_init(struct pool *p) {
+    memset(p, 0, sizeof(struct pool));
+
+    for (int i = 0; i < POOL_N_CLASSES; i++) {
+        p->classes[i].size = class_sizes[i];
+    }
+}
+
+size_t pool_min_size(void) {
+    return class_sizes[0];
+}
+
+size_t pool_max_size(void) {
+    return class_sizes[POOL_N_CLASSES - 1];
+}
+
+int pool_get(struct pool *p, struct buf *b, size_t min_size) {
+    int idx = class_for(min_size);
+    struct pool_class *c;
+
+    if (idx == -1) {
+        return 0;
+    }
+
+    c = &(p->classes[idx]);
+
+    if (c->free_list == NULL && !refill(p, c)) {
+        return 0;
+    }
+
+    b->data = c->free_list;
+    b->cap = c->size;
+    b->len = 0;
+
+    // Free buffers hold the pointer to the next one in their first bytes
+    c->free_list = *(void **)c->free_list;
+    c->in_use += 1;
+
+    return 1;
+}
+
+void pool_put(struct pool *p, struct buf *b) {
+    struct pool_class *c;
+
+    if (b->data == NULL) {
+        return;
+    }
+
+    c = &(p->classes[class_for(b->cap)]);
+
+    *(void **)b->data = c->free_list;
+    c->free_list = b->data;
+    c->in_use -= 1;
+
+    b->data = NULL;
+    b->cap = 0;
+    b->len = 0;
+}
+
+int pool_resize(struct pool *p, struct buf *b, size_t min_size) {
+    struct buf resized;
+
+    if (min_size < b->len) {
+        min_size = b->len;
+    }
+
+    if (b->data != NULL && class_for(min_size) == class_for(b->cap)) {
+        return 1;
+    }
+
+    if (!pool_get(p, &resized, min_size)) {
+        return 0;
+    }
+
+    if (b->len > 0) {
+        memcpy(resized.data, b->data, b->len);
+    }
+    resized.len = b->len;
+
+    pool_put(p, b);
+    *b = resized;
+
+    return 1;
+}
+
+size_t pool_in_use(struct pool *p) {
+    size_t total = 0;
+
+    for (int i = 0; i < POOL_N_CLASSES; i++) {
+        total += p->classes[i].in_use * p->classes[i].size;
+    }
+
+    return total;
+}
+
+static int class_for(size_t size) {
+    for (int i = 0; i < POOL_N_CLASSES; i++) {
+        if (size <= class_sizes[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Carve a new slab into buffers of class C.
+ * Slabs are never given back, the pool only grows to the peak usage.
+ */
+static int refill(struct pool *p, struct pool_class *c) {
+    size_t count = POOL_SLAB_SIZE / c->size;
+    char *slab = malloc(count * c->size);
+
+    if (slab == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        *(void **)(slab + i * c->size) = c->free_list;
+        c->free_list = slab + i * c->size;
+    }
+
+    c->total += count;
+    p->reserved += count * c->size;
+
+    return 1;
+}
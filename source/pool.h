@@ -0,0 +1,80 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+
+/**
+ * Number of buffer size classes
+ */
+#define POOL_N_CLASSES 4
+
+/**
+ * Bytes requested from the system at once when a class runs out of buffers
+ */
+#define POOL_SLAB_SIZE (256 * 1024)
+
+/**
+ * A buffer borrowed from a pool.
+ * LEN is for the user to keep track of how much of it is in use.
+ */
+struct buf {
+    char *data;
+    size_t cap;
+    size_t len;
+};
+
+struct pool_class {
+    size_t size;
+    void *free_list;
+    size_t in_use;
+    size_t total;
+};
+
+/**
+ * Slab allocator of fixed-size buffer classes.
+ * Not thread safe, each thread is expected to own its pool.
+ */
+struct pool {
+    struct pool_class classes[POOL_N_CLASSES];
+    size_t reserved;
+};
+
+/**
+ * Initialize an empty pool. Memory is only reserved when first needed.
+ */
+void pool_init(struct pool *p);
+
+/**
+ * Size of the smallest class, what an idle connection holds
+ */
+size_t pool_min_size(void);
+
+/**
+ * Size of the biggest class
+ */
+size_t pool_max_size(void);
+
+/**
+ * Borrow a buffer of at least MIN_SIZE bytes into B.
+ * Returns 0 if MIN_SIZE is bigger than the biggest class or memory is exhausted.
+ */
+int pool_get(struct pool *p, struct buf *b, size_t min_size);
+
+/**
+ * Return B to the pool. Does nothing if B holds no buffer.
+ */
+void pool_put(struct pool *p, struct buf *b);
+
+/**
+ * Move B to the class fitting MIN_SIZE bytes, keeping its first B->len bytes.
+ * Works both ways, to borrow a bigger buffer or to give it back.
+ * Returns 0 on failure, in which case B is left untouched.
+ */
+int pool_resize(struct pool *p, struct buf *b, size_t min_size);
+
+/**
+ * Bytes currently handed out
+ */
+size_t pool_in_use(struct pool *p);
+
+#endif
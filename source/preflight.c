@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include "preflight.h"
+#include "protocol.h"
+#include "tuning.h"
+#include "stream.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static int open_session(struct sockaddr_in *server_addr, int timeout_sec, double *hello_rtt_sec);
+static int close_session(int fd, msg_closing *closing);
+
+int preflight_run(struct sockaddr_in *server_addr, int timeout_sec, struct preflight_result *dest) {
+    int fd;
+    double hello_rtt;
+    struct path_info path;
+    struct stream_counters counters;
+    msg_closing closing;
+    char leftover[MAX_SIZE_READY];
+    size_t leftover_len;
+
+    memset(dest, 0, sizeof(struct preflight_result));
+
+    fd = open_session(server_addr, timeout_sec, &hello_rtt);
+    if (fd == -1) {
+        return 0;
+    }
+
+    tune_nodelay(fd);
+
+    if (!stream_probes(fd, 1, 1, PREFLIGHT_PROBES, PREFLIGHT_PROBE_SIZE, timeout_sec, &counters,
+            leftover, sizeof(leftover), &leftover_len)
+    ) {
+        close(fd);
+        return 0;
+    }
+
+    memset(&path, 0, sizeof(struct path_info));
+    dest->rtt_sec = hello_rtt;
+
+    // The kernel's min RTT isn't inflated by our own processing of the Hello
+    if (tune_path_info(fd, &path) && path.min_rtt_usec > 0) {
+        dest->rtt_sec = path.min_rtt_usec / 1000000.0;
+    }
+
+    if (!close_session(fd, &closing)) {
+        return 0;
+    }
+
+    if (closing.has_counters && closing.rx_usec > 0) {
+        dest->rate_up = closing.rx_bytes / (closing.rx_usec / 1000000.0);
+    }
+
+    if (stream_rx_usec(&counters) > 0) {
+        dest->rate_down = counters.rx_bytes / (stream_rx_usec(&counters) / 1000000.0);
+    }
+
+    // Too little data to time a direction on a fast path, the kernel's estimate of ours is better than none
+    if (dest->rate_up == 0) {
+        dest->rate_up = path.delivery_rate;
+    }
+
+    dest->rate = dest->rate_up > dest->rate_down ? dest->rate_up : dest->rate_down;
+
+    if (dest->rate == 0) {
+        log_error("Pre-flight: too little data to estimate the rate");
+        return 0;
+    }
+
+    dest->bdp = dest->rate * dest->rtt_sec;
+    dest->buf_size = tune_buf_for_bdp(dest->rate, dest->rtt_sec);
+
+    return 1;
+}
+
+static int open_session(struct sockaddr_in *server_addr, int timeout_sec, double *hello_rtt_sec) {
+    int fd;
+    struct timeval timeout;
+    msg_hello hello;
+    char hello_str[MAX_SIZE_HELLO];
+    char response[MAX_SIZE_READY];
+    size_t hello_len;
+    uint64_t time_before;
+
+    memset(&hello, 0, sizeof(msg_hello));
+    hello.protocol_phase = PHASE_HELLO;
+    hello.measure_type = MEASURE_BIDIR;
+    hello.n_probes = PREFLIGHT_PROBES;
+    hello.msg_size = PREFLIGHT_PROBE_SIZE;
+
+    if (!hello_to_string(&hello, hello_str, &hello_len)) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        log_perror("Pre-flight: cannot create socket");
+        return -1;
+    }
+
+    timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_sec;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)server_addr, sizeof(struct sockaddr_in)) == -1) {
+        log_perror("Pre-flight: cannot connect host");
+        close(fd);
+        return -1;
+    }
+
+    bzero(response, sizeof(response));
+    time_before = now_ns();
+
+    if (send(fd, hello_str, hello_len, 0) == -1
+        || recv_response(fd, response, sizeof(response)) <= 0
+    ) {
+        log_perror("Pre-flight: Hello failed");
+        close(fd);
+        return -1;
+    }
+
+    *hello_rtt_sec = (now_ns() - time_before) / 1000000000.0;
+
+    if (!response_is(response, RESP_READY)) {
+        log_error("Pre-flight: invalid Hello response");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Say Bye and read the server's counters into CLOSING
+ */
+static int close_session(int fd, msg_closing *closing) {
+    msg_bye bye;
+    char bye_str[MAX_SIZE_BYE];
+    char response[MAX_SIZE_CLOSING];
+    size_t bye_len;
+    ssize_t res = -1;
+
+    bye.protocol_phase = PHASE_BYE;
+    bye_to_string(&bye, bye_str, &bye_len);
+    bzero(response, sizeof(response));
+
+    if (send(fd, bye_str, bye_len, 0) != -1) {
+        res = recv(fd, response, sizeof(response) - 1, 0);
+    }
+
+    close(fd);
+
+    if (res <= 0 || !closing_from_string(response, closing)) {
+        log_error("Pre-flight: invalid Bye response");
+        return 0;
+    }
+
+    return 1;
+}
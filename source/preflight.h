@@ -0,0 +1,39 @@
+#ifndef PREFLIGHT_H
+#define PREFLIGHT_H
+
+#include <netinet/in.h>
+
+/**
+ * Number of max-size probes streamed each way during the pre-flight
+ */
+#define PREFLIGHT_PROBES 32
+
+/**
+ * Payload size of the pre-flight probes
+ */
+#define PREFLIGHT_PROBE_SIZE (32 * 1024)
+
+/**
+ * What the pre-flight learned about the path. Rates are in bytes/sec, UP
+ * from the client to the server. RATE is the faster of the two: both ends
+ * get the same buffers, and each end's buffers carry both directions.
+ */
+struct preflight_result {
+    double rtt_sec;
+    double rate_up;
+    double rate_down;
+    double rate;
+    int bdp;
+    int buf_size;
+};
+
+/**
+ * Run a short bidir session against SERVER_ADDR, streaming probes both ways
+ * at once, to estimate RTT and the bottleneck rate of each direction: the
+ * server reports what it received, the client times what it did. From those,
+ * a socket buffer size fitting the path's BDP.
+ * Returns 0 on failure.
+ */
+int preflight_run(struct sockaddr_in *server_addr, int timeout_sec, struct preflight_result *dest);
+
+#endif
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include "prof.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+/**
+ * Width of a table column
+ */
+#define COLUMN_WIDTH 18
+
+static int open_event(struct perf_event_attr *attr, int group_fd);
+
+static const char *counter_names[] = {"cycles", "instructions", "cache-misses", "ctx-switches", "cpu-time-ns"};
+static const char *phase_names[] = {"recv", "parse", "delay", "send"};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PROF_N_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+// Counters are per thread, and so is their state
+static __thread int group_fd = -1;
+static __thread int n_events;
+static __thread enum prof_counters event_counters[PROF_N_COUNTERS];
+static __thread char from_perf[PROF_N_COUNTERS];
+static __thread char available[PROF_N_COUNTERS];
+static __thread char user_only;
+
+void prof_init(void) {
+    struct perf_event_attr attr;
+    int fd;
+
+    for (int i = 0; i < PROF_N_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(struct perf_event_attr));
+        attr.size = sizeof(struct perf_event_attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = 1;
+
+        fd = open_event(&attr, group_fd);
+
+        // Restricted by perf_event_paranoid, settle for user space only
+        if (fd == -1 && (errno == EACCES || errno == EPERM) && group_fd == -1 && !user_only) {
+            user_only = 1;
+            attr.exclude_kernel = 1;
+            fd = open_event(&attr, group_fd);
+        }
+
+        if (fd == -1) {
+            continue;
+        }
+
+        // The whole group is read at once, starting from the leader
+        if (group_fd == -1) {
+            group_fd = fd;
+        }
+
+        event_counters[n_events] = i;
+        n_events += 1;
+        from_perf[i] = 1;
+        available[i] = 1;
+    }
+
+    available[PROF_CTX_SWITCHES] = 1;
+    available[PROF_CPU_NS] = 1;
+
+    if (n_events == 0) {
+        log_warn("Performance counters not available, profiling CPU time and context switches only");
+    } else if (!available[PROF_CYCLES]) {
+        log_warn("Hardware performance counters not available, profiling CPU time and context switches only");
+    }
+}
+
+void prof_read(struct prof_sample *s) {
+    uint64_t values[1 + PROF_N_COUNTERS];
+    struct timespec ts;
+    struct rusage usage;
+
+    if (n_events > 0 && read(group_fd, values, sizeof(values)) > 0) {
+        for (int i = 0; i < n_events; i++) {
+            s->values[event_counters[i]] = values[1 + i];
+        }
+    }
+
+    if (!from_perf[PROF_CPU_NS]) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        s->values[PROF_CPU_NS] = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    if (!from_perf[PROF_CTX_SWITCHES]) {
+        getrusage(RUSAGE_THREAD, &usage);
+        s->values[PROF_CTX_SWITCHES] = usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+}
+
+void prof_since(struct prof_sample *start, struct prof_probe *p, enum prof_phases phase) {
+    struct prof_sample now;
+
+    memset(&now, 0, sizeof(struct prof_sample));
+    prof_read(&now);
+
+    for (int i = 0; i < PROF_N_COUNTERS; i++) {
+        p->phases[phase].values[i] += now.values[i] - start->values[i];
+    }
+
+    p->used[phase] = 1;
+    *start = now;
+}
+
+void prof_usage_read(struct prof_usage *u) {
+    struct timespec ts;
+    struct rusage usage;
+
+    // getrusage() reports the runtime as of the last tick or context switch,
+    // reading the thread's clock brings it up to date first
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    getrusage(RUSAGE_THREAD, &usage);
+
+    u->user_usec = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    u->sys_usec = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    u->vcsw = usage.ru_nvcsw;
+    u->ivcsw = usage.ru_nivcsw;
+    u->minflt = usage.ru_minflt;
+    u->majflt = usage.ru_majflt;
+}
+
+void prof_usage_add_since(struct prof_usage *dest, const struct prof_usage *start) {
+    struct prof_usage now;
+
+    prof_usage_read(&now);
+
+    dest->user_usec += now.user_usec - start->user_usec;
+    dest->sys_usec += now.sys_usec - start->sys_usec;
+    dest->vcsw += now.vcsw - start->vcsw;
+    dest->ivcsw += now.ivcsw - start->ivcsw;
+    dest->minflt += now.minflt - start->minflt;
+    dest->majflt += now.majflt - start->majflt;
+}
+
+void prof_report_init(struct prof_report *r) {
+    r->n_probes = 0;
+
+    for (int phase = 0; phase < PROF_N_PHASES; phase++) {
+        r->used[phase] = 0;
+
+        for (int i = 0; i < PROF_N_COUNTERS; i++) {
+            r->hists[phase][i] = NULL;
+        }
+    }
+}
+
+void prof_report_free(struct prof_report *r) {
+    for (int phase = 0; phase < PROF_N_PHASES; phase++) {
+        for (int i = 0; i < PROF_N_COUNTERS; i++) {
+            free(r->hists[phase][i]);
+            r->hists[phase][i] = NULL;
+        }
+    }
+}
+
+void prof_record(struct prof_report *r, struct prof_probe *p) {
+    histogram **h;
+
+    for (int phase = 0; phase < PROF_N_PHASES; phase++) {
+        if (!p->used[phase]) {
+            continue;
+        }
+
+        for (int i = 0; i < PROF_N_COUNTERS; i++) {
+            if (!available[i]) {
+                continue;
+            }
+
+            h = &(r->hists[phase][i]);
+
+            // Tried again on the next probe, the column shows "-" if it never is
+            if (*h == NULL && (*h = malloc(sizeof(histogram))) != NULL) {
+                hist_init(*h);
+            }
+
+            if (*h != NULL) {
+                hist_record(*h, p->phases[phase].values[i]);
+            }
+        }
+
+        r->used[phase] = 1;
+    }
+
+    r->n_probes += 1;
+    memset(p, 0, sizeof(struct prof_probe));
+}
+
+void prof_print(struct prof_report *r, const char *prefix) {
+    char line[PROF_N_COUNTERS * COLUMN_WIDTH + 16];
+    char cell[COLUMN_WIDTH + 1];
+    size_t len;
+    histogram *h;
+
+    if (r->n_probes == 0) {
+        return;
+    }
+
+    printf("%sPer-probe cost by phase over %lu probes, avg / p99%s:\n", prefix, r->n_probes,
+        user_only ? " (user space only)" : "");
+
+    len = snprintf(line, sizeof(line), "  %-6s", "phase");
+    for (int i = 0; i < PROF_N_COUNTERS; i++) {
+        if (available[i]) {
+            len += snprintf(line + len, sizeof(line) - len, "%*s", COLUMN_WIDTH, counter_names[i]);
+        }
+    }
+    printf("%s%s\n", prefix, line);
+
+    for (int phase = 0; phase < PROF_N_PHASES; phase++) {
+        if (!r->used[phase]) {
+            continue;
+        }
+
+        len = snprintf(line, sizeof(line), "  %-6s", phase_names[phase]);
+
+        for (int i = 0; i < PROF_N_COUNTERS; i++) {
+            if (!available[i]) {
+                continue;
+            }
+
+            h = r->hists[phase][i];
+
+            if (h != NULL) {
+                snprintf(cell, sizeof(cell), "%.0f / %lu", hist_mean(h), hist_percentile(h, 99));
+            } else {
+                snprintf(cell, sizeof(cell), "-");
+            }
+
+            len += snprintf(line + len, sizeof(line) - len, "%*s", COLUMN_WIDTH, cell);
+        }
+
+        printf("%s%s\n", prefix, line);
+    }
+}
+
+static int open_event(struct perf_event_attr *attr, int group_fd) {
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
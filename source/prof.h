@@ -0,0 +1,122 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include "stats.h"
+
+#include <stdint.h>
+
+/**
+ * What is counted for each phase. Hardware counters are only there when
+ * the CPU exposes them to perf_event_open().
+ */
+enum prof_counters {
+    PROF_CYCLES = 0,
+    PROF_INSTRUCTIONS,
+    PROF_CACHE_MISSES,
+    PROF_CTX_SWITCHES,
+    PROF_CPU_NS,
+    PROF_N_COUNTERS
+};
+
+/**
+ * Phases a probe goes through while being echoed
+ */
+enum prof_phases {
+    PROF_RECV = 0,
+    PROF_PARSE,
+    PROF_DELAY,
+    PROF_SEND,
+    PROF_N_PHASES
+};
+
+/**
+ * Counter values at some point in time, or a difference of them
+ */
+struct prof_sample {
+    uint64_t values[PROF_N_COUNTERS];
+};
+
+/**
+ * Cost of each phase for the probe in flight
+ */
+struct prof_probe {
+    struct prof_sample phases[PROF_N_PHASES];
+    char used[PROF_N_PHASES];
+};
+
+/**
+ * Per-probe cost distributions of a session. Histograms are big, ~11 KB, one
+ * is only allocated once its phase and counter are recorded: NULL until then,
+ * or if it couldn't be.
+ * Counters are the thread's, so a phase only spans the session's own work:
+ * the wait of a delayed probe, when the thread serves other sessions, isn't
+ * part of the delay phase, which is the cost of firing its timer.
+ */
+struct prof_report {
+    uint64_t n_probes;
+    char used[PROF_N_PHASES];
+    histogram *hists[PROF_N_PHASES][PROF_N_COUNTERS];
+};
+
+/**
+ * Resources used by a thread, or over an interval: CPU time in user and
+ * kernel space, voluntary and involuntary context switches, minor and major
+ * page faults. Always available, from getrusage().
+ */
+struct prof_usage {
+    uint64_t user_usec;
+    uint64_t sys_usec;
+    uint64_t vcsw;
+    uint64_t ivcsw;
+    uint64_t minflt;
+    uint64_t majflt;
+};
+
+/**
+ * Open the counters for the calling thread. Whatever perf_event_open() can't
+ * provide is taken from getrusage() and CLOCK_THREAD_CPUTIME_ID, or left out.
+ */
+void prof_init(void);
+
+/**
+ * Read the calling thread's counters into S
+ */
+void prof_read(struct prof_sample *s);
+
+/**
+ * Add the cost since START to PHASE of P, then move START to now
+ * so that consecutive phases can be chained.
+ */
+void prof_since(struct prof_sample *start, struct prof_probe *p, enum prof_phases phase);
+
+/**
+ * Start R empty, histograms are only allocated once something is recorded
+ */
+void prof_report_init(struct prof_report *r);
+
+/**
+ * Free the histograms of R, it can be initialized again
+ */
+void prof_report_free(struct prof_report *r);
+
+/**
+ * Read the resources used so far by the calling thread into U
+ */
+void prof_usage_read(struct prof_usage *u);
+
+/**
+ * Add the resources used by the calling thread since START to DEST
+ */
+void prof_usage_add_since(struct prof_usage *dest, const struct prof_usage *start);
+
+/**
+ * Add the costs of P to R and reset P for the next probe
+ */
+void prof_record(struct prof_report *r, struct prof_probe *p);
+
+/**
+ * Print avg and p99 of each phase and counter to stdout, each line starting with PREFIX
+ */
+void prof_print(struct prof_report *r, const char *prefix);
+
+#endif
@@ -1,4 +1,5 @@
 #include "protocol.h"
+#include "log.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -9,7 +10,10 @@ static int check_truncation(size_t max_size, size_t actual_size);
 const char *measure_types_strings[] = {
     "NONE",
     "rtt",
-    "thput"
+    "thput",
+    "sink",
+    "source",
+    "bidir"
 };
 
 const char *response_strings[] = {
@@ -24,7 +28,8 @@ size_t default_payload_size_rtt[] = {1, 100, 200, 400, 800, 1000};
 size_t default_payload_size_thput[] = {1 K, 2 K, 4 K, 16 K, 32 K};
 
 char response_is(char *res, enum responses type) {
-    return strcmp(res, response_strings[type]) == 0;
+    // Responses may be followed by extra fields
+    return strncmp(res, response_strings[type], strlen(response_strings[type])) == 0;
 }
 
 char is_valid_hello(msg_hello *msg) {
@@ -36,10 +41,6 @@ char is_valid_hello(msg_hello *msg) {
         return 0;
     }
 
-    if (msg->n_probes < 1) {
-        return 0;
-    }
-
     if (msg->msg_size < 1) {
         return 0;
     }
@@ -68,16 +69,49 @@ char is_valid_bye(msg_bye *msg) {
 }
 
 int hello_to_string(msg_hello *msg, char *dest, size_t *size) {
-    *size = snprintf(dest, MAX_SIZE_HELLO, "%c %s %u %lu %u\n",
+    const char *usage = msg->wants_usage ? " cpu" : "";
+
+    if (!msg->has_tuning) {
+        *size = snprintf(dest, MAX_SIZE_HELLO, "%c %s %u %lu %u%s\n",
+            msg->protocol_phase,
+            measure_types_strings[msg->measure_type],
+            msg->n_probes,
+            msg->msg_size,
+            msg->server_delay,
+            usage);
+
+        return check_truncation(MAX_SIZE_HELLO, *size);
+    }
+
+    *size = snprintf(dest, MAX_SIZE_HELLO, "%c %s %u %lu %u %d %d %s%s\n",
         msg->protocol_phase,
         measure_types_strings[msg->measure_type],
         msg->n_probes,
         msg->msg_size,
-        msg->server_delay);
-    
+        msg->server_delay,
+        msg->tuning.sndbuf,
+        msg->tuning.rcvbuf,
+        msg->tuning.congestion[0] != '\0' ? msg->tuning.congestion : "-",
+        usage);
+
     return check_truncation(MAX_SIZE_HELLO, *size);
 }
 
+int ready_to_string(msg_ready *msg, char *dest, size_t *size) {
+    if (!msg->has_tuning) {
+        *size = snprintf(dest, MAX_SIZE_READY, "%s", response_strings[RESP_READY]);
+        return check_truncation(MAX_SIZE_READY, *size);
+    }
+
+    *size = snprintf(dest, MAX_SIZE_READY, "%s %d %d %s",
+        response_strings[RESP_READY],
+        msg->tuning.sndbuf,
+        msg->tuning.rcvbuf,
+        msg->tuning.congestion[0] != '\0' ? msg->tuning.congestion : "-");
+
+    return check_truncation(MAX_SIZE_READY, *size);
+}
+
 int probe_to_string(msg_probe *msg, char *dest, size_t *size) {
     *size = snprintf(dest, MAX_SIZE_PROBE, "%c %4u %s\n",
         msg->protocol_phase,
@@ -96,28 +130,121 @@ int hello_from_string(const char *str, msg_hello *dest) {
     int scan_res;
     char measure_type[8];
 
-    scan_res = sscanf(str, " %c %s %u %lu %u\n",
+    memset(&(dest->tuning), 0, sizeof(struct sock_tuning));
+
+    scan_res = sscanf(str, " %c %7s %u %lu %u %d %d %15s\n",
         &(dest->protocol_phase),
         measure_type,
         &(dest->n_probes),
         &(dest->msg_size),
-        &(dest->server_delay));
+        &(dest->server_delay),
+        &(dest->tuning.sndbuf),
+        &(dest->tuning.rcvbuf),
+        dest->tuning.congestion);
 
     if (scan_res < EXPECTED_ITEMS_HELLO) {
         return 0;
     }
 
-    if (strcmp(measure_type, measure_types_strings[MEASURE_RTT]) == 0) {
-        dest->measure_type = MEASURE_RTT;
-    } else if (strcmp(measure_type, measure_types_strings[MEASURE_THPUT]) == 0) {
-        dest->measure_type = MEASURE_THPUT;
-    } else {
-        dest->measure_type = 0;
+    dest->has_tuning = scan_res >= EXPECTED_ITEMS_HELLO_TUNING;
+    dest->wants_usage = strstr(str, " cpu") != NULL;
+
+    if (strcmp(dest->tuning.congestion, "-") == 0) {
+        dest->tuning.congestion[0] = '\0';
+    }
+
+    dest->measure_type = 0;
+    for (int i = MEASURE_RTT; i < N_MEASURE_TYPES; i++) {
+        if (strcmp(measure_type, measure_types_strings[i]) == 0) {
+            dest->measure_type = i;
+        }
     }
 
     return 1;
 }
 
+int closing_to_string(msg_closing *msg, char *dest, size_t *size) {
+    *size = snprintf(dest, MAX_SIZE_CLOSING, "%s", response_strings[RESP_CLOSING]);
+
+    if (msg->has_counters) {
+        *size += snprintf(dest + *size, MAX_SIZE_CLOSING - *size, " %lu %lu %lu %lu",
+            msg->rx_bytes,
+            msg->rx_usec,
+            msg->tx_bytes,
+            msg->tx_usec);
+    }
+
+    if (msg->has_usage && *size < MAX_SIZE_CLOSING) {
+        *size += snprintf(dest + *size, MAX_SIZE_CLOSING - *size, " cpu %lu %lu %lu %lu %lu %lu %lu",
+            msg->usage.user_usec,
+            msg->usage.sys_usec,
+            msg->usage.vcsw,
+            msg->usage.ivcsw,
+            msg->usage.minflt,
+            msg->usage.majflt,
+            msg->usage_sessions);
+    }
+
+    return check_truncation(MAX_SIZE_CLOSING, *size);
+}
+
+int closing_from_string(const char *str, msg_closing *dest) {
+    int scan_res;
+    const char *usage;
+    size_t prefix_len = strlen(response_strings[RESP_CLOSING]);
+
+    memset(dest, 0, sizeof(msg_closing));
+
+    if (strncmp(str, response_strings[RESP_CLOSING], prefix_len) != 0) {
+        return 0;
+    }
+
+    scan_res = sscanf(str + prefix_len, " %lu %lu %lu %lu",
+        &(dest->rx_bytes),
+        &(dest->rx_usec),
+        &(dest->tx_bytes),
+        &(dest->tx_usec));
+
+    dest->has_counters = scan_res >= EXPECTED_ITEMS_CLOSING_COUNTERS;
+
+    usage = strstr(str + prefix_len, " cpu ");
+
+    if (usage != NULL) {
+        scan_res = sscanf(usage, " cpu %lu %lu %lu %lu %lu %lu %lu",
+            &(dest->usage.user_usec),
+            &(dest->usage.sys_usec),
+            &(dest->usage.vcsw),
+            &(dest->usage.ivcsw),
+            &(dest->usage.minflt),
+            &(dest->usage.majflt),
+            &(dest->usage_sessions));
+
+        dest->has_usage = scan_res >= EXPECTED_ITEMS_CLOSING_USAGE;
+    }
+
+    return 1;
+}
+
+int ready_from_string(const char *str, msg_ready *dest) {
+    int scan_res;
+    size_t prefix_len = strlen(response_strings[RESP_READY]);
+
+    memset(dest, 0, sizeof(msg_ready));
+
+    if (strncmp(str, response_strings[RESP_READY], prefix_len) != 0) {
+        return 0;
+    }
+
+    scan_res = sscanf(str + prefix_len, " %d %d %15s",
+        &(dest->tuning.sndbuf),
+        &(dest->tuning.rcvbuf),
+        dest->tuning.congestion);
+
+    dest->has_tuning = scan_res >= EXPECTED_ITEMS_READY_TUNING;
+
+    return 1;
+}
+
 int probe_from_string(const char *str, msg_probe *dest) {
     int scan_res;
 
@@ -143,6 +270,45 @@ int bye_from_string(const char *str, msg_bye *dest) {
     return 1;
 }
 
+void probe_stream_init(probe_stream *ps, unsigned int n_probes) {
+    ps->expected_seq = 1;
+    ps->n_probes = n_probes;
+    ps->header_len = 0;
+}
+
+ssize_t probe_stream_feed(probe_stream *ps, const char *buf, size_t len) {
+    msg_probe probe;
+    size_t i;
+
+    for (i = 0; i < len && !probe_stream_done(ps); i++) {
+        if (buf[i] != '\n') {
+            // Only the head of the probe matters, the payload is skipped
+            if (ps->header_len < PROBE_HEADER_SIZE - 1) {
+                ps->header[ps->header_len] = buf[i];
+                ps->header_len += 1;
+            }
+            continue;
+        }
+
+        ps->header[ps->header_len] = '\0';
+        ps->header_len = 0;
+
+        if (!probe_from_string(ps->header, &probe)
+            || !is_valid_probe(&probe, ps->expected_seq)
+        ) {
+            return -1;
+        }
+
+        ps->expected_seq += 1;
+    }
+
+    return i;
+}
+
+char probe_stream_done(probe_stream *ps) {
+    return ps->expected_seq > ps->n_probes;
+}
+
 char *new_payload(size_t size) {
     char *payload = calloc(size + 1, sizeof(char));
 
@@ -158,7 +324,7 @@ char *new_payload(size_t size) {
 
 static int check_truncation(size_t max_size, size_t actual_size) {
     if (actual_size >= max_size) {
-        fprintf(stderr, "Output was truncated. Increase DEST size to %lu bytes at least", actual_size);
+        log_error("Output was truncated. Increase DEST size to %lu bytes at least", actual_size);
         return 0;
     }
 
@@ -2,12 +2,28 @@
 #define PROTOCOL_H
 
 #include <stdlib.h>
+#include <sys/types.h>
+
+#include "tuning.h"
+#include "prof.h"
 
 /**
  * Expected items to be parsed by scanf when reading a serialized Hello.
  */
 #define EXPECTED_ITEMS_HELLO 5
 
+/**
+ * Expected items to be parsed by scanf when a serialized Hello also
+ * carries the requested socket tuning.
+ */
+#define EXPECTED_ITEMS_HELLO_TUNING 8
+
+/**
+ * Expected items to be parsed by scanf after the response string when
+ * a serialized Ready carries the server's socket settings.
+ */
+#define EXPECTED_ITEMS_READY_TUNING 3
+
 /**
  * Expected items to be parsed by scanf when reading a serialized Probe.
  * This will be one less than the number of the struct's elements because
@@ -20,6 +36,18 @@
  */
 #define EXPECTED_ITEMS_BYE 1
 
+/**
+ * Expected items to be parsed by scanf after the response string when
+ * a serialized Closing carries the server's byte counters.
+ */
+#define EXPECTED_ITEMS_CLOSING_COUNTERS 4
+
+/**
+ * Expected items to be parsed by scanf after the "cpu" marker when
+ * a serialized Closing carries the server's resource usage.
+ */
+#define EXPECTED_ITEMS_CLOSING_USAGE 7
+
 /**
  * I'm lazy
  */
@@ -28,13 +56,28 @@
 /**
  * Maximum size a serialized Hello can be.
  */
-#define MAX_SIZE_HELLO 32
+#define MAX_SIZE_HELLO 128
+
+/**
+ * Maximum size a serialized Ready response can be.
+ */
+#define MAX_SIZE_READY 96
 
 /**
  * Maximum size a serialized Bye can be.
  */
 #define MAX_SIZE_BYE 4
 
+/**
+ * Maximum size a serialized Closing response can be.
+ */
+#define MAX_SIZE_CLOSING 256
+
+/**
+ * Bytes of a probe kept by a probe_stream to parse its phase and sequence number.
+ */
+#define PROBE_HEADER_SIZE 24
+
 /**
  * Maximum size a serialized Probe can be.
  * Probe size needs to accomodate a max of 32K payload, plus the overhead.
@@ -72,9 +115,17 @@ extern size_t default_payload_size_thput[5];
  */
 enum measure_types {
     MEASURE_RTT = 1,
-    MEASURE_THPUT
+    MEASURE_THPUT,
+    MEASURE_SINK,
+    MEASURE_SOURCE,
+    MEASURE_BIDIR
 };
 
+/**
+ * Number of measure types, including the NONE placeholder at index 0
+ */
+#define N_MEASURE_TYPES 6
+
 /**
  * Actual measure type strings
  */
@@ -91,13 +142,19 @@ enum responses {
     RESP_INVALID_PROBE
 };
 
+/**
+ * Number of responses, including the NONE placeholder at index 0
+ */
+#define N_RESPONSES 5
+
 /**
  * Actual response strings
  */
 extern const char *response_strings[];
 
 /**
- * Hello message
+ * Hello message. WANTS_USAGE asks for the server's resource usage in the
+ * Closing, with a trailing "cpu" marker older servers ignore.
  */
 typedef struct msg_hello_s {
     char protocol_phase;
@@ -105,8 +162,20 @@ typedef struct msg_hello_s {
     unsigned int n_probes;
     size_t msg_size;
     unsigned int server_delay;
+    char has_tuning;
+    struct sock_tuning tuning;
+    char wants_usage;
 } msg_hello;
 
+/**
+ * Ready response. Carries the server's effective socket settings
+ * when the Hello requested tuning.
+ */
+typedef struct msg_ready_s {
+    char has_tuning;
+    struct sock_tuning tuning;
+} msg_ready;
+
 /**
  * Probe message
  */
@@ -123,13 +192,45 @@ typedef struct msg_bye_s {
     char protocol_phase;
 } msg_bye;
 
+/**
+ * Closing response. For the streaming measure types (sink, source, bidir)
+ * it carries what the server received and transmitted, durations are from
+ * first to last byte.
+ * It can also carry the resources the server used during the measurement
+ * phase, after a "cpu" marker, only when the Hello asked for them. They are
+ * the serving thread's, shared by USAGE_SESSIONS sessions (this one
+ * included) that were measured meanwhile.
+ */
+typedef struct msg_closing_s {
+    char has_counters;
+    unsigned long rx_bytes;
+    unsigned long rx_usec;
+    unsigned long tx_bytes;
+    unsigned long tx_usec;
+    char has_usage;
+    struct prof_usage usage;
+    unsigned long usage_sessions;
+} msg_closing;
+
+/**
+ * Incremental parser for a stream of probes that are not echoed,
+ * so payloads can be dropped as they arrive instead of buffered.
+ */
+typedef struct probe_stream_s {
+    unsigned int expected_seq;
+    unsigned int n_probes;
+    char header[PROBE_HEADER_SIZE];
+    size_t header_len;
+} probe_stream;
+
 /**
  * Check if response (as string) matches the specified response from [enum responses]
  */
 char response_is(char *res, enum responses type);
 
 /**
- * Check if the provided Hello message is valid
+ * Check if the provided Hello message is valid.
+ * A Hello with no probes is valid, the measurement phase is skipped.
  */
 char is_valid_hello(msg_hello *msg);
 
@@ -150,6 +251,12 @@ char is_valid_bye(msg_bye *msg);
  */
 int hello_to_string(msg_hello *msg, char *dest, size_t *size);
 
+/**
+ * Serialize a Ready struct to its corresponding response string.
+ * String actual length (without terminator) is written in SIZE
+ */
+int ready_to_string(msg_ready *msg, char *dest, size_t *size);
+
 /**
  * Serialize an Probe struct to its corresponding string representation to be sent via socket.
  * String actual length is written in SIZE
@@ -167,6 +274,22 @@ int bye_to_string(msg_bye *msg, char *dest, size_t *size);
  */
 int hello_from_string(const char *str, msg_hello *dest);
 
+/**
+ * Serialize a Closing struct to its corresponding response string.
+ * String actual length (without terminator) is written in SIZE
+ */
+int closing_to_string(msg_closing *msg, char *dest, size_t *size);
+
+/**
+ * Deserialize a Closing response, including the optional server counters and usage
+ */
+int closing_from_string(const char *str, msg_closing *dest);
+
+/**
+ * Deserialize a Ready response, including the optional server socket settings
+ */
+int ready_from_string(const char *str, msg_ready *dest);
+
 /**
  * Deserialize input string to its corresponding Probe struct.
  * Note that we don't bother reading the payload.
@@ -178,6 +301,23 @@ int probe_from_string(const char *str, msg_probe *dest);
  */
 int bye_from_string(const char *str, msg_bye *dest);
 
+/**
+ * Get ready to parse a stream of N_PROBES probes
+ */
+void probe_stream_init(probe_stream *ps, unsigned int n_probes);
+
+/**
+ * Feed up to LEN bytes of the stream to the parser, validating each probe.
+ * Stops right after the last expected probe, so what follows can be parsed separately.
+ * Returns the number of bytes consumed, -1 if an invalid probe was found.
+ */
+ssize_t probe_stream_feed(probe_stream *ps, const char *buf, size_t len);
+
+/**
+ * Check if all the expected probes have been received
+ */
+char probe_stream_done(probe_stream *ps);
+
 /**
  * Allocate a new random payload of SIZE bytes
  */
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <argp.h>
+#include <arpa/inet.h>
+
+#include "store.h"
+#include "protocol.h"
+#include "log.h"
+
+/**
+ * Trend buckets when none is given: an hour
+ */
+#define DEFAULT_TREND_SEC 3600
+
+enum query_commands {
+    CMD_LIST,
+    CMD_TREND,
+    CMD_DIFF
+};
+
+struct query_config {
+    const char *path;
+    enum query_commands command;
+    const char *diff_a;
+    const char *diff_b;
+    char has_addr;
+    struct in_addr addr;
+    unsigned short port;
+    int measure_type;
+    size_t payload_size;
+    const char *label;
+    uint64_t since_ns;
+    uint64_t until_ns;
+    uint64_t trend_ns;
+};
+
+/**
+ * Runs aggregated by trend and diff. A single run keeps its own percentiles,
+ * several get those of their merged buckets. MEAN is weighted by the probes.
+ */
+struct run_summary {
+    unsigned long runs;
+    uint64_t count;
+    uint64_t min;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    uint64_t max;
+    double thput_bps;
+    uint64_t buckets[STORE_BUCKETS];
+};
+
+static char doc[] = "Query the results store written by the client.\v"
+    "Commands:\n"
+    "  list          One line per run\n"
+    "  trend         Runs aggregated by time, see --bucket\n"
+    "  diff A B      Compare two runs, or two sets of runs. A and B are run numbers as printed by list,\n"
+    "                or label:NAME for all the runs with that label (e.g. two builds)";
+static char args_doc[] = "STORE [list | trend | diff A B]";
+
+static struct argp_option options[] = {
+    {"target", 't', "ADDR[:PORT]", 0, "Only runs against this server", 1},
+    {"measure", 'm', "TYPE", 0, "Only runs of this measure type", 1},
+    {"size", 's', "BYTES", 0, "Only runs with this payload size", 1},
+    {"label", 'l', "LABEL", 0, "Only runs with this label", 1},
+    {"since", 'f', "TIME", 0, "Only runs from TIME on: unix seconds, YYYY-MM-DD[THH:MM[:SS]] (UTC) or -N{s|m|h|d} ago", 1},
+    {"until", 'u', "TIME", 0, "Only runs before TIME", 1},
+    {"bucket", 'b', "SEC", 0, "Trend bucket width. Defaults to 3600.", 2},
+    {0}
+};
+
+static error_t arg_parser(int key, char *arg, struct argp_state *state);
+static void parse_target(const char *arg, struct query_config *config);
+static void parse_measure_type(const char *arg, struct query_config *config);
+static uint64_t parse_time(const char *arg);
+static char matches(const struct store_record *rec);
+static const struct store_record *next_match(uint64_t *cursor);
+static void run_list();
+static void run_trend();
+static void run_diff();
+static int summarize(const char *spec, struct run_summary *dest);
+static void summary_add(struct run_summary *s, const struct store_record *rec);
+static void summary_finish(struct run_summary *s);
+static double pooled_percentile(const struct run_summary *s, double p);
+static void print_record(uint64_t idx, const struct store_record *rec);
+static void print_row(const char *name, double a, double b);
+static void format_time(uint64_t time_ns, char *dest, size_t size);
+
+static struct argp argp = {options, arg_parser, args_doc, doc, 0, 0, 0};
+static struct query_config config;
+static struct store store;
+
+int main(int argc, char **argv) {
+    memset(&config, 0, sizeof(struct query_config));
+    config.until_ns = UINT64_MAX;
+    config.trend_ns = (uint64_t)DEFAULT_TREND_SEC * 1000000000;
+
+    if (!log_init(LOG_INFO)) {
+        exit(1);
+    }
+
+    if (argp_parse(&argp, argc, argv, 0, 0, &config) != 0) {
+        log_error("Some error occurred while parsing arguments");
+        exit(1);
+    }
+
+    if (!store_open(&store, config.path, 0)) {
+        exit(1);
+    }
+
+    switch (config.command) {
+        case CMD_LIST : run_list(); break;
+        case CMD_TREND: run_trend(); break;
+        case CMD_DIFF : run_diff(); break;
+    }
+
+    store_close(&store);
+    return 0;
+}
+
+static void run_list() {
+    const struct store_record *rec;
+    uint64_t cursor = 0;
+    unsigned long n = 0;
+
+    printf("%8s %-20s %-21s %-6s %6s %6s %6s %-15s %10s %10s %10s %10s\n", "run", "time (UTC)", "target",
+        "type", "bytes", "delay", "probes", "label", "avg ms", "p50 ms", "p99 ms", "max ms");
+
+    while ((rec = next_match(&cursor)) != NULL) {
+        print_record(cursor - 1, rec);
+        n += 1;
+    }
+
+    printf("\n%lu runs\n", n);
+}
+
+static void run_trend() {
+    const struct store_record *rec;
+    struct run_summary s;
+    uint64_t bucket = UINT64_MAX, cursor = 0;
+    char timestamp[32];
+
+    printf("%-20s %8s %10s %10s %10s %10s %10s\n", "from (UTC)", "runs", "probes", "avg ms", "p50 ms", "p99 ms", "max ms");
+
+    memset(&s, 0, sizeof(struct run_summary));
+
+    // Runs are appended as they happen, so buckets come in order
+    while ((rec = next_match(&cursor)) != NULL) {
+        if (rec->time_ns / config.trend_ns != bucket && s.runs > 0) {
+            summary_finish(&s);
+            format_time(bucket * config.trend_ns, timestamp, sizeof(timestamp));
+            printf("%-20s %8lu %10lu %10.6f %10.6f %10.6f %10.6f\n", timestamp, s.runs, s.count,
+                s.mean / 1000000, s.p50 / 1000000, s.p99 / 1000000, s.max / 1000000.0);
+            memset(&s, 0, sizeof(struct run_summary));
+        }
+
+        bucket = rec->time_ns / config.trend_ns;
+        summary_add(&s, rec);
+    }
+
+    if (s.runs > 0) {
+        summary_finish(&s);
+        format_time(bucket * config.trend_ns, timestamp, sizeof(timestamp));
+        printf("%-20s %8lu %10lu %10.6f %10.6f %10.6f %10.6f\n", timestamp, s.runs, s.count,
+            s.mean / 1000000, s.p50 / 1000000, s.p99 / 1000000, s.max / 1000000.0);
+    }
+}
+
+static void run_diff() {
+    struct run_summary a, b;
+    uint64_t total_a = 0, total_b = 0;
+
+    if (!summarize(config.diff_a, &a) || !summarize(config.diff_b, &b)) {
+        exit(1);
+    }
+
+    printf("%-12s %14s %14s %10s\n", "", config.diff_a, config.diff_b, "change");
+    print_row("runs", a.runs, b.runs);
+    print_row("probes", a.count, b.count);
+    print_row("avg ms", a.mean / 1000000, b.mean / 1000000);
+    print_row("p50 ms", a.p50 / 1000000, b.p50 / 1000000);
+    print_row("p90 ms", a.p90 / 1000000, b.p90 / 1000000);
+    print_row("p99 ms", a.p99 / 1000000, b.p99 / 1000000);
+    print_row("p99.9 ms", a.p999 / 1000000, b.p999 / 1000000);
+    print_row("max ms", a.max / 1000000.0, b.max / 1000000.0);
+
+    if (a.thput_bps > 0 || b.thput_bps > 0) {
+        print_row("kbits/sec", a.thput_bps / 1000, b.thput_bps / 1000);
+    }
+
+    for (int i = 0; i < STORE_BUCKETS; i++) {
+        total_a += a.buckets[i];
+        total_b += b.buckets[i];
+    }
+
+    printf("\n%-12s %14s %14s\n", "RTT", "% of probes", "% of probes");
+
+    for (int i = 0; i < STORE_BUCKETS; i++) {
+        if (a.buckets[i] == 0 && b.buckets[i] == 0) {
+            continue;
+        }
+
+        printf("< %-10.6f %14.2f %14.2f\n", ((uint64_t)2 << i) / 1000000.0,
+            total_a > 0 ? a.buckets[i] * 100.0 / total_a : 0, total_b > 0 ? b.buckets[i] * 100.0 / total_b : 0);
+    }
+}
+
+/**
+ * SPEC is a run number, or label:NAME for all matching runs with that label
+ */
+static int summarize(const char *spec, struct run_summary *dest) {
+    const struct store_record *rec;
+    const char *label = config.label;
+    char *end;
+    uint64_t idx, cursor = 0;
+
+    memset(dest, 0, sizeof(struct run_summary));
+
+    if (strncmp(spec, "label:", 6) == 0) {
+        config.label = spec + 6;
+
+        while ((rec = next_match(&cursor)) != NULL) {
+            summary_add(dest, rec);
+        }
+
+        config.label = label;
+    } else {
+        idx = strtoull(spec, &end, 10);
+
+        if (*end != '\0' || idx >= store.n_records) {
+            log_error("No run %s", spec);
+            return 0;
+        }
+
+        summary_add(dest, store_get(&store, idx));
+    }
+
+    if (dest->runs == 0) {
+        log_error("No runs match %s", spec);
+        return 0;
+    }
+
+    summary_finish(dest);
+    return 1;
+}
+
+static void summary_add(struct run_summary *s, const struct store_record *rec) {
+    if (s->runs == 0 || rec->min < s->min) s->min = rec->min;
+
+    s->runs += 1;
+    s->count += rec->count;
+    s->mean += rec->mean * rec->count;
+    s->p50 += rec->p50;
+    s->p90 += rec->p90;
+    s->p99 += rec->p99;
+    s->p999 += rec->p999;
+    s->thput_bps += rec->thput_bps;
+
+    if (rec->max > s->max) s->max = rec->max;
+
+    for (int i = 0; i < STORE_BUCKETS; i++) {
+        s->buckets[i] += rec->buckets[i];
+    }
+}
+
+static void summary_finish(struct run_summary *s) {
+    s->mean = s->count > 0 ? s->mean / s->count : 0;
+    s->thput_bps /= s->runs;
+
+    // Averaging the runs' own percentiles would give a short run as much say as a long one
+    if (s->runs > 1) {
+        s->p50 = pooled_percentile(s, 50);
+        s->p90 = pooled_percentile(s, 90);
+        s->p99 = pooled_percentile(s, 99);
+        s->p999 = pooled_percentile(s, 99.9);
+    }
+}
+
+/**
+ * Values are taken as evenly spread within a bucket, so the percentile is
+ * only as precise as its power of two bucket. It's kept within the runs'
+ * min and max.
+ */
+static double pooled_percentile(const struct run_summary *s, double p) {
+    double rank, low, high, value;
+    uint64_t total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < STORE_BUCKETS; i++) {
+        total += s->buckets[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    rank = p / 100 * total;
+
+    for (i = 0; i < STORE_BUCKETS - 1 && seen + s->buckets[i] < rank; i++) {
+        seen += s->buckets[i];
+    }
+
+    low = i > 0 ? (double)((uint64_t)1 << i) : 0;
+    high = i < STORE_BUCKETS - 1 ? (double)((uint64_t)2 << i) : (double)s->max;
+    value = s->buckets[i] > 0 ? low + (rank - seen) / s->buckets[i] * (high - low) : low;
+
+    if (value < s->min) value = s->min;
+    if (value > s->max) value = s->max;
+
+    return value;
+}
+
+static char matches(const struct store_record *rec) {
+    if (rec->time_ns < config.since_ns || rec->time_ns >= config.until_ns) return 0;
+    if (config.has_addr && rec->addr != config.addr.s_addr) return 0;
+    if (config.port != 0 && rec->port != config.port) return 0;
+    if (config.measure_type != 0 && rec->measure_type != config.measure_type) return 0;
+    if (config.payload_size != 0 && rec->payload_size != config.payload_size) return 0;
+    if (config.label != NULL && strncmp(rec->label, config.label, STORE_LABEL_SIZE) != 0) return 0;
+    return 1;
+}
+
+/**
+ * The next run from CURSOR on matching the filters, NULL if none is left.
+ * Blocks out of the time range are skipped without reading their records.
+ */
+static const struct store_record *next_match(uint64_t *cursor) {
+    const struct store_block *block;
+    const struct store_record *rec;
+
+    while (*cursor < store.n_records) {
+        if (*cursor % STORE_BLOCK_RECORDS == 0) {
+            block = store_block(&store, *cursor / STORE_BLOCK_RECORDS);
+
+            if (block->max_time_ns < config.since_ns || block->min_time_ns >= config.until_ns) {
+                *cursor += STORE_BLOCK_RECORDS;
+                continue;
+            }
+        }
+
+        rec = store_get(&store, (*cursor)++);
+
+        if (matches(rec)) {
+            return rec;
+        }
+    }
+
+    return NULL;
+}
+
+static void print_record(uint64_t idx, const struct store_record *rec) {
+    char timestamp[32], target[INET_ADDRSTRLEN + 6];
+    struct in_addr addr;
+
+    addr.s_addr = rec->addr;
+    format_time(rec->time_ns, timestamp, sizeof(timestamp));
+    snprintf(target, sizeof(target), "%s:%u", inet_ntoa(addr), rec->port);
+
+    printf("%8lu %-20s %-21s %-6s %6u %6u %6lu %-15.15s %10.6f %10.6f %10.6f %10.6f\n", idx, timestamp, target,
+        rec->measure_type < N_MEASURE_TYPES ? measure_types_strings[rec->measure_type] : "?",
+        rec->payload_size, rec->server_delay, rec->count, rec->label[0] != '\0' ? rec->label : "-",
+        rec->mean / 1000000, rec->p50 / 1000000.0, rec->p99 / 1000000.0, rec->max / 1000000.0);
+}
+
+static void print_row(const char *name, double a, double b) {
+    if (a == 0) {
+        printf("%-12s %14.8g %14.8g %10s\n", name, a, b, "-");
+        return;
+    }
+
+    printf("%-12s %14.8g %14.8g %+9.1f%%\n", name, a, b, (b - a) / a * 100);
+}
+
+static void format_time(uint64_t time_ns, char *dest, size_t size) {
+    time_t secs = time_ns / 1000000000;
+    struct tm tm;
+
+    gmtime_r(&secs, &tm);
+    strftime(dest, size, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+static error_t arg_parser(int key, char *arg, struct argp_state *state) {
+    struct query_config *config = state->input;
+
+    switch (key) {
+        case 't': parse_target(arg, config); break;
+        case 'm': parse_measure_type(arg, config); break;
+        case 's': config->payload_size = atol(arg); break;
+        case 'l': config->label = arg; break;
+        case 'f': config->since_ns = parse_time(arg); break;
+        case 'u': config->until_ns = parse_time(arg); break;
+        case 'b': config->trend_ns = atof(arg) * 1000000000; break;
+
+        case ARGP_KEY_ARG:
+            switch (state->arg_num) {
+                case 0: config->path = arg; break;
+                case 1:
+                    if (strcmp(arg, "list") == 0) config->command = CMD_LIST;
+                    else if (strcmp(arg, "trend") == 0) config->command = CMD_TREND;
+                    else if (strcmp(arg, "diff") == 0) config->command = CMD_DIFF;
+                    else argp_usage(state);
+                    break;
+                case 2: config->diff_a = arg; break;
+                case 3: config->diff_b = arg; break;
+                default: argp_usage(state);
+            }
+            break;
+
+        case ARGP_KEY_END:
+            if (state->arg_num < 1 || (config->command == CMD_DIFF && state->arg_num != 4)) {
+                argp_usage(state);
+            }
+            if (config->trend_ns == 0) {
+                log_error("Invalid bucket width");
+                exit(1);
+            }
+    }
+
+    return 0;
+}
+
+static void parse_target(const char *arg, struct query_config *config) {
+    char addr[INET_ADDRSTRLEN];
+    const char *colon = strchr(arg, ':');
+    size_t len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+
+    if (len >= sizeof(addr)) {
+        log_error("Invalid target");
+        exit(1);
+    }
+
+    memcpy(addr, arg, len);
+    addr[len] = '\0';
+
+    if (inet_aton(addr, &(config->addr)) == 0) {
+        log_error("Invalid target");
+        exit(1);
+    }
+
+    config->has_addr = 1;
+    config->port = colon != NULL ? atoi(colon + 1) : 0;
+}
+
+static void parse_measure_type(const char *arg, struct query_config *config) {
+    for (int i = 1; i < N_MEASURE_TYPES; i++) {
+        if (strcmp(measure_types_strings[i], arg) == 0) {
+            config->measure_type = i;
+            return;
+        }
+    }
+
+    log_error("Invalid measure type");
+    exit(1);
+}
+
+static uint64_t parse_time(const char *arg) {
+    struct tm tm;
+    char *end;
+    double value;
+    const char *units = "smhd";
+    const double unit_secs[] = {1, 60, 3600, 86400};
+
+    if (arg[0] == '-') {
+        value = strtod(arg + 1, &end);
+
+        if (end != arg + 1 && strlen(end) == 1 && strchr(units, *end) != NULL) {
+            return (uint64_t)(time(NULL) - value * unit_secs[strchr(units, *end) - units]) * 1000000000;
+        }
+    } else {
+        value = strtod(arg, &end);
+
+        if (*end == '\0') {
+            return (uint64_t)(value * 1000000000);
+        }
+
+        memset(&tm, 0, sizeof(struct tm));
+        end = strptime(arg, "%Y-%m-%d", &tm);
+
+        if (end != NULL && *end == 'T') {
+            end = strptime(end + 1, "%H:%M", &tm);
+            if (end != NULL && *end == ':') end = strptime(end + 1, "%S", &tm);
+        }
+
+        if (end != NULL && *end == '\0') {
+            return (uint64_t)timegm(&tm) * 1000000000;
+        }
+    }
+
+    log_error("Invalid time '%s'", arg);
+    exit(1);
+}
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+
+#include "scenario.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCENARIO_MAX_LINE 4096
+#define SCENARIO_MAX_PARALLEL 1024
+
+/**
+ * The values a matrix line lists for each key, an empty list means the default
+ */
+struct matrix_line {
+    unsigned long types[SCENARIO_MAX_VALUES];
+    int n_types;
+    unsigned long sizes[SCENARIO_MAX_VALUES];
+    int n_sizes;
+    unsigned long probes[SCENARIO_MAX_VALUES];
+    int n_probes;
+    unsigned long delays[SCENARIO_MAX_VALUES];
+    int n_delays;
+    unsigned long parallel[SCENARIO_MAX_VALUES];
+    int n_parallel;
+    int targets[SCENARIO_MAX_VALUES];
+    int n_targets;
+};
+
+static int parse_directive(char *line, const struct scenario_defaults *defaults, struct scenario_plan *plan);
+static int parse_matrix(char *args, const struct scenario_defaults *defaults, struct scenario_plan *plan);
+static int parse_list(const char *values, unsigned long *dest, int *n, unsigned long min, unsigned long max);
+static int parse_types(const char *values, struct matrix_line *m);
+static int parse_targets(const char *values, struct matrix_line *m, struct scenario_plan *plan);
+static int add_target(struct scenario_plan *plan, const struct mesh_target *target);
+static int expand(struct matrix_line *m, struct scenario_plan *plan);
+static int add_scenario(struct scenario_plan *plan, enum measure_types type, size_t size, unsigned int n_probes,
+    unsigned int delay, int parallel, int target);
+static void finish_run(struct scenario_plan *plan, struct scenario *sc, struct mesh_result *results,
+    scenario_run_cb cb, void *ctx);
+
+static const char *path;
+static int line_no;
+static histogram run_rtt;
+
+int scenario_parse(const char *scenario_path, const struct scenario_defaults *defaults, struct scenario_plan *plan) {
+    char line[SCENARIO_MAX_LINE];
+    FILE *file;
+    int ok = 1;
+
+    memset(plan, 0, sizeof(struct scenario_plan));
+    plan->repeat = 1;
+    plan->concurrency = 1;
+    plan->randomize = 1;
+    plan->seed = time(NULL) ^ getpid();
+
+    path = scenario_path;
+    line_no = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        log_perror("Cannot open scenario file");
+        return 0;
+    }
+
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        line_no += 1;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        if (line[strspn(line, " \t")] != '\0') {
+            ok = parse_directive(line, defaults, plan);
+        }
+    }
+
+    fclose(file);
+
+    if (ok && plan->n_scenarios == 0) {
+        log_error("%s: no scenarios", path);
+        ok = 0;
+    }
+
+    if (!ok) {
+        scenario_free(plan);
+    }
+
+    return ok;
+}
+
+int scenario_run(struct scenario_plan *plan, scenario_run_cb cb, void *ctx) {
+    struct mesh_config mesh_config;
+    struct mesh_target *targets;
+    struct mesh_params *params;
+    struct mesh_result *results;
+    struct scenario *sc;
+    int n_runs = plan->n_scenarios * plan->repeat, max_sessions = plan->concurrency;
+    int *order, n_sessions, next, tmp, ok = 1;
+    size_t max_size = 0;
+
+    for (int i = 0; i < plan->n_scenarios; i++) {
+        if (plan->scenarios[i].parallel > max_sessions) {
+            max_sessions = plan->scenarios[i].parallel;
+        }
+        if (plan->scenarios[i].params.payload_size > max_size) {
+            max_size = plan->scenarios[i].params.payload_size;
+        }
+    }
+
+    // Buffers, event loop and session slots for the largest wave, reused by all of them
+    if (!mesh_init(max_sessions, max_size)) {
+        return 0;
+    }
+
+    order = malloc(n_runs * sizeof(int));
+    targets = malloc(max_sessions * sizeof(struct mesh_target));
+    params = malloc(max_sessions * sizeof(struct mesh_params));
+    results = malloc(max_sessions * sizeof(struct mesh_result));
+
+    if (order == NULL || targets == NULL || params == NULL || results == NULL) {
+        log_error("Scenario: out of memory");
+        ok = 0;
+        n_runs = 0;
+    }
+
+    // Repeats go round the whole matrix, so that no scenario gets all its runs at the same time of day
+    for (int i = 0; i < n_runs; i++) {
+        order[i] = i % plan->n_scenarios;
+    }
+
+    if (plan->randomize) {
+        log_info("Running %d scenarios %d times in random order, seed %u", plan->n_scenarios, plan->repeat, plan->seed);
+
+        for (int i = n_runs - 1; i > 0; i--) {
+            next = rand_r(&(plan->seed)) % (i + 1);
+            tmp = order[i];
+            order[i] = order[next];
+            order[next] = tmp;
+        }
+    } else {
+        log_info("Running %d scenarios %d times in file order", plan->n_scenarios, plan->repeat);
+    }
+
+    memset(&mesh_config, 0, sizeof(struct mesh_config));
+    mesh_config.targets = targets;
+    mesh_config.params = params;
+    mesh_config.timeout_sec = plan->timeout_sec;
+
+    // A wave takes runs in order while their sessions fit, a run's sessions always start together
+    for (int first = 0; ok && first < n_runs; first = next) {
+        n_sessions = 0;
+
+        for (next = first; next < n_runs; next++) {
+            sc = &(plan->scenarios[order[next]]);
+
+            if (next > first && n_sessions + sc->parallel > plan->concurrency) {
+                break;
+            }
+
+            for (int k = 0; k < sc->parallel; k++, n_sessions++) {
+                targets[n_sessions] = plan->targets[sc->target];
+                params[n_sessions] = sc->params;
+            }
+        }
+
+        log_info("Runs %d-%d of %d, %d sessions", first + 1, next, n_runs, n_sessions);
+
+        mesh_config.n_targets = n_sessions;
+        mesh_config.concurrency = n_sessions;
+
+        if (!mesh_run(&mesh_config, results)) {
+            ok = 0;
+            break;
+        }
+
+        n_sessions = 0;
+
+        for (int i = first; i < next; i++) {
+            sc = &(plan->scenarios[order[i]]);
+            finish_run(plan, sc, results + n_sessions, cb, ctx);
+            n_sessions += sc->parallel;
+        }
+    }
+
+    mesh_free();
+    free(order);
+    free(targets);
+    free(params);
+    free(results);
+
+    return ok;
+}
+
+void scenario_print(struct scenario_plan *plan, FILE *output) {
+    struct scenario *sc;
+    histogram *h;
+    char thput[24];
+
+    fprintf(output, "%-5s %-21s %6s %7s %6s %4s %5s %5s %11s %11s %11s %11s %11s %14s\n", "type", "target",
+        "bytes", "probes", "delay", "par", "runs", "fail", "min ms", "p50 ms", "p99 ms", "max ms", "avg ms",
+        "thput kbit/s");
+
+    for (int i = 0; i < plan->n_scenarios; i++) {
+        sc = &(plan->scenarios[i]);
+        h = &(sc->rtt);
+
+        snprintf(thput, sizeof(thput), "%.3f", sc->thput_runs > 0 ? sc->thput_bps_sum / sc->thput_runs / 1000 : 0);
+
+        fprintf(output, "%-5s %-21s %6lu %7u %6u %4d %5u %5u %11.6f %11.6f %11.6f %11.6f %11.6f %14s\n",
+            measure_types_strings[sc->params.measure_type], plan->targets[sc->target].name,
+            sc->params.payload_size, sc->params.n_probes, sc->params.server_delay, sc->parallel, sc->runs,
+            sc->failed_sessions, h->count > 0 ? h->min / 1000000.0 : 0, hist_percentile(h, 50) / 1000000.0,
+            hist_percentile(h, 99) / 1000000.0, h->max / 1000000.0, hist_mean(h) / 1000000.0,
+            sc->thput_runs > 0 ? thput : "-");
+    }
+
+    fflush(output);
+}
+
+void scenario_free(struct scenario_plan *plan) {
+    free(plan->targets);
+    free(plan->scenarios);
+    plan->targets = NULL;
+    plan->scenarios = NULL;
+}
+
+/**
+ * Settings for the whole file, or "run" followed by a matrix
+ */
+static int parse_directive(char *line, const struct scenario_defaults *defaults, struct scenario_plan *plan) {
+    char *name = line + strspn(line, " \t");
+    char *arg = name + strcspn(name, " \t");
+    char extra[2];
+    unsigned long value[SCENARIO_MAX_VALUES];
+    int n;
+
+    if (*arg != '\0') {
+        *arg++ = '\0';
+        arg += strspn(arg, " \t");
+    }
+
+    if (strcmp(name, "run") == 0) {
+        return parse_matrix(arg, defaults, plan);
+    }
+
+    if (*arg == '\0' || sscanf(arg, "%*s %1s", extra) == 1) {
+        log_error("%s:%d: '%s' takes a single value", path, line_no, name);
+        return 0;
+    }
+
+    arg[strcspn(arg, " \t")] = '\0';
+
+    if (strcmp(name, "order") == 0) {
+        if (strcmp(arg, "random") != 0 && strcmp(arg, "file") != 0) {
+            log_error("%s:%d: order must be random or file", path, line_no);
+            return 0;
+        }
+
+        plan->randomize = strcmp(arg, "random") == 0;
+        return 1;
+    }
+
+    if (strcmp(name, "concurrency") == 0 && parse_list(arg, value, &n, 1, SCENARIO_MAX_PARALLEL) && n == 1) {
+        plan->concurrency = value[0];
+        return 1;
+    }
+
+    if (strcmp(name, "repeat") == 0 && parse_list(arg, value, &n, 1, 100000) && n == 1) {
+        plan->repeat = value[0];
+        return 1;
+    }
+
+    if (strcmp(name, "seed") == 0 && parse_list(arg, value, &n, 0, UINT32_MAX) && n == 1) {
+        plan->seed = value[0];
+        return 1;
+    }
+
+    log_error("%s:%d: invalid '%s'", path, line_no, name);
+    return 0;
+}
+
+/**
+ * KEY=VALUE[,VALUE...] pairs, the whole line after "run"
+ */
+static int parse_matrix(char *args, const struct scenario_defaults *defaults, struct scenario_plan *plan) {
+    struct matrix_line m;
+    char *save, *item, *value;
+    int ok = 1;
+
+    memset(&m, 0, sizeof(struct matrix_line));
+
+    for (item = strtok_r(args, " \t", &save); ok && item != NULL; item = strtok_r(NULL, " \t", &save)) {
+        value = strchr(item, '=');
+
+        if (value == NULL) {
+            log_error("%s:%d: '%s' must be KEY=VALUE", path, line_no, item);
+            return 0;
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(item, "type") == 0) {
+            ok = parse_types(value, &m);
+        } else if (strcmp(item, "size") == 0) {
+            ok = parse_list(value, m.sizes, &(m.n_sizes), 1, 32 K);
+        } else if (strcmp(item, "probes") == 0) {
+            ok = parse_list(value, m.probes, &(m.n_probes), 1, UINT32_MAX);
+        } else if (strcmp(item, "delay") == 0) {
+            ok = parse_list(value, m.delays, &(m.n_delays), 0, UINT32_MAX);
+        } else if (strcmp(item, "parallel") == 0) {
+            ok = parse_list(value, m.parallel, &(m.n_parallel), 1, SCENARIO_MAX_PARALLEL);
+        } else if (strcmp(item, "target") == 0) {
+            ok = parse_targets(value, &m, plan);
+        } else {
+            log_error("%s:%d: unknown key '%s'", path, line_no, item);
+            return 0;
+        }
+
+        if (!ok) {
+            log_error("%s:%d: invalid %s '%s'", path, line_no, item, value);
+            return 0;
+        }
+    }
+
+    // Fill in the defaults
+    if (m.n_types == 0) {
+        m.types[m.n_types++] = MEASURE_RTT;
+    }
+    if (m.n_probes == 0) {
+        m.probes[m.n_probes++] = defaults->n_probes;
+    }
+    if (m.n_delays == 0) {
+        m.delays[m.n_delays++] = defaults->server_delay;
+    }
+    if (m.n_parallel == 0) {
+        m.parallel[m.n_parallel++] = 1;
+    }
+
+    for (int i = 0; m.n_targets == 0 && i < defaults->n_targets && i < SCENARIO_MAX_VALUES; i++) {
+        if ((m.targets[i] = add_target(plan, &(defaults->targets[i]))) == -1) {
+            return 0;
+        }
+    }
+
+    if (m.n_targets == 0 && defaults->n_targets > 0) {
+        m.n_targets = defaults->n_targets < SCENARIO_MAX_VALUES ? defaults->n_targets : SCENARIO_MAX_VALUES;
+    } else if (m.n_targets == 0) {
+        log_error("%s:%d: no target, and none given on the command line", path, line_no);
+        return 0;
+    }
+
+    return expand(&m, plan);
+}
+
+/**
+ * Comma separated numbers within [MIN, MAX]
+ */
+static int parse_list(const char *values, unsigned long *dest, int *n, unsigned long min, unsigned long max) {
+    const char *p = values;
+    char *end;
+
+    *n = 0;
+
+    while (*n < SCENARIO_MAX_VALUES) {
+        dest[*n] = strtoul(p, &end, 10);
+
+        if (end == p || dest[*n] < min || dest[*n] > max || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+
+        *n += 1;
+
+        if (*end == '\0') {
+            return 1;
+        }
+
+        p = end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Only the echoed measure types, the others can't share a loop with them
+ */
+static int parse_types(const char *values, struct matrix_line *m) {
+    char copy[SCENARIO_MAX_LINE], *save, *item;
+
+    strncpy(copy, values, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (m->n_types == SCENARIO_MAX_VALUES) {
+            return 0;
+        } else if (strcmp(item, measure_types_strings[MEASURE_RTT]) == 0) {
+            m->types[m->n_types++] = MEASURE_RTT;
+        } else if (strcmp(item, measure_types_strings[MEASURE_THPUT]) == 0) {
+            m->types[m->n_types++] = MEASURE_THPUT;
+        } else {
+            return 0;
+        }
+    }
+
+    return m->n_types > 0;
+}
+
+/**
+ * ADDR:PORT[,ADDR:PORT...] or @FILE, like --targets
+ */
+static int parse_targets(const char *values, struct matrix_line *m, struct scenario_plan *plan) {
+    struct mesh_target *targets = NULL;
+    int n = 0, ok = mesh_parse_targets(values, &targets, &n) && n <= SCENARIO_MAX_VALUES;
+
+    for (int i = 0; ok && i < n; i++) {
+        m->targets[i] = add_target(plan, &(targets[i]));
+        ok = m->targets[i] != -1;
+    }
+
+    m->n_targets = ok ? n : 0;
+    free(targets);
+    return ok;
+}
+
+/**
+ * Index of TARGET in the plan, added if it's not there yet.
+ * Returns -1 on failure.
+ */
+static int add_target(struct scenario_plan *plan, const struct mesh_target *target) {
+    struct mesh_target *targets;
+
+    for (int i = 0; i < plan->n_targets; i++) {
+        if (strcmp(plan->targets[i].name, target->name) == 0) {
+            return i;
+        }
+    }
+
+    targets = realloc(plan->targets, (plan->n_targets + 1) * sizeof(struct mesh_target));
+    if (targets == NULL) {
+        log_error("Scenario: out of memory");
+        return -1;
+    }
+
+    plan->targets = targets;
+    plan->targets[plan->n_targets] = *target;
+    return plan->n_targets++;
+}
+
+/**
+ * A scenario for every combination of the line's values
+ */
+static int expand(struct matrix_line *m, struct scenario_plan *plan) {
+    unsigned long sizes[SCENARIO_MAX_VALUES];
+    int n_sizes;
+
+    for (int t = 0; t < m->n_types; t++) {
+        n_sizes = m->n_sizes;
+        memcpy(sizes, m->sizes, sizeof(sizes));
+
+        if (n_sizes == 0 && m->types[t] == MEASURE_RTT) {
+            n_sizes = sizeof default_payload_size_rtt / sizeof default_payload_size_rtt[0];
+            for (int s = 0; s < n_sizes; s++) sizes[s] = default_payload_size_rtt[s];
+        } else if (n_sizes == 0) {
+            n_sizes = sizeof default_payload_size_thput / sizeof default_payload_size_thput[0];
+            for (int s = 0; s < n_sizes; s++) sizes[s] = default_payload_size_thput[s];
+        }
+
+        for (int s = 0; s < n_sizes; s++)
+        for (int p = 0; p < m->n_probes; p++)
+        for (int d = 0; d < m->n_delays; d++)
+        for (int c = 0; c < m->n_parallel; c++)
+        for (int i = 0; i < m->n_targets; i++) {
+            if (!add_scenario(plan, m->types[t], sizes[s], m->probes[p], m->delays[d], m->parallel[c], m->targets[i])) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int add_scenario(struct scenario_plan *plan, enum measure_types type, size_t size, unsigned int n_probes,
+    unsigned int delay, int parallel, int target
+) {
+    struct scenario *scenarios, *sc;
+
+    scenarios = realloc(plan->scenarios, (plan->n_scenarios + 1) * sizeof(struct scenario));
+    if (scenarios == NULL) {
+        log_error("Scenario: out of memory");
+        return 0;
+    }
+
+    plan->scenarios = scenarios;
+    sc = &(plan->scenarios[plan->n_scenarios++]);
+
+    memset(sc, 0, sizeof(struct scenario));
+    sc->params.measure_type = type;
+    sc->params.payload_size = size;
+    sc->params.n_probes = n_probes;
+    sc->params.server_delay = delay;
+    sc->parallel = parallel;
+    sc->target = target;
+    hist_init(&(sc->rtt));
+
+    return 1;
+}
+
+/**
+ * Merge the results of the sessions of a run of SC into it.
+ * Throughput is only counted when every session got all its echoes, over
+ * the time from the first probe sent to the last echo of any of them.
+ */
+static void finish_run(struct scenario_plan *plan, struct scenario *sc, struct mesh_result *results,
+    scenario_run_cb cb, void *ctx
+) {
+    uint64_t bytes = 0, first_ns = UINT64_MAX, last_ns = 0;
+    unsigned int echoed = 0, failed = 0;
+    double thput_bps = 0;
+
+    hist_init(&run_rtt);
+
+    for (int k = 0; k < sc->parallel; k++) {
+        hist_merge(&run_rtt, &(results[k].rtt));
+        echoed += results[k].echoed;
+        bytes += results[k].echoed_bytes;
+        failed += results[k].error[0] != '\0';
+
+        if (results[k].echoed > 0 && results[k].first_sent_ns < first_ns) first_ns = results[k].first_sent_ns;
+        if (results[k].last_echo_ns > last_ns) last_ns = results[k].last_echo_ns;
+    }
+
+    sc->runs += 1;
+    sc->failed_sessions += failed;
+    hist_merge(&(sc->rtt), &run_rtt);
+
+    if (sc->params.measure_type == MEASURE_THPUT && failed == 0 && last_ns > first_ns) {
+        thput_bps = bytes * 8 / ((last_ns - first_ns) / 1000000000.0);
+        sc->thput_bps_sum += thput_bps;
+        sc->thput_runs += 1;
+    }
+
+    if (cb != NULL && run_rtt.count > 0) {
+        cb(sc, &(plan->targets[sc->target]), &run_rtt, echoed, thput_bps, ctx);
+    }
+}
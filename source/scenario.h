@@ -0,0 +1,83 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mesh.h"
+#include "stats.h"
+
+/**
+ * Max values a key of a matrix line can list
+ */
+#define SCENARIO_MAX_VALUES 64
+
+/**
+ * A point of the matrix: a measure against a target, by PARALLEL sessions
+ * at once. The rest is what its runs got to, over all repeats.
+ */
+struct scenario {
+    struct mesh_params params;
+    int target;
+    int parallel;
+    histogram rtt;
+    unsigned int runs;
+    unsigned int failed_sessions;
+    double thput_bps_sum;
+    unsigned int thput_runs;
+};
+
+/**
+ * A scenario file, expanded. Each scenario is run REPEAT times, in file order
+ * or shuffled with SEED, with at most CONCURRENCY sessions open at once.
+ */
+struct scenario_plan {
+    struct mesh_target *targets;
+    int n_targets;
+    struct scenario *scenarios;
+    int n_scenarios;
+    int repeat;
+    int concurrency;
+    char randomize;
+    unsigned int seed;
+    int timeout_sec;
+};
+
+/**
+ * What a matrix line gets for the keys it leaves out. Payload sizes default
+ * to the measure type's, targets to TARGETS if there are any.
+ */
+struct scenario_defaults {
+    unsigned int n_probes;
+    unsigned int server_delay;
+    struct mesh_target *targets;
+    int n_targets;
+};
+
+/**
+ * Called after every run of a scenario with the RTTs of its sessions merged,
+ * the probes they echoed and, for thput, their combined throughput
+ */
+typedef void (*scenario_run_cb)(const struct scenario *sc, const struct mesh_target *target,
+    const histogram *rtt, unsigned int echoed, double thput_bps, void *ctx);
+
+/**
+ * Read the scenario file at PATH into PLAN.
+ * Returns 0 on failure, after saying what's wrong where.
+ */
+int scenario_parse(const char *path, const struct scenario_defaults *defaults, struct scenario_plan *plan);
+
+/**
+ * Run every scenario of PLAN, calling CB with CTX after each run.
+ * Returns 0 on failure.
+ */
+int scenario_run(struct scenario_plan *plan, scenario_run_cb cb, void *ctx);
+
+/**
+ * Write a row per scenario to OUTPUT
+ */
+void scenario_print(struct scenario_plan *plan, FILE *output);
+
+void scenario_free(struct scenario_plan *plan);
+
+#endif
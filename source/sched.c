@@ -0,0 +1,179 @@
+#include "sched.h"
+
+#include <string.h>
+
+static uint64_t eligible_at(struct sched *sc, struct sched_entry *e, uint64_t now);
+static void queue_push(struct sched_queue *q, struct sched_entry *e);
+static struct sched_entry *queue_pop(struct sched_queue *q);
+static void queue_unlink(struct sched_queue *q, struct sched_entry *e);
+
+void sched_init(struct sched *sc, size_t quantum, size_t small_max, uint64_t bulk_rate, sched_echo_cb echo) {
+    memset(sc, 0, sizeof(struct sched));
+    sc->quantum = quantum;
+    sc->small_max = small_max;
+    sc->bulk_rate = bulk_rate;
+    sc->echo = echo;
+}
+
+void sched_entry_init(struct sched_entry *e, void *ctx) {
+    memset(e, 0, sizeof(struct sched_entry));
+    e->ctx = ctx;
+}
+
+char sched_is_bulk(struct sched *sc, size_t len) {
+    return len > sc->small_max;
+}
+
+void sched_push(struct sched *sc, struct sched_entry *e, size_t len, uint64_t now) {
+    e->len = len;
+    e->bulk = sched_is_bulk(sc, len);
+    e->ready_ns = now;
+    e->capped = 0;
+
+    if (!e->bulk) {
+        queue_push(&(sc->small), e);
+        return;
+    }
+
+    // A session starts with a full bucket
+    if (e->refill_ns == 0) {
+        e->tokens = sc->quantum;
+        e->refill_ns = now;
+    }
+
+    queue_push(&(sc->bulk), e);
+}
+
+void sched_remove(struct sched *sc, struct sched_entry *e) {
+    if (e->len == 0) {
+        return;
+    }
+
+    queue_unlink(e->bulk ? &(sc->bulk) : &(sc->small), e);
+    e->len = 0;
+}
+
+uint64_t sched_run(struct sched *sc, uint64_t now) {
+    struct sched_entry *e;
+    uint64_t at, wake = 0;
+    char echoed = 0, eligible = 1;
+
+    // Only those queued so far, a session echoed may push its next probe
+    for (size_t n = sc->small.len; n > 0; n--) {
+        e = queue_pop(&(sc->small));
+        e->len = 0;
+        sc->echo(e->ctx);
+    }
+
+    // Rounds where no probe fits its session's deficit yet are skipped over
+    while (sc->bulk.len > 0 && eligible && !echoed) {
+        eligible = 0;
+
+        for (size_t n = sc->bulk.len; n > 0; n--) {
+            e = queue_pop(&(sc->bulk));
+
+            if (eligible_at(sc, e, now) > now) {
+                e->throttled += !e->capped;
+                e->capped = 1;
+                queue_push(&(sc->bulk), e);
+                continue;
+            }
+
+            eligible = 1;
+            e->deficit += sc->quantum;
+
+            if (e->deficit < e->len) {
+                queue_push(&(sc->bulk), e);
+                continue;
+            }
+
+            // Nothing else is queued for the session, so no credit is kept
+            e->deficit = 0;
+            e->tokens -= e->len;
+            e->len = 0;
+            echoed = 1;
+            sc->echo(e->ctx);
+        }
+    }
+
+    if (sc->small.len > 0) {
+        return now;
+    }
+
+    for (e = sc->bulk.head; e != NULL; e = e->next) {
+        at = eligible_at(sc, e, now);
+
+        if (at == now) {
+            return now;
+        }
+
+        if (wake == 0 || at < wake) {
+            wake = at;
+        }
+    }
+
+    return wake;
+}
+
+/**
+ * Token bucket of the rate cap, a quantum deep. A probe can go as soon as
+ * the bucket isn't in debt, whatever its size, so its echo can take it
+ * below zero.
+ */
+static uint64_t eligible_at(struct sched *sc, struct sched_entry *e, uint64_t now) {
+    if (sc->bulk_rate == 0) {
+        return now;
+    }
+
+    e->tokens += (double)(now - e->refill_ns) * sc->bulk_rate / 1000000000.0;
+    e->refill_ns = now;
+
+    if (e->tokens > sc->quantum) {
+        e->tokens = sc->quantum;
+    }
+
+    if (e->tokens >= 0) {
+        return now;
+    }
+
+    return now + 1 + (uint64_t)(-e->tokens * 1000000000.0 / sc->bulk_rate);
+}
+
+static void queue_push(struct sched_queue *q, struct sched_entry *e) {
+    e->prev = q->tail;
+    e->next = NULL;
+
+    if (q->tail != NULL) {
+        q->tail->next = e;
+    } else {
+        q->head = e;
+    }
+
+    q->tail = e;
+    q->len += 1;
+}
+
+static struct sched_entry *queue_pop(struct sched_queue *q) {
+    struct sched_entry *e = q->head;
+
+    queue_unlink(q, e);
+    return e;
+}
+
+static void queue_unlink(struct sched_queue *q, struct sched_entry *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        q->head = e->next;
+    }
+
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        q->tail = e->prev;
+    }
+
+    e->prev = NULL;
+    e->next = NULL;
+    q->len -= 1;
+}
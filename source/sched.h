@@ -0,0 +1,93 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Default bytes a bulk session may be echoed per round
+ */
+#define SCHED_QUANTUM (16 * 1024)
+
+/**
+ * Default size of the longest RTT class probe, header included
+ */
+#define SCHED_SMALL_PROBE 1024
+
+typedef void (*sched_echo_cb)(void *ctx);
+
+/**
+ * A session's place in the scheduler. LEN is the size of the probe it has
+ * waiting, 0 if none: a session doesn't read on while its probe waits,
+ * so it never has more than one.
+ * DEFICIT and TOKENS are only used by bulk sessions, THROTTLED counts
+ * their probes that had to wait for the rate cap.
+ */
+struct sched_entry {
+    struct sched_entry *prev;
+    struct sched_entry *next;
+    size_t len;
+    char bulk;
+    uint64_t ready_ns;
+    size_t deficit;
+    double tokens;
+    uint64_t refill_ns;
+    char capped;
+    unsigned long throttled;
+    void *ctx;
+};
+
+struct sched_queue {
+    struct sched_entry *head;
+    struct sched_entry *tail;
+    size_t len;
+};
+
+/**
+ * Echo scheduler shared by the sessions of a thread.
+ * Probes up to SMALL_MAX bytes are RTT class and go first, in arrival
+ * order. Bulk ones are echoed by deficit round-robin, QUANTUM bytes per
+ * session and round, each session at most BULK_RATE bytes per second
+ * if not 0.
+ */
+struct sched {
+    size_t quantum;
+    size_t small_max;
+    uint64_t bulk_rate;
+    struct sched_queue small;
+    struct sched_queue bulk;
+    sched_echo_cb echo;
+};
+
+void sched_init(struct sched *sc, size_t quantum, size_t small_max, uint64_t bulk_rate, sched_echo_cb echo);
+
+/**
+ * Prepare the entry of a new session, ECHO will be called with CTX
+ */
+void sched_entry_init(struct sched_entry *e, void *ctx);
+
+/**
+ * Whether probes of LEN bytes are bulk ones
+ */
+char sched_is_bulk(struct sched *sc, size_t len);
+
+/**
+ * Queue a probe of LEN bytes, ready to be echoed since NOW
+ */
+void sched_push(struct sched *sc, struct sched_entry *e, size_t len, uint64_t now);
+
+/**
+ * Take E out of the scheduler, if it's waiting. Its probe won't be echoed.
+ */
+void sched_remove(struct sched *sc, struct sched_entry *e);
+
+/**
+ * Echo every RTT class probe queued so far, then go through a round of the
+ * bulk sessions. Entries are out of the scheduler by the time ECHO is
+ * called for them, it may push them again or free them.
+ * Returns when to run again: NOW if probes are left that can be echoed,
+ * the time the first throttled one can if they all are, 0 if none is left.
+ */
+uint64_t sched_run(struct sched *sc, uint64_t now);
+
+#endif
@@ -1,7 +1,20 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include "utils.h"
 #include "protocol.h"
+#include "tuning.h"
+#include "stream.h"
+#include "pool.h"
+#include "sched.h"
+#include "stats.h"
+#include "evloop.h"
+#include "log.h"
+#include "metrics.h"
+#include "prof.h"
+#include "trace.h"
+#include "udp.h"
+#include "xdp.h"
+#include "sockmap.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -16,9 +29,11 @@
 #include <unistd.h>
 #include <time.h>
 
-#define RECV_BUF_SIZE 33*1024
-#define MAX_CONNECTIONS 16
+#define MAX_CONNECTIONS 4096
 #define SOCK_TIMEOUT_SEC 5
+#define FASTOPEN_QUEUE_LEN 16
+#define SCRATCH_SIZE (64 * 1024)
+#define RATE_REPORT_SEC 1
 
 enum server_states {
     STATE_HELLO = 1,
@@ -29,253 +44,1267 @@ enum server_states {
 
 struct server_config {
     int port;
+    char low_latency;
+    int cpu;
+    char mlock;
+    char fastopen;
+    char profile;
+    char sockmap;
+    int idle_timeout;
+    enum log_levels log_level;
+    int metrics_port;
+    char udp;
+    const char *xdp_ifname;
+    int xdp_queues;
+    size_t quantum;
+    size_t small_probe;
+    uint64_t bulk_rate;
+    struct sock_tuning listen_tuning;
 };
 
-static void state_hello();
-static void state_measure();
-static void state_bye();
-static void state_close();
+/**
+ * A client connection.
+ * Kept small since most of the time sessions are idle: IN holds a buffer of
+ * the smallest pool class, bigger ones are only borrowed while a probe
+ * is in flight and given back once it has been echoed.
+ */
+struct session {
+    unsigned long id;
+    struct ev_io io;
+    struct ev_timer echo_timer;
+    struct ev_timer idle_timer;
+    uint64_t last_activity_ns;
+    uint64_t probe_ready_ns;
+    enum server_states state;
+    msg_hello hello;
+    unsigned int expected_seq;
+
+    // Received bytes not processed yet
+    struct buf in;
+
+    // Bytes at the head of IN waiting for the server delay or the scheduler before being echoed
+    size_t echo_len;
+    struct sched_entry sched;
+
+    // How long probes waited for the scheduler
+    moments queue_delay;
+    uint64_t queue_delay_max;
+
+    // Response bytes the socket didn't take yet
+    struct buf out;
+    size_t out_sent;
+
+    // Streaming measure types
+    probe_stream rx_stream;
+    char rx_active;
+    char *tx_payload;
+    struct buf tx_probe;
+    size_t tx_sent;
+    unsigned int tx_seq;
+    struct stream_counters counters;
+
+    // Probes echoed by the kernel, see session_offload()
+    char offloaded;
+    uint64_t cookie;
+    uint64_t offloaded_bytes;
+
+    // Resources the serving thread had used when the measurement phase began.
+    // Sessions measured at the same time share them: USAGE_SESSIONS counts
+    // those that already were, the ones starting later are counted from
+    // how many had started by then.
+    struct prof_usage usage_start;
+    unsigned long usage_sessions;
+    unsigned long usage_starts;
+
+    // Phase costs of echoed probes, only when profiling
+    struct prof_report *prof;
+    struct prof_probe prof_probe;
+    struct prof_sample prof_start;
+};
+
+static void on_accept(void *ctx, uint32_t events);
+static void on_session_io(void *ctx, uint32_t events);
+static void on_echo_due(void *ctx);
+static void on_sched_due(void *ctx);
+static void on_sched_echo(void *ctx);
+static void on_idle_check(void *ctx);
+static void on_rate_report(void *ctx);
+
+static void session_new(int fd, struct sockaddr_in *addr);
+static void session_read(struct session *s);
+static void session_write(struct session *s);
+static void session_process(struct session *s);
+static void session_update(struct session *s);
+static void session_send(struct session *s, const char *data, size_t len);
+static void session_consume(struct session *s, size_t len);
+static void session_fail(struct session *s);
+static void session_close(struct session *s);
+static char session_busy(struct session *s);
+static void session_set_state(struct session *s, enum server_states state);
+static void session_offload(struct session *s);
+static void session_sync(struct session *s);
+
+static int state_hello(struct session *s);
+static int state_measure(struct session *s);
+static int state_bye(struct session *s);
+
+static int measure_echo(struct session *s);
+static int measure_stream(struct session *s);
+static void start_measure(struct session *s);
+static void schedule_echo(struct session *s, size_t len);
+static void echo_probe(struct session *s, size_t len);
+static void stream_read(struct session *s);
+static void stream_write(struct session *s);
+static void respond_error(struct session *s, enum responses resp);
 
 static void handle_terminate(int sig);
 static error_t arg_parser(int key, char *arg, struct argp_state *state);
 
+/**
+ * Keys of the options with no short name: the letters that would suit them
+ * already mean something else to the client
+ */
+enum long_options {
+    OPT_SMALL_PROBE = 256,
+    OPT_QUANTUM,
+    OPT_BULK_RATE
+};
+
 static char doc[] = "RTT and throughput tester. Server software.";
 static char args_doc[] = "PORT";
-static struct argp_option options[] = {{0}};
+static struct argp_option options[] = {
+    {"low-latency", 'l', 0, 0, "Busy poll non-blocking client sockets", 1},
+    {"cpu", 'c', "CPU", 0, "Pin the server to CPU", 1},
+    {"mlock", 'M', 0, 0, "Lock all memory pages to avoid page faults while echoing", 1},
+    {"profile", 'p', 0, 0, "Count cycles, instructions, cache misses and context switches of each echo phase and report them per session", 1},
+    {"sockmap", 'k', 0, 0, "Echo probes inside the kernel with a sockmap once the Hello is validated", 1},
+    {"fastopen", 'F', 0, 0, "Accept Hello messages carried in the SYN (TCP Fast Open)", 2},
+    {"idle-timeout", 'i', "SEC", 0, "Close sessions with no activity for SEC seconds. Defaults to 5.", 2},
+    {"sndbuf", 'S', "BYTES", 0, "Send buffer size of client sockets, from the handshake on", 2},
+    {"rcvbuf", 'R', "BYTES", 0, "Receive buffer size of client sockets, from the handshake on. Sizes a client asks for in its Hello only come after the window scale is agreed on, so they can't grow the window past it: set this to the largest expected", 2},
+    {"log-level", 'L', "LEVEL", 0, "Most verbose messages to print (error | warn | info | debug). Defaults to 'info'.", 3},
+    {"metrics-port", 'P', "PORT", 0, "Serve Prometheus metrics over HTTP on PORT", 3},
+    {"udp", 'u', 0, 0, "Also reflect UDP datagrams sent to PORT through a regular socket", 4},
+    {"xdp", 'X', "IFACE", 0, "Reflect UDP datagrams to PORT arriving on IFACE with AF_XDP, bypassing the network stack", 4},
+    {"xdp-queues", 'Q', "NUM", 0, "Serve IFACE queues 0 to NUM - 1 with AF_XDP. Defaults to 1.", 4},
+    {"small-probe", OPT_SMALL_PROBE, "BYTES", 0, "Probes up to BYTES long, header included, are RTT class and echoed before any bulk one. Defaults to 1024.", 5},
+    {"quantum", OPT_QUANTUM, "BYTES", 0, "Bytes each bulk session may be echoed per deficit round-robin round. Defaults to 16384.", 5},
+    {"bulk-rate", OPT_BULK_RATE, "RATE", 0, "Echo at most RATE bytes per second to each bulk session (k, M and G suffixes allowed). Kernel echoing is disabled for them. Defaults to no cap.", 5},
+    {0}
+};
 static struct argp argp = {options, arg_parser, args_doc, doc, 0, 0, 0};
 static struct server_config config;
 
 static void parse_server_port(const char *arg, struct server_config *config);
+static void parse_cpu(const char *arg, struct server_config *config);
+static void parse_idle_timeout(const char *arg, struct server_config *config);
+static void parse_log_level(const char *arg, struct server_config *config);
+static void parse_metrics_port(const char *arg, struct server_config *config);
+static void parse_xdp_queues(const char *arg, struct server_config *config);
+static void parse_small_probe(const char *arg, struct server_config *config);
+static void parse_quantum(const char *arg, struct server_config *config);
+static void parse_bulk_rate(const char *arg, struct server_config *config);
+static void parse_buf_size(const char *arg, int *dest);
 
 
 
 static int listen_sock;
-static int client_sock;
-static char recv_buf[RECV_BUF_SIZE];
-static enum server_states current_state;
-static msg_hello hello_message;
+static struct ev_io listen_io;
+static struct evloop loop;
+static struct pool pool;
+static struct sched sched;
+static struct ev_timer sched_timer;
+static struct metrics *metrics;
+static unsigned long next_session_id;
+static unsigned long n_sessions;
+static unsigned long n_measuring;
+static unsigned long n_measure_starts;
+static char scratch[SCRATCH_SIZE];
+static struct sockmap_echo sockmap;
+static struct udp_reflector udp;
+static struct xdp_reflector xdp;
+static struct ev_timer rate_timer;
+static uint64_t last_udp_packets;
+static uint64_t last_xdp_packets[XDP_MAX_QUEUES];
 
 int main(int argc, char **argv) {
     struct sockaddr_in listen_addr;
 
     config.port = 0;
+    config.low_latency = 0;
+    config.cpu = -1;
+    config.mlock = 0;
+    config.fastopen = 0;
+    config.profile = 0;
+    config.sockmap = 0;
+    config.idle_timeout = SOCK_TIMEOUT_SEC;
+    config.log_level = LOG_INFO;
+    config.metrics_port = 0;
+    config.udp = 0;
+    config.xdp_ifname = NULL;
+    config.xdp_queues = 1;
+    config.quantum = SCHED_QUANTUM;
+    config.small_probe = SCHED_SMALL_PROBE;
+    config.bulk_rate = 0;
+    memset(&(config.listen_tuning), 0, sizeof(struct sock_tuning));
+
+    if (!log_init(config.log_level)) {
+        exit(1);
+    }
 
     if (argp_parse(&argp, argc, argv, 0, 0, &config) != 0) {
-        fprintf(stderr, "Some error occurred while parsing arguments\n");
+        log_error("Some error occurred while parsing arguments");
         exit(1);
     }
 
-    setvbuf(stdout, NULL, _IONBF, 0);
+    log_set_level(config.log_level);
+
+    if (config.cpu >= 0 && !tune_pin_cpu(config.cpu)) {
+        exit(1);
+    }
+
+    if (config.mlock && !tune_mlock()) {
+        exit(1);
+    }
+
+    tune_fd_limit();
+
+    if (config.profile) {
+        prof_init();
+    }
 
     signal(SIGINT, handle_terminate);
 
+    pool_init(&pool);
+
+    metrics = metrics_register();
+
+    if (metrics == NULL) {
+        log_error("Cannot allocate metrics");
+        return 1;
+    }
+
+    if (config.metrics_port > 0 && !metrics_serve(config.metrics_port)) {
+        return 1;
+    }
+
+    if (config.sockmap && !sockmap_open(&sockmap)) {
+        return 1;
+    }
+
+    if (!evloop_init(&loop, config.low_latency)) {
+        return 1;
+    }
+
+    sched_init(&sched, config.quantum, config.small_probe, config.bulk_rate, on_sched_echo);
+    evloop_timer_init(&sched_timer, on_sched_due, NULL);
+
+    if (config.bulk_rate > 0) {
+        log_info("Bulk sessions (probes over %lu bytes) capped at %lu bytes/s", config.small_probe, config.bulk_rate);
+    }
+
     bzero(&listen_addr, sizeof(struct sockaddr_in));
     listen_addr.sin_family = AF_INET;
     listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     listen_addr.sin_port = htons(config.port);
 
-    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
 
     if (listen_sock == -1) {
-        perror("Cannot create socket");
+        log_perror("Cannot create socket");
         return errno;
     }
 
     if (bind(listen_sock, (const struct sockaddr *)&listen_addr, sizeof(listen_addr)) == -1) {
-        perror("Cannot bind socket");
+        log_perror("Cannot bind socket");
+        return errno;
+    }
+
+    if (config.fastopen && !tune_fastopen_listen(listen_sock, FASTOPEN_QUEUE_LEN)) {
         return errno;
     }
 
+    // Accepted sockets inherit them, and the window scale of their SYN-ACK fits them
+    if ((config.listen_tuning.sndbuf > 0 || config.listen_tuning.rcvbuf > 0)
+        && !tune_apply(listen_sock, &(config.listen_tuning))
+    ) {
+        return 1;
+    }
+
     if (listen(listen_sock, MAX_CONNECTIONS)) {
-        perror("Cannot listen");
+        log_perror("Cannot listen");
         return errno;
     }
 
-    printf("Listening on port %d\n", config.port);
+    if (!evloop_io_add(&loop, &listen_io, listen_sock, EPOLLIN, on_accept, NULL)) {
+        return 1;
+    }
 
-    current_state = STATE_HELLO;
+    if (config.udp && !udp_reflector_open(&udp, &loop, config.port)) {
+        return 1;
+    }
 
-    while (1) {
-        switch (current_state) {
-            case STATE_HELLO  : state_hello(); break;
-            case STATE_MEASURE: state_measure(); break;
-            case STATE_BYE    : state_bye(); break;
-            case STATE_CLOSE  : state_close();
+    if (config.xdp_ifname != NULL) {
+        if (!xdp_reflector_open(&xdp, &loop, config.xdp_ifname, config.port, config.xdp_queues)) {
+            return 1;
         }
+
+        log_info("AF_XDP reflector on %s, %d queues, %s mode, %s", config.xdp_ifname, config.xdp_queues,
+            xdp.generic ? "generic" : "native", xdp.zerocopy ? "zero-copy" : "copy");
     }
 
-    return 0;
+    if (config.udp || config.xdp_ifname != NULL) {
+        evloop_timer_init(&rate_timer, on_rate_report, NULL);
+        evloop_timer_set(&loop, &rate_timer, now_ns() + RATE_REPORT_SEC * 1000000000ULL);
+    }
+
+    log_info("Listening on port %d", config.port);
+    log_info("Waiting connections");
+
+    while (evloop_run_once(&loop, -1));
+
+    return 1;
 }
 
-static void state_hello() {
-    struct timeval timeout;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_accept(void *ctx, uint32_t events) {
     struct sockaddr_in client_addr;
     socklen_t client_addr_len;
-    char addr_str[INET_ADDRSTRLEN];
-    ssize_t recv_size;
-    const char *response;
+    int fd;
 
-    bzero(&recv_buf, RECV_BUF_SIZE);
+    while (1) {
+        client_addr_len = sizeof(client_addr);
+        fd = accept4(listen_sock, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK);
 
-    printf("Waiting connections\n");
-    client_sock = accept(listen_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Cannot accept connection");
+            }
+            return;
+        }
+
+        session_new(fd, &client_addr);
+    }
+}
+#pragma GCC diagnostic pop
+
+static void on_session_io(void *ctx, uint32_t events) {
+    struct session *s = ctx;
+
+    if (events & EPOLLOUT) {
+        session_write(s);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        session_read(s);
+    }
+
+    session_process(s);
+    session_update(s);
+}
+
+static void on_echo_due(void *ctx) {
+    struct session *s = ctx;
 
-    // Timeout recv operations after SOCK_TIMEOUT_SEC seconds
-    timeout.tv_usec = 0;
-    timeout.tv_sec = SOCK_TIMEOUT_SEC;
-    if (setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Cannot set socket options: ");
-        current_state = STATE_CLOSE;
+    // The thread served other sessions during the wait, only the timer is this one's
+    if (s->prof != NULL) {
+        prof_read(&(s->prof_start));
+    }
+
+    s->probe_ready_ns = now_ns();
+    metrics_observe(&(metrics->delay_error), s->probe_ready_ns - s->echo_timer.due_ns);
+
+    if (s->prof != NULL) {
+        prof_since(&(s->prof_start), &(s->prof_probe), PROF_DELAY);
+    }
+
+    schedule_echo(s, s->echo_len);
+}
+
+/**
+ * Echo what the scheduler lets through, coming back as soon as the loop
+ * has polled the sockets again if anything is left
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_sched_due(void *ctx) {
+    uint64_t next = sched_run(&sched, now_ns());
+
+    if (next > 0) {
+        evloop_timer_set(&loop, &sched_timer, next);
+    }
+}
+#pragma GCC diagnostic pop
+
+static void on_sched_echo(void *ctx) {
+    struct session *s = ctx;
+    uint64_t waited = now_ns() - s->sched.ready_ns;
+
+    moments_add(&(s->queue_delay), waited);
+    if (waited > s->queue_delay_max) {
+        s->queue_delay_max = waited;
+    }
+    metrics_observe(&(metrics->queue_delay), waited);
+
+    echo_probe(s, s->echo_len);
+    s->echo_len = 0;
+
+    session_process(s);
+    session_update(s);
+}
+
+static void on_idle_check(void *ctx) {
+    struct session *s = ctx;
+    uint64_t idle_ns = (uint64_t)config.idle_timeout * 1000000000;
+
+    // Probes echoed by the kernel are activity user space doesn't see
+    if (s->offloaded) {
+        session_sync(s);
+    }
+
+    // Waiting on our own delay doesn't count as the client being idle
+    if (s->echo_len > 0 || now_ns() - s->last_activity_ns < idle_ns) {
+        evloop_timer_set(&loop, &(s->idle_timer), s->last_activity_ns + idle_ns);
         return;
     }
-    if (setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Cannot set socket options: ");
-        current_state = STATE_CLOSE;
+
+    log_error("[%lu] Session timed out", s->id);
+    session_fail(s);
+    session_update(s);
+}
+
+/**
+ * Datagram reflectors don't have sessions, report their packet rates instead.
+ * Nothing is printed while there's no traffic.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_rate_report(void *ctx) {
+    uint64_t packets;
+
+    evloop_timer_set(&loop, &rate_timer, rate_timer.due_ns + RATE_REPORT_SEC * 1000000000ULL);
+
+    if (config.udp && udp.packets != last_udp_packets) {
+        log_info("UDP socket: %lu pkt/s", (udp.packets - last_udp_packets) / RATE_REPORT_SEC);
+        last_udp_packets = udp.packets;
+    }
+
+    if (config.xdp_ifname == NULL) {
         return;
     }
 
-    inet_ntop(AF_INET, &(client_addr.sin_addr), addr_str, INET_ADDRSTRLEN);
-    printf("Client connected: %s on port %d\n", addr_str, client_addr.sin_port);
+    xdp_reflector_reclaim(&xdp);
 
-    recv_size = recv(client_sock, recv_buf, RECV_BUF_SIZE, 0);
+    for (int i = 0; i < xdp.n_queues; i++) {
+        packets = xdp.queues[i].packets;
 
-    if (recv_size == -1) {
-        perror("Receive error");
-        current_state = STATE_CLOSE;
+        if (packets != last_xdp_packets[i]) {
+            log_info("XDP queue %d: %lu pkt/s, %lu dropped so far", i,
+                (packets - last_xdp_packets[i]) / RATE_REPORT_SEC, xdp.queues[i].dropped);
+            last_xdp_packets[i] = packets;
+        }
+    }
+}
+#pragma GCC diagnostic pop
+
+static void session_new(int fd, struct sockaddr_in *addr) {
+    struct session *s;
+    char addr_str[INET_ADDRSTRLEN];
+
+    s = calloc(1, sizeof(struct session));
+
+    if (s == NULL || !pool_get(&pool, &(s->in), pool_min_size())) {
+        log_error("Out of memory, dropping connection");
+        free(s);
+        close(fd);
         return;
     }
 
-    print_recv(recv_buf);
+    s->id = next_session_id++;
+    session_set_state(s, STATE_HELLO);
+    s->last_activity_ns = now_ns();
 
-    if (!hello_from_string(recv_buf, &hello_message)
-        || !is_valid_hello(&hello_message)
-    ) {
-        response = response_strings[RESP_INVALID_HELLO];
-        print_send(response);
-        send(client_sock, response, strlen(response) + 1, 0);
-        current_state = STATE_CLOSE;
+    if (config.low_latency) {
+        tune_low_latency(fd);
+    }
+
+    evloop_timer_init(&(s->echo_timer), on_echo_due, s);
+    sched_entry_init(&(s->sched), s);
+    moments_init(&(s->queue_delay));
+    evloop_timer_init(&(s->idle_timer), on_idle_check, s);
+
+    if (!evloop_io_add(&loop, &(s->io), fd, EPOLLIN, on_session_io, s)) {
+        pool_put(&pool, &(s->in));
+        free(s);
+        close(fd);
         return;
     }
 
-    response = response_strings[RESP_READY];
-    print_send(response);
-    send(client_sock, response, strlen(response) + 1, 0);
+    evloop_timer_set(&loop, &(s->idle_timer), s->last_activity_ns + (uint64_t)config.idle_timeout * 1000000000);
+    n_sessions += 1;
+    metrics_add(&(metrics->sessions_accepted), 1);
 
-    current_state = STATE_MEASURE;
+    inet_ntop(AF_INET, &(addr->sin_addr), addr_str, INET_ADDRSTRLEN);
+    log_info("[%lu] Client connected: %s on port %d", s->id, addr_str, ntohs(addr->sin_port));
 }
 
-static void state_measure() {
-    unsigned int expected_seq = 1;
-    size_t recv_idx = 0;
-    char probe_buf[RECV_BUF_SIZE];
-    ssize_t probe_size;
-    msg_probe probe;
-    const char *response;
-    struct timespec delay;
+static void session_read(struct session *s) {
+    ssize_t res;
+    size_t want;
 
-    delay.tv_sec = 0;
-    delay.tv_nsec = 0;
+    if (s->state == STATE_CLOSE) {
+        return;
+    }
 
-    if (hello_message.server_delay > 0) {
-        delay.tv_sec = hello_message.server_delay / 1000;
+    if (s->rx_active) {
+        stream_read(s);
+        return;
+    }
 
-        delay.tv_nsec = 1000000 * (hello_message.server_delay % 1000);
+    // The kernel handed something over, catch up with the probes it echoed
+    if (s->offloaded) {
+        session_sync(s);
     }
 
-    #ifdef DEBUG
-    printf("Fake network delay is %ld seconds and %ld nanoseconds\n", delay.tv_sec, delay.tv_nsec);
-    #endif
+    // Keep room for a terminator, borrow a bigger buffer if full
+    if (s->in.len + 1 >= s->in.cap) {
+        want = s->in.cap + 1;
 
-    while (expected_seq <= hello_message.n_probes) {
-        probe_size = recv_until(client_sock, recv_buf, RECV_BUF_SIZE, &recv_idx, probe_buf, RECV_BUF_SIZE, '\n');
+        // Go straight for the size of a whole probe instead of climbing the classes
+        if (s->state == STATE_MEASURE && s->hello.msg_size + PROBE_HEADER_SIZE > want) {
+            want = s->hello.msg_size + PROBE_HEADER_SIZE;
+        }
 
-        if (probe_size == -1) {
-            perror("Receive error");
-            current_state = STATE_CLOSE;
-            return;
+        if (want > pool_max_size()) {
+            want = pool_max_size();
         }
 
-        if (probe_size == -2) {
-            fprintf(stderr, "Probe buffer too small\n");
-            response = response_strings[RESP_INVALID_PROBE];
-            print_send(response);
-            send(client_sock, response, strlen(response) + 1, 0);
-            current_state = STATE_CLOSE;
+        if (want <= s->in.cap || !pool_resize(&pool, &(s->in), want)) {
+            log_error("[%lu] Message buffer too small", s->id);
+            respond_error(s, s->state == STATE_HELLO ? RESP_INVALID_HELLO : RESP_INVALID_PROBE);
             return;
         }
+    }
+
+    if (s->prof != NULL) {
+        prof_read(&(s->prof_start));
+    }
+
+    res = recv(s->io.fd, s->in.data + s->in.len, s->in.cap - 1 - s->in.len, 0);
+
+    if (s->prof != NULL) {
+        prof_since(&(s->prof_start), &(s->prof_probe), PROF_RECV);
+    }
 
-        #ifdef DEBUG
-        print_recv(probe_buf);
-        #endif
-
-        if (!probe_from_string(probe_buf, &probe)
-            || !is_valid_probe(&probe, expected_seq)
-        ) {
-            fprintf(stderr, "Received invalid probe\n");
-            response = response_strings[RESP_INVALID_PROBE];
-            print_send(response);
-            send(client_sock, response, strlen(response) + 1, 0);
-            current_state = STATE_CLOSE;
+    if (res == 0) {
+        log_error("[%lu] Connection closed by client", s->id);
+        session_fail(s);
+        return;
+    }
+
+    if (res == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_perror("Receive error");
+            session_fail(s);
+        }
+        return;
+    }
+
+    if (config.low_latency) {
+        tune_quickack(s->io.fd);
+    }
+
+    s->in.len += res;
+    s->in.data[s->in.len] = '\0';
+    s->last_activity_ns = now_ns();
+}
+
+static void session_write(struct session *s) {
+    ssize_t res;
+
+    if (s->out.len > 0) {
+        res = send(s->io.fd, s->out.data + s->out_sent, s->out.len - s->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (res == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Send error");
+                session_fail(s);
+            }
             return;
         }
 
-        printf("Received probe seq %d / %d (%lu bytes)\n",
-                probe.probe_seq_num, hello_message.n_probes, probe_size);
+        s->out_sent += res;
+        s->last_activity_ns = now_ns();
+
+        if (s->out_sent == s->out.len) {
+            pool_put(&pool, &(s->out));
+            s->out_sent = 0;
+        }
+    }
+
+    if (s->out.len == 0 && s->tx_payload != NULL) {
+        stream_write(s);
+    }
+}
+
+/**
+ * Handle as many complete messages as there are in the input buffer
+ */
+static void session_process(struct session *s) {
+    int progress = 1;
+
+    while (progress && s->state != STATE_CLOSE && !session_busy(s)) {
+        switch (s->state) {
+            case STATE_HELLO  : progress = state_hello(s); break;
+            case STATE_MEASURE: progress = state_measure(s); break;
+            case STATE_BYE    : progress = state_bye(s); break;
+            case STATE_CLOSE  : progress = 0;
+        }
+    }
+}
+
+/**
+ * Close the session if done, otherwise watch for the events it's waiting on
+ */
+static void session_update(struct session *s) {
+    uint32_t events = 0;
+
+    if (s->state == STATE_CLOSE && s->out.len == 0) {
+        session_close(s);
+        return;
+    }
+
+    if (s->state != STATE_CLOSE && !session_busy(s)) {
+        events |= EPOLLIN;
+    }
 
-        if (delay.tv_sec > 0 || delay.tv_nsec > 0) {
-            nanosleep(&delay, NULL);
+    if (s->out.len > 0 || s->tx_payload != NULL) {
+        events |= EPOLLOUT;
+    }
+
+    evloop_io_set(&loop, &(s->io), events);
+}
+
+/**
+ * Send right away, whatever the socket can't take is kept for later
+ */
+static void session_send(struct session *s, const char *data, size_t len) {
+    ssize_t res = 0;
+
+    if (s->out.len == 0) {
+        res = send(s->io.fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (res == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Send error");
+                session_fail(s);
+                return;
+            }
+            res = 0;
         }
 
-        if (send(client_sock, probe_buf, probe_size, 0) == -1) {
-            perror("Probe send error");
-            current_state = STATE_CLOSE;
+        if ((size_t)res == len) {
             return;
         }
-        expected_seq += 1;
     }
 
-    current_state = STATE_BYE;
+    if (!pool_resize(&pool, &(s->out), s->out.len + len - res)) {
+        log_error("[%lu] Out of buffers", s->id);
+        session_fail(s);
+        return;
+    }
+
+    memcpy(s->out.data + s->out.len, data + res, len - res);
+    s->out.len += len - res;
+}
+
+/**
+ * Drop LEN processed bytes from the input buffer, giving back
+ * the borrowed buffer if what's left fits in a smaller one
+ */
+static void session_consume(struct session *s, size_t len) {
+    memmove(s->in.data, s->in.data + len, s->in.len - len);
+    s->in.len -= len;
+    s->in.data[s->in.len] = '\0';
+
+    pool_resize(&pool, &(s->in), s->in.len + 1);
+}
+
+/**
+ * Abort the session, dropping any pending output
+ */
+static void session_fail(struct session *s) {
+    pool_put(&pool, &(s->out));
+    s->out_sent = 0;
+    session_set_state(s, STATE_CLOSE);
+}
+
+static void session_close(struct session *s) {
+    log_info("[%lu] Closing client connection", s->id);
+
+    if (s->offloaded) {
+        session_sync(s);
+        sockmap_remove(&sockmap, s->cookie);
+    }
+
+    evloop_timer_stop(&loop, &(s->echo_timer));
+    evloop_timer_stop(&loop, &(s->idle_timer));
+    sched_remove(&sched, &(s->sched));
+
+    if (s->queue_delay.count > 0) {
+        log_info("[%lu] Queueing delay avg / max = %.3f / %.3f us over %lu %s probes, %lu throttled", s->id,
+            s->queue_delay.mean / 1000.0, s->queue_delay_max / 1000.0, s->queue_delay.count,
+            s->sched.bulk ? "bulk" : "RTT class", s->sched.throttled);
+    }
+    evloop_io_del(&loop, &(s->io));
+    close(s->io.fd);
+
+    pool_put(&pool, &(s->in));
+    pool_put(&pool, &(s->out));
+    pool_put(&pool, &(s->tx_probe));
+    free(s->tx_payload);
+
+    if (s->prof != NULL) {
+        char prefix[32];
+
+        snprintf(prefix, sizeof(prefix), "[%lu] ", s->id);
+        log_flush();
+        prof_print(s->prof, prefix);
+        fflush(stdout);
+        prof_report_free(s->prof);
+        free(s->prof);
+    }
+
+    free(s);
+
+    n_sessions -= 1;
+    metrics_add(&(metrics->sessions_closed), 1);
+    log_info("Sessions: %lu open, buffers: %lu bytes in use, %lu bytes reserved",
+        n_sessions, pool_in_use(&pool), pool.reserved);
+}
+
+/**
+ * A busy session doesn't process input until its pending output is gone
+ */
+static char session_busy(struct session *s) {
+    return s->out.len > 0 || s->echo_len > 0;
+}
+
+/**
+ * A session is measuring from the Hello to the Closing, while its share of
+ * the thread's resource usage is taken
+ */
+static void session_set_state(struct session *s, enum server_states state) {
+    if (state == STATE_MEASURE && s->state != STATE_MEASURE) {
+        s->usage_sessions = n_measuring + 1;
+        n_measuring += 1;
+        n_measure_starts += 1;
+        s->usage_starts = n_measure_starts;
+    } else if (state == STATE_CLOSE && (s->state == STATE_MEASURE || s->state == STATE_BYE)) {
+        n_measuring -= 1;
+    }
+
+    s->state = state;
+    TRACE2(session_state, s->id, state);
+}
+
+/**
+ * Hand probe echoing over to the kernel, from here on user space only
+ * sees what the BPF programs don't recognize as the next probe: the Bye,
+ * or an invalid probe to respond to. Only done when there's nothing left
+ * to process or send in user space and nothing to do between receiving
+ * and echoing a probe.
+ */
+static void session_offload(struct session *s) {
+    if (s->state != STATE_MEASURE
+        || (s->hello.measure_type != MEASURE_RTT && s->hello.measure_type != MEASURE_THPUT)
+        || s->hello.server_delay > 0
+        || (sched.bulk_rate > 0 && sched_is_bulk(&sched, s->hello.msg_size + PROBE_HEADER_SIZE))
+        || s->prof != NULL
+        || s->in.len > 0
+        || s->out.len > 0
+    ) {
+        return;
+    }
+
+    if (!sockmap_add(&sockmap, s->io.fd, s->hello.msg_size, s->hello.n_probes, s->expected_seq, &(s->cookie))) {
+        return;
+    }
+
+    s->offloaded = 1;
+    log_debug("[%lu] Probes are echoed by the kernel", s->id);
+}
+
+/**
+ * Account for the probes the kernel echoed since the last time.
+ * Once it gave up on the session, user space takes over from the next
+ * expected probe.
+ */
+static void session_sync(struct session *s) {
+    struct sockmap_session state;
+    unsigned int echoed;
+
+    if (!sockmap_get(&sockmap, s->cookie, &state)) {
+        return;
+    }
+
+    echoed = state.expected_seq - s->expected_seq;
+
+    if (echoed > 0) {
+        metrics_add(&(metrics->probes_echoed), echoed);
+        metrics_add(&(metrics->bytes_echoed), state.bytes - s->offloaded_bytes);
+        s->offloaded_bytes = state.bytes;
+        s->expected_seq = state.expected_seq;
+        s->last_activity_ns = now_ns();
+    }
+
+    if (!state.fallback) {
+        return;
+    }
+
+    log_debug("[%lu] Kernel echoed %u probes (%lu bytes)", s->id, s->expected_seq - 1, state.bytes);
+    sockmap_remove(&sockmap, s->cookie);
+    s->offloaded = 0;
+
+    if (s->state == STATE_MEASURE && s->expected_seq > s->hello.n_probes) {
+        session_set_state(s, STATE_BYE);
+    }
+}
+
+static int state_hello(struct session *s) {
+    char line[MAX_SIZE_HELLO + 1];
+    char *newline;
+    size_t line_len;
+    msg_ready ready;
+    char ready_str[MAX_SIZE_READY];
+    size_t ready_str_len;
+
+    newline = memchr(s->in.data, '\n', s->in.len);
+
+    if (newline == NULL) {
+        if (s->in.len >= MAX_SIZE_HELLO) {
+            respond_error(s, RESP_INVALID_HELLO);
+            return 1;
+        }
+        return 0;
+    }
+
+    line_len = newline - s->in.data + 1;
+    if (line_len > MAX_SIZE_HELLO) {
+        respond_error(s, RESP_INVALID_HELLO);
+        return 1;
+    }
+
+    memcpy(line, s->in.data, line_len);
+    line[line_len] = '\0';
+    session_consume(s, line_len);
+
+    log_debug("<< %s", line);
+
+    if (!hello_from_string(line, &(s->hello))
+        || !is_valid_hello(&(s->hello))
+    ) {
+        respond_error(s, RESP_INVALID_HELLO);
+        return 1;
+    }
+
+    ready.has_tuning = s->hello.has_tuning;
+
+    if (s->hello.has_tuning) {
+        if (!tune_apply(s->io.fd, &(s->hello.tuning))) {
+            log_error("Some requested socket options could not be applied");
+        }
+        tune_effective(s->io.fd, &(ready.tuning));
+    }
+
+    ready_to_string(&ready, ready_str, &ready_str_len);
+    log_debug(">> %s", ready_str);
+    session_send(s, ready_str, ready_str_len + 1);
+
+    start_measure(s);
+
+    if (config.sockmap) {
+        session_offload(s);
+    }
+
+    return 1;
 }
 
-static void state_bye() {
+static int state_measure(struct session *s) {
+    switch (s->hello.measure_type) {
+        case MEASURE_SINK  :
+        case MEASURE_SOURCE:
+        case MEASURE_BIDIR : return measure_stream(s);
+        default            : return measure_echo(s);
+    }
+}
+
+static int state_bye(struct session *s) {
     msg_bye msg;
-    const char *response;
+    msg_closing closing;
+    char closing_str[MAX_SIZE_CLOSING];
+    size_t closing_str_len;
+    char *newline;
+
+    newline = memchr(s->in.data, '\n', s->in.len);
+
+    if (newline == NULL) {
+        if (s->in.len >= MAX_SIZE_BYE) {
+            log_error("[%lu] Received invalid Bye message", s->id);
+            session_fail(s);
+            return 1;
+        }
+        return 0;
+    }
+
+    log_debug("<< %s", s->in.data);
+
+    if (!bye_from_string(s->in.data, &msg) || !is_valid_bye(&msg)) {
+        log_error("[%lu] Received invalid Bye message", s->id);
+        session_fail(s);
+        return 1;
+    }
+
+    session_consume(s, newline - s->in.data + 1);
+
+    closing.has_counters = s->hello.measure_type == MEASURE_SINK
+        || s->hello.measure_type == MEASURE_SOURCE
+        || s->hello.measure_type == MEASURE_BIDIR;
+    closing.rx_bytes = s->counters.rx_bytes;
+    closing.rx_usec = stream_rx_usec(&(s->counters));
+    closing.tx_bytes = s->counters.tx_bytes;
+    closing.tx_usec = stream_tx_usec(&(s->counters));
+    closing.has_usage = s->hello.wants_usage;
+    memset(&(closing.usage), 0, sizeof(struct prof_usage));
+    prof_usage_add_since(&(closing.usage), &(s->usage_start));
+    closing.usage_sessions = s->usage_sessions + n_measure_starts - s->usage_starts;
+
+    closing_to_string(&closing, closing_str, &closing_str_len);
+    log_debug(">> %s", closing_str);
+    session_send(s, closing_str, closing_str_len + 1);
+    session_set_state(s, STATE_CLOSE);
+
+    return 1;
+}
+
+static int measure_echo(struct session *s) {
+    char header[PROBE_HEADER_SIZE];
+    char *newline;
+    size_t probe_size, header_len;
+    msg_probe probe;
+
+    if (s->prof != NULL) {
+        prof_read(&(s->prof_start));
+    }
+
+    newline = memchr(s->in.data, '\n', s->in.len);
+
+    if (newline == NULL) {
+        return 0;
+    }
+
+    // Clients stopping once their estimate is precise enough say Bye early
+    if (s->in.data[0] == PHASE_BYE) {
+        log_info("[%lu] Client ended the measure after %u / %u probes", s->id, s->expected_seq - 1, s->hello.n_probes);
+        session_set_state(s, STATE_BYE);
+        return 1;
+    }
 
-    bzero(recv_buf, RECV_BUF_SIZE);
+    probe_size = newline - s->in.data + 1;
+    s->probe_ready_ns = now_ns();
+    TRACE3(probe_received, s->id, probe_size, s->probe_ready_ns);
 
-    if (recv(client_sock, recv_buf, RECV_BUF_SIZE, 0) == -1) {
-        perror("Receive error");
-        current_state = STATE_CLOSE;
+    // Only the head of the probe is parsed, no need to go through the payload
+    header_len = probe_size < PROBE_HEADER_SIZE ? probe_size : PROBE_HEADER_SIZE - 1;
+    memcpy(header, s->in.data, header_len);
+    header[header_len] = '\0';
+
+    #ifdef DEBUG
+    log_debug("<< %s", s->in.data);
+    #endif
+
+    if (!probe_from_string(header, &probe)
+        || !is_valid_probe(&probe, s->expected_seq)
+    ) {
+        log_error("[%lu] Received invalid probe", s->id);
+        respond_error(s, RESP_INVALID_PROBE);
+        return 1;
+    }
+
+    log_debug("[%lu] Received probe seq %d / %d (%lu bytes)",
+            s->id, probe.probe_seq_num, s->hello.n_probes, probe_size);
+    TRACE3(probe_validated, s->id, probe.probe_seq_num, probe_size);
+
+    if (s->prof != NULL) {
+        prof_since(&(s->prof_start), &(s->prof_probe), PROF_PARSE);
+    }
+
+    if (s->hello.server_delay > 0) {
+        s->echo_len = probe_size;
+        evloop_timer_set(&loop, &(s->echo_timer), s->probe_ready_ns + (uint64_t)s->hello.server_delay * 1000000);
+        return 1;
+    }
+
+    schedule_echo(s, probe_size);
+
+    return 1;
+}
+
+/**
+ * Probes are not echoed, we only keep track of bytes and times
+ * to report them with the Closing response.
+ */
+static int measure_stream(struct session *s) {
+    ssize_t consumed;
+
+    // Probes that arrived together with the Hello
+    if (s->rx_active && s->in.len > 0) {
+        consumed = probe_stream_feed(&(s->rx_stream), s->in.data, s->in.len);
+
+        if (consumed == -1) {
+            log_error("[%lu] Received invalid probe while streaming", s->id);
+            respond_error(s, RESP_INVALID_PROBE);
+            return 1;
+        }
+
+        stream_count_rx(&(s->counters), consumed, now_ns());
+        session_consume(s, consumed);
+        s->rx_active = !probe_stream_done(&(s->rx_stream));
+    }
+
+    if (s->rx_active || s->tx_payload != NULL) {
+        return 0;
+    }
+
+    log_info("[%lu] Received %lu bytes in %lu us, transmitted %lu bytes in %lu us", s->id,
+        s->counters.rx_bytes, stream_rx_usec(&(s->counters)),
+        s->counters.tx_bytes, stream_tx_usec(&(s->counters)));
+
+    session_set_state(s, STATE_BYE);
+
+    return 1;
+}
+
+static void start_measure(struct session *s) {
+    char transmit, receive;
+
+    session_set_state(s, STATE_MEASURE);
+    s->expected_seq = 1;
+    prof_usage_read(&(s->usage_start));
+
+    if (s->hello.n_probes == 0) {
+        session_set_state(s, STATE_BYE);
         return;
     }
 
-    print_recv(recv_buf);
+    transmit = s->hello.measure_type == MEASURE_SOURCE || s->hello.measure_type == MEASURE_BIDIR;
+    receive = s->hello.measure_type == MEASURE_SINK || s->hello.measure_type == MEASURE_BIDIR;
+
+    if (!transmit && !receive) {
+        if (config.profile) {
+            s->prof = malloc(sizeof(struct prof_report));
 
-    if (!bye_from_string(recv_buf, &msg) || !is_valid_bye(&msg)) {
-        fprintf(stderr, "Received invalid Bye message\n");
-        current_state = STATE_CLOSE;
+            if (s->prof != NULL) {
+                prof_report_init(s->prof);
+                memset(&(s->prof_probe), 0, sizeof(struct prof_probe));
+            }
+        }
         return;
     }
 
-    response = response_strings[RESP_CLOSING];
-    print_send(response);
-    send(client_sock, response, strlen(response) + 1, 0);
+    log_info("[%lu] Streaming %u probes (%lu bytes payload), %s", s->id, s->hello.n_probes, s->hello.msg_size,
+        measure_types_strings[s->hello.measure_type]);
+
+    // Nagle would hold back the tail of every probe waiting for an ACK
+    tune_nodelay(s->io.fd);
+
+    probe_stream_init(&(s->rx_stream), receive ? s->hello.n_probes : 0);
+    s->rx_active = receive;
+
+    if (transmit) {
+        msg_probe probe;
+
+        if (!pool_get(&pool, &(s->tx_probe), s->hello.msg_size + PROBE_HEADER_SIZE)) {
+            log_error("[%lu] Out of buffers", s->id);
+            session_fail(s);
+            return;
+        }
+
+        s->tx_payload = new_payload(s->hello.msg_size);
+        s->tx_seq = 1;
+        s->tx_sent = 0;
 
-    current_state = STATE_CLOSE;
+        probe.protocol_phase = PHASE_MEASURE;
+        probe.probe_seq_num = s->tx_seq;
+        probe.payload = s->tx_payload;
+        probe_to_string(&probe, s->tx_probe.data, &(s->tx_probe.len));
+    }
 }
 
-static void state_close() {
-    printf("Closing client connection\n");
-    close(client_sock);
-    current_state = STATE_HELLO;
+/**
+ * Queue the first LEN bytes of the input buffer to be echoed.
+ * Probes are gathered over a round of the loop, and go out once it's
+ * done with the sockets and timers that were ready.
+ */
+static void schedule_echo(struct session *s, size_t len) {
+    uint64_t now = now_ns();
+
+    s->echo_len = len;
+    sched_push(&sched, &(s->sched), len, now);
+
+    if (sched_timer.heap_idx == -1 || sched_timer.due_ns > now) {
+        evloop_timer_set(&loop, &sched_timer, now);
+    }
+}
+
+/**
+ * Echo the first LEN bytes of the input buffer, straight from there
+ */
+static void echo_probe(struct session *s, size_t len) {
+    uint64_t echoed_ns;
+
+    if (s->prof != NULL) {
+        prof_read(&(s->prof_start));
+    }
+
+    session_send(s, s->in.data, len);
+
+    if (s->state == STATE_CLOSE) {
+        return;
+    }
+
+    if (s->prof != NULL) {
+        prof_since(&(s->prof_start), &(s->prof_probe), PROF_SEND);
+        prof_record(s->prof, &(s->prof_probe));
+    }
+
+    echoed_ns = now_ns();
+    TRACE4(probe_echoed, s->id, s->expected_seq, len, echoed_ns);
+
+    metrics_observe(&(metrics->echo_service), echoed_ns - s->probe_ready_ns);
+    metrics_add(&(metrics->probes_echoed), 1);
+    metrics_add(&(metrics->bytes_echoed), len);
+
+    session_consume(s, len);
+    s->expected_seq += 1;
+
+    if (s->expected_seq > s->hello.n_probes) {
+        session_set_state(s, STATE_BYE);
+    }
+}
+
+/**
+ * Streamed probes are discarded as soon as they are validated,
+ * read them through the shared scratch buffer instead of borrowing one.
+ */
+static void stream_read(struct session *s) {
+    ssize_t res, consumed;
+    uint64_t now;
+
+    res = recv(s->io.fd, scratch, SCRATCH_SIZE, 0);
+
+    if (res == 0) {
+        log_error("[%lu] Connection closed while streaming", s->id);
+        session_fail(s);
+        return;
+    }
+
+    if (res == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_perror("Stream receive error");
+            session_fail(s);
+        }
+        return;
+    }
+
+    consumed = probe_stream_feed(&(s->rx_stream), scratch, res);
+
+    if (consumed == -1) {
+        log_error("[%lu] Received invalid probe while streaming", s->id);
+        respond_error(s, RESP_INVALID_PROBE);
+        return;
+    }
+
+    now = now_ns();
+    stream_count_rx(&(s->counters), consumed, now);
+    s->last_activity_ns = now;
+    s->rx_active = !probe_stream_done(&(s->rx_stream));
+
+    if (consumed == res) {
+        return;
+    }
+
+    // The Bye may have been read along with the last probe, none of it can be left out
+    if (s->in.len + (res - consumed) + 1 > s->in.cap
+        && !pool_resize(&pool, &(s->in), s->in.len + (res - consumed) + 1)
+    ) {
+        log_error("[%lu] Message buffer too small", s->id);
+        session_fail(s);
+        return;
+    }
+
+    memcpy(s->in.data + s->in.len, scratch + consumed, res - consumed);
+    s->in.len += res - consumed;
+    s->in.data[s->in.len] = '\0';
+}
+
+static void stream_write(struct session *s) {
+    msg_probe probe;
+    ssize_t res;
+    uint64_t now;
+
+    probe.protocol_phase = PHASE_MEASURE;
+    probe.payload = s->tx_payload;
+
+    while (s->tx_seq <= s->hello.n_probes) {
+        res = send(s->io.fd, s->tx_probe.data + s->tx_sent, s->tx_probe.len - s->tx_sent,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (res == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Stream send error");
+                session_fail(s);
+            }
+            return;
+        }
+
+        now = now_ns();
+        stream_count_tx(&(s->counters), res, now);
+        s->last_activity_ns = now;
+        s->tx_sent += res;
+
+        if (s->tx_sent == s->tx_probe.len) {
+            s->tx_seq += 1;
+            s->tx_sent = 0;
+            probe.probe_seq_num = s->tx_seq;
+            probe_to_string(&probe, s->tx_probe.data, &(s->tx_probe.len));
+        }
+    }
+
+    pool_put(&pool, &(s->tx_probe));
+    free(s->tx_payload);
+    s->tx_payload = NULL;
+}
+
+/**
+ * Send an error response and close the session once it's out
+ */
+static void respond_error(struct session *s, enum responses resp) {
+    const char *response = response_strings[resp];
+
+    metrics_add(&(metrics->failures[resp]), 1);
+
+    log_debug(">> %s", response);
+    session_send(s, response, strlen(response) + 1);
+    session_set_state(s, STATE_CLOSE);
 }
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 static void handle_terminate(int sig) {
-    printf("Interrupt caught. Exiting.\n");
+    log_info("Interrupt caught. Exiting.");
     close(listen_sock);
-    close(client_sock);
     exit(0);
 }
 #pragma GCC diagnostic pop
@@ -284,6 +1313,24 @@ static error_t arg_parser(int key, char *arg, struct argp_state *state) {
     struct server_config *config = state->input;
 
     switch (key) {
+        case 'l': config->low_latency = 1; break;
+        case 'c': parse_cpu(arg, config); break;
+        case 'M': config->mlock = 1; break;
+        case 'p': config->profile = 1; break;
+        case 'k': config->sockmap = 1; break;
+        case 'F': config->fastopen = 1; break;
+        case 'i': parse_idle_timeout(arg, config); break;
+        case 'L': parse_log_level(arg, config); break;
+        case 'P': parse_metrics_port(arg, config); break;
+        case 'u': config->udp = 1; break;
+        case 'X': config->xdp_ifname = arg; break;
+        case 'Q': parse_xdp_queues(arg, config); break;
+        case 'S': parse_buf_size(arg, &(config->listen_tuning.sndbuf)); break;
+        case 'R': parse_buf_size(arg, &(config->listen_tuning.rcvbuf)); break;
+        case OPT_SMALL_PROBE: parse_small_probe(arg, config); break;
+        case OPT_QUANTUM    : parse_quantum(arg, config); break;
+        case OPT_BULK_RATE  : parse_bulk_rate(arg, config); break;
+
         case ARGP_KEY_ARG:
             if (state->arg_num >= 1) {
                 argp_usage(state);
@@ -304,7 +1351,100 @@ static void parse_server_port(const char *arg, struct server_config *config) {
     config->port = atoi(arg);
 
     if (config->port < 1 || config->port > 65535) {
-        fprintf(stderr, "Invalid port");
+        log_error("Invalid port");
+        exit(1);
+    }
+}
+
+static void parse_cpu(const char *arg, struct server_config *config) {
+    config->cpu = atoi(arg);
+
+    if (config->cpu < 0) {
+        log_error("Invalid CPU");
+        exit(1);
+    }
+}
+
+static void parse_idle_timeout(const char *arg, struct server_config *config) {
+    config->idle_timeout = atoi(arg);
+
+    if (config->idle_timeout < 1) {
+        log_error("Invalid idle timeout");
+        exit(1);
+    }
+}
+
+static void parse_log_level(const char *arg, struct server_config *config) {
+    if (!log_level_from_string(arg, &(config->log_level))) {
+        log_error("Invalid log level");
+        exit(1);
+    }
+}
+
+static void parse_metrics_port(const char *arg, struct server_config *config) {
+    config->metrics_port = atoi(arg);
+
+    if (config->metrics_port < 1 || config->metrics_port > 65535) {
+        log_error("Invalid metrics port");
+        exit(1);
+    }
+}
+
+static void parse_xdp_queues(const char *arg, struct server_config *config) {
+    config->xdp_queues = atoi(arg);
+
+    if (config->xdp_queues < 1 || config->xdp_queues > XDP_MAX_QUEUES) {
+        log_error("Invalid number of XDP queues");
+        exit(1);
+    }
+}
+
+static void parse_small_probe(const char *arg, struct server_config *config) {
+    int size = atoi(arg);
+
+    if (size < 1) {
+        log_error("Invalid RTT class probe size");
+        exit(1);
+    }
+
+    config->small_probe = size;
+}
+
+static void parse_quantum(const char *arg, struct server_config *config) {
+    int quantum = atoi(arg);
+
+    if (quantum < 1) {
+        log_error("Invalid quantum");
+        exit(1);
+    }
+
+    config->quantum = quantum;
+}
+
+static void parse_bulk_rate(const char *arg, struct server_config *config) {
+    char *end;
+    double rate = strtod(arg, &end);
+
+    switch (*end) {
+        case 'k': rate *= 1e3; end++; break;
+        case 'M': rate *= 1e6; end++; break;
+        case 'G': rate *= 1e9; end++; break;
+        default : break;
+    }
+
+    if (*end != '\0' || rate < 1) {
+        log_error("Invalid bulk rate");
+        exit(1);
+    }
+
+    config->bulk_rate = rate;
+}
+
+static void parse_buf_size(const char *arg, int *dest) {
+    *dest = atoi(arg);
+
+    if (*dest < 1) {
+        log_error("Invalid buffer size");
         exit(1);
     }
 }
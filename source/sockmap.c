@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+
+#include "sockmap.h"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57
+#endif
+
+/**
+ * Bytes of a probe looked at by the stream parser, same as PROBE_HEADER_SIZE
+ */
+#define HEADER_SIZE 24
+
+#define INSN(code, dst, src, off, imm) ((struct bpf_insn){code, dst, src, off, imm})
+
+#define STATE(field) offsetof(struct sockmap_session, field)
+
+static int create_map(enum bpf_map_type type, uint32_t key_size, uint32_t value_size);
+static int load_program(struct bpf_insn *insns, uint32_t insn_cnt, const char *name);
+static int attach_program(int map_fd, int prog_fd, enum bpf_attach_type type);
+static long bpf(int cmd, union bpf_attr *attr);
+
+int sockmap_open(struct sockmap_echo *e) {
+    /*
+     * Stream parser. Finds where the probe at the head of the stream ends:
+     *
+     *   if (state == NULL || state->fallback) return skb->len;
+     *   n = min(skb->len, HEADER_SIZE); load n bytes in buf;
+     *   if (buf[0] != 'm') goto invalid;
+     *   for (i = 1; i < n; i++) {
+     *       if (buf[i] == ' ') { if (digits) goto found; continue; }
+     *       if (!isdigit(buf[i])) goto invalid;
+     *       seq = seq * 10 + buf[i] - '0'; digits = 1;
+     *   }
+     *   if (skb->len < HEADER_SIZE) return 0;   // wait for the rest of the header
+     * invalid:
+     *   state->parsed_seq = 0; return skb->len;
+     * found:
+     *   state->parsed_seq = seq;
+     *   return state->parsed_len = i + 1 + state->msg_size + 1;
+     */
+    struct bpf_insn parser[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_9, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 45, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(fallback), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 42, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+        INSN(BPF_JMP | BPF_JLE | BPF_K, BPF_REG_8, 0, 1, HEADER_SIZE),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, HEADER_SIZE),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_1, -32, 0),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_1, -24, 0),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_1, -16, 0),
+        INSN(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_8, 0, 34, 1),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -32),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_8, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 25, 0),
+        INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_1, BPF_REG_10, -32, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 23, 'm'),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 1),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, 0),
+        // loop:
+        INSN(BPF_JMP | BPF_JGE | BPF_X, BPF_REG_2, BPF_REG_8, 16, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, -32),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0),
+        INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_1, BPF_REG_1, 0, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 3, ' '),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 17, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, 1),
+        INSN(BPF_JMP | BPF_JA, 0, 0, -9, 0),
+        INSN(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_1, 0, 10, '0'),
+        INSN(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_1, 0, 9, '9'),
+        INSN(BPF_ALU64 | BPF_MUL | BPF_K, BPF_REG_3, 0, 0, 10),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_3, BPF_REG_1, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -'0'),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, 1),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, 1),
+        INSN(BPF_JMP | BPF_JA, 0, 0, -17, 0),
+        // incomplete:
+        INSN(BPF_JMP | BPF_JGE | BPF_K, BPF_REG_9, 0, 2, HEADER_SIZE),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        // invalid:
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0),
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_1, STATE(parsed_seq), 0),
+        // pass all:
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_0, BPF_REG_9, 0, 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        // found:
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_3, STATE(parsed_seq), 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_0, BPF_REG_7, STATE(msg_size), 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0, BPF_REG_2, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_0, 0, 0, 2),
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_0, STATE(parsed_len), 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+
+    /*
+     * Stream verdict. Sends the probe back out of the same socket if it's
+     * the expected one, otherwise falls back to user space for good:
+     *
+     *   if (state == NULL || state->fallback) return SK_PASS;
+     *   if (skb->len != state->parsed_len || state->parsed_seq != state->expected_seq
+     *       || state->expected_seq > state->n_probes || skb[skb->len - 1] != '\n')
+     *       goto fallback;
+     *   state->expected_seq++; state->bytes += skb->len;
+     *   return bpf_sk_redirect_hash(skb, &sockhash, &cookie, 0);
+     * fallback:
+     *   state->fallback = 1; return SK_PASS;
+     */
+    struct bpf_insn verdict[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_9, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 36, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(fallback), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 33, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(parsed_len), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_9, 29, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(parsed_seq), 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_7, STATE(expected_seq), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_2, 26, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(n_probes), 0),
+        INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_1, 24, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_9, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -1),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 1),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 16, 0),
+        INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_1, BPF_REG_10, -16, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 14, '\n'),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(expected_seq), 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1),
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_1, STATE(expected_seq), 0),
+        INSN(BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_1, BPF_REG_7, STATE(bytes), 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_9, 0, 0),
+        INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_7, BPF_REG_1, STATE(bytes), 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, 0),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        // fallback:
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_1, STATE(fallback), 0),
+        // pass:
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+
+    memset(e, 0, sizeof(struct sockmap_echo));
+
+    e->sockhash_fd = create_map(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t), sizeof(uint32_t));
+    e->state_fd = create_map(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(struct sockmap_session));
+
+    if (e->sockhash_fd == -1 || e->state_fd == -1) {
+        log_perror("Cannot create sockmap");
+        return 0;
+    }
+
+    parser[4].imm = e->state_fd;
+    verdict[4].imm = e->state_fd;
+    verdict[37].imm = e->sockhash_fd;
+
+    e->parser_fd = load_program(parser, sizeof(parser) / sizeof(parser[0]), "parser");
+    e->verdict_fd = load_program(verdict, sizeof(verdict) / sizeof(verdict[0]), "verdict");
+
+    if (e->parser_fd == -1 || e->verdict_fd == -1) {
+        return 0;
+    }
+
+    return attach_program(e->sockhash_fd, e->parser_fd, BPF_SK_SKB_STREAM_PARSER)
+        && attach_program(e->sockhash_fd, e->verdict_fd, BPF_SK_SKB_STREAM_VERDICT);
+}
+
+int sockmap_add(struct sockmap_echo *e, int fd, size_t msg_size, unsigned int n_probes,
+    unsigned int expected_seq, uint64_t *cookie
+) {
+    struct sockmap_session state;
+    union bpf_attr attr;
+    socklen_t cookie_len = sizeof(uint64_t);
+    uint32_t value = fd;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, cookie, &cookie_len) == -1) {
+        log_perror("Cannot get socket cookie");
+        return 0;
+    }
+
+    // The state has to be there before the first probe reaches the parser
+    memset(&state, 0, sizeof(struct sockmap_session));
+    state.msg_size = msg_size;
+    state.n_probes = n_probes;
+    state.expected_seq = expected_seq;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_fd = e->state_fd;
+    attr.key = (uint64_t)(unsigned long)cookie;
+    attr.value = (uint64_t)(unsigned long)&state;
+
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        log_perror("Cannot add session to sockmap");
+        return 0;
+    }
+
+    attr.map_fd = e->sockhash_fd;
+    attr.value = (uint64_t)(unsigned long)&value;
+
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        log_perror("Cannot add socket to sockmap");
+        sockmap_remove(e, *cookie);
+        return 0;
+    }
+
+    return 1;
+}
+
+int sockmap_get(struct sockmap_echo *e, uint64_t cookie, struct sockmap_session *state) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_fd = e->state_fd;
+    attr.key = (uint64_t)(unsigned long)&cookie;
+    attr.value = (uint64_t)(unsigned long)state;
+
+    return bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0;
+}
+
+void sockmap_remove(struct sockmap_echo *e, uint64_t cookie) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_fd = e->state_fd;
+    attr.key = (uint64_t)(unsigned long)&cookie;
+
+    bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int create_map(enum bpf_map_type type, uint32_t key_size, uint32_t value_size) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = SOCKMAP_MAX_SESSIONS;
+
+    return bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_program(struct bpf_insn *insns, uint32_t insn_cnt, const char *name) {
+    char verifier_log[4096];
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(unsigned long)insns;
+    attr.insn_cnt = insn_cnt;
+    attr.license = (uint64_t)(unsigned long)"GPL";
+
+    fd = bpf(BPF_PROG_LOAD, &attr);
+
+    if (fd != -1) {
+        return fd;
+    }
+
+    log_error("Cannot load sockmap %s program: %s", name, strerror(errno));
+
+    // The parser loop makes for a long log, only ask for it when something's wrong
+    attr.log_buf = (uint64_t)(unsigned long)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+    verifier_log[0] = '\0';
+
+    bpf(BPF_PROG_LOAD, &attr);
+    log_error("%s", verifier_log);
+
+    return -1;
+}
+
+static int attach_program(int map_fd, int prog_fd, enum bpf_attach_type type) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.target_fd = map_fd;
+    attr.attach_bpf_fd = prog_fd;
+    attr.attach_type = type;
+
+    if (bpf(BPF_PROG_ATTACH, &attr) == -1) {
+        log_perror("Cannot attach sockmap program");
+        return 0;
+    }
+
+    return 1;
+}
+
+static long bpf(int cmd, union bpf_attr *attr) {
+    return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
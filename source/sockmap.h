@@ -0,0 +1,62 @@
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Max sessions echoed by the kernel at the same time
+ */
+#define SOCKMAP_MAX_SESSIONS 4096
+
+/**
+ * Per-session state shared with the BPF programs, keyed by socket cookie.
+ * EXPECTED_SEQ and BYTES are advanced by the kernel for every probe it echoes.
+ * PARSED_SEQ and PARSED_LEN are handed from the stream parser to the verdict.
+ * FALLBACK is set on the first message that isn't the expected probe: that one
+ * and everything after it is left to user space.
+ */
+struct sockmap_session {
+    uint32_t msg_size;
+    uint32_t n_probes;
+    uint32_t expected_seq;
+    uint32_t parsed_seq;
+    uint32_t parsed_len;
+    uint32_t fallback;
+    uint64_t bytes;
+};
+
+struct sockmap_echo {
+    int sockhash_fd;
+    int state_fd;
+    int parser_fd;
+    int verdict_fd;
+};
+
+/**
+ * Create the maps and attach the stream parser and verdict programs.
+ * Returns 0 on failure.
+ */
+int sockmap_open(struct sockmap_echo *e);
+
+/**
+ * Have the kernel echo the probes of the socket FD from now on, starting from
+ * EXPECTED_SEQ up to N_PROBES, each with a payload of MSG_SIZE bytes.
+ * The socket cookie is written in COOKIE.
+ * Returns 0 on failure, the socket is left alone in that case.
+ */
+int sockmap_add(struct sockmap_echo *e, int fd, size_t msg_size, unsigned int n_probes,
+    unsigned int expected_seq, uint64_t *cookie);
+
+/**
+ * Read the state of the session with COOKIE.
+ * Returns 0 on failure.
+ */
+int sockmap_get(struct sockmap_echo *e, uint64_t cookie, struct sockmap_session *state);
+
+/**
+ * Forget the session with COOKIE. The socket leaves the sockhash by itself when closed.
+ */
+void sockmap_remove(struct sockmap_echo *e, uint64_t cookie);
+
+#endif
@@ -0,0 +1,247 @@
+#include "stats.h"
+
+#include <string.h>
+#include <math.h>
+
+static unsigned int bucket_index(uint64_t value);
+static uint64_t bucket_value(unsigned int idx);
+
+void hist_init(histogram *h) {
+    memset(h, 0, sizeof(histogram));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(histogram *h, uint64_t value) {
+    h->count += 1;
+    h->sum += value;
+
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+
+    h->buckets[bucket_index(value)] += 1;
+}
+
+void hist_merge(histogram *dest, const histogram *src) {
+    if (src->count == 0) {
+        return;
+    }
+
+    dest->count += src->count;
+    dest->sum += src->sum;
+
+    if (src->min < dest->min) dest->min = src->min;
+    if (src->max > dest->max) dest->max = src->max;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+}
+
+double hist_mean(const histogram *h) {
+    if (h->count == 0) {
+        return 0;
+    }
+
+    return h->sum / h->count;
+}
+
+uint64_t hist_percentile(const histogram *h, double p) {
+    uint64_t rank, seen = 0;
+    uint64_t value;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    if (p <= 0) return h->min;
+    if (p >= 100) return h->max;
+
+    rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+
+        if (seen >= rank) {
+            value = bucket_value(i);
+
+            // Bucket midpoints can fall outside of what was actually recorded
+            if (value < h->min) return h->min;
+            if (value > h->max) return h->max;
+            return value;
+        }
+    }
+
+    return h->max;
+}
+
+void hist_log2_counts(const histogram *h, uint32_t *dest, unsigned int n) {
+    uint64_t value;
+    unsigned int exp;
+
+    memset(dest, 0, n * sizeof(uint32_t));
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0) {
+            continue;
+        }
+
+        value = bucket_value(i);
+        exp = value > 1 ? 63 - __builtin_clzll(value) : 0;
+        dest[exp < n ? exp : n - 1] += h->buckets[i];
+    }
+}
+
+int hist_percentile_ci(const histogram *h, double p, double z, uint64_t *lower, uint64_t *upper) {
+    double q = p / 100, spread;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    spread = z * sqrt(h->count * q * (1 - q)) / h->count * 100;
+
+    // Too few samples, the interval would reach past the min or max
+    if (p - spread <= 0 || p + spread >= 100) {
+        return 0;
+    }
+
+    *lower = hist_percentile(h, p - spread);
+    *upper = hist_percentile(h, p + spread);
+
+    // Values in the same bucket can't be told apart
+    if (*upper - *lower < *upper >> HIST_SUB_BITS) {
+        *lower = *upper - (*upper >> HIST_SUB_BITS);
+    }
+
+    return 1;
+}
+
+void moments_init(moments *m) {
+    memset(m, 0, sizeof(moments));
+}
+
+void moments_add(moments *m, double value) {
+    double delta = value - m->mean;
+
+    m->count += 1;
+    m->mean += delta / m->count;
+    m->m2 += delta * (value - m->mean);
+}
+
+double moments_variance(const moments *m) {
+    if (m->count < 2) {
+        return 0;
+    }
+
+    return m->m2 / (m->count - 1);
+}
+
+double moments_ci(const moments *m, double z) {
+    if (m->count < 2) {
+        return INFINITY;
+    }
+
+    return z * sqrt(moments_variance(m) / m->count);
+}
+
+/**
+ * Chan et al. pairwise update, as exact as adding the samples one by one
+ */
+void moments_merge(moments *dest, const moments *src) {
+    uint64_t count = dest->count + src->count;
+    double delta = src->mean - dest->mean;
+
+    if (src->count == 0) {
+        return;
+    }
+
+    dest->mean += delta * src->count / count;
+    dest->m2 += src->m2 + delta * delta * dest->count * src->count / count;
+    dest->count = count;
+}
+
+void jitter_tracker_init(jitter_tracker *t) {
+    memset(t, 0, sizeof(jitter_tracker));
+}
+
+void jitter_stats_init(jitter_stats *s) {
+    moments_init(&(s->delay));
+    hist_init(&(s->ipdv));
+    memset(s->loss_runs, 0, sizeof(s->loss_runs));
+}
+
+void jitter_record(jitter_tracker *t, jitter_stats *s, uint64_t delay) {
+    uint64_t ipdv;
+    unsigned int exp;
+
+    moments_add(&(s->delay), delay);
+
+    if (t->loss_run > 0) {
+        exp = 63 - __builtin_clzll(t->loss_run);
+        s->loss_runs[exp < LOSS_RUN_BUCKETS ? exp : LOSS_RUN_BUCKETS - 1] += 1;
+        t->loss_run = 0;
+    }
+
+    if (t->count > 0) {
+        ipdv = delay > t->last_delay ? delay - t->last_delay : t->last_delay - delay;
+        hist_record(&(s->ipdv), ipdv);
+
+        // RFC 3550 A.8, J += (|D| - J) / 16
+        t->jitter += ((double)ipdv - t->jitter) / 16;
+    }
+
+    t->count += 1;
+    t->last_delay = delay;
+}
+
+void jitter_lost(jitter_tracker *t, uint64_t n) {
+    t->loss_run += n;
+}
+
+void jitter_stats_merge(jitter_stats *dest, const jitter_stats *src) {
+    moments_merge(&(dest->delay), &(src->delay));
+    hist_merge(&(dest->ipdv), &(src->ipdv));
+
+    for (int i = 0; i < LOSS_RUN_BUCKETS; i++) {
+        dest->loss_runs[i] += src->loss_runs[i];
+    }
+}
+
+/**
+ * Values below 2^(HIST_SUB_BITS + 1) get their own bucket, above that each
+ * power of two is split into 2^HIST_SUB_BITS linear sub-buckets.
+ */
+static unsigned int bucket_index(uint64_t value) {
+    unsigned int exp, shift;
+
+    if (value >= (uint64_t)2 << HIST_MAX_EXP) {
+        value = ((uint64_t)2 << HIST_MAX_EXP) - 1;
+    }
+
+    if (value < (uint64_t)2 << HIST_SUB_BITS) {
+        return value;
+    }
+
+    exp = 63 - __builtin_clzll(value);
+    shift = exp - HIST_SUB_BITS;
+
+    return (shift << HIST_SUB_BITS) + (value >> shift);
+}
+
+/**
+ * Inverse of bucket_index(), returns the bucket's midpoint
+ */
+static uint64_t bucket_value(unsigned int idx) {
+    unsigned int shift;
+    uint64_t lower;
+
+    if (idx < 2 << HIST_SUB_BITS) {
+        return idx;
+    }
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    lower = (uint64_t)(idx - (shift << HIST_SUB_BITS)) << shift;
+
+    return lower + ((uint64_t)1 << shift) / 2;
+}
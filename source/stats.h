@@ -0,0 +1,160 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/**
+ * Number of sub-buckets per power of two, as a power of two.
+ * 5 bits means 32 sub-buckets, which gives ~3% worst-case relative error.
+ */
+#define HIST_SUB_BITS 5
+
+/**
+ * Highest power of two tracked by the histogram. Values in nanoseconds
+ * above 2^HIST_MAX_EXP (~39 hours) are clamped into the last bucket.
+ */
+#define HIST_MAX_EXP 47
+
+/**
+ * Total number of buckets in a histogram
+ */
+#define HIST_BUCKETS (((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (1 << HIST_SUB_BITS))
+
+/**
+ * Log-linear histogram of nanosecond values.
+ * Keeps exact count/min/max/sum, percentiles are approximated from buckets.
+ */
+typedef struct histogram_s {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+/**
+ * Running mean and variance (Welford), no samples are kept
+ */
+typedef struct moments_s {
+    uint64_t count;
+    double mean;
+    double m2;
+} moments;
+
+/**
+ * Counters of the loss run distribution: counter i takes the runs of 2^i to
+ * 2^(i+1) - 1 lost probes in a row, the last any longer one
+ */
+#define LOSS_RUN_BUCKETS 16
+
+/**
+ * Running state of the delay variation of a stream of probes: the RFC 3550
+ * interarrival jitter (in nanoseconds), the delay it was last updated with
+ * and the probes lost in a row since
+ */
+typedef struct jitter_tracker_s {
+    uint64_t count;
+    double jitter;
+    uint64_t last_delay;
+    uint64_t loss_run;
+} jitter_tracker;
+
+/**
+ * Delay variation statistics, fed by a tracker in O(1) per probe with no
+ * samples kept: mean and variance of the delay, distribution of the absolute
+ * IPDV (RFC 3393, difference between consecutive delays) and of loss runs.
+ * Unlike the tracker they can be merged, so they can cover any period.
+ */
+typedef struct jitter_stats_s {
+    moments delay;
+    histogram ipdv;
+    uint64_t loss_runs[LOSS_RUN_BUCKETS];
+} jitter_stats;
+
+/**
+ * Reset the histogram to its empty state
+ */
+void hist_init(histogram *h);
+
+/**
+ * Add a value (nanoseconds) to the histogram
+ */
+void hist_record(histogram *h, uint64_t value);
+
+/**
+ * Add all the values recorded in SRC to DEST
+ */
+void hist_merge(histogram *dest, const histogram *src);
+
+/**
+ * Mean of the recorded values, 0 if empty
+ */
+double hist_mean(const histogram *h);
+
+/**
+ * Approximate value at percentile P (0-100), 0 if empty
+ */
+uint64_t hist_percentile(const histogram *h, double p);
+
+/**
+ * Coarse copy of H: DEST[i] counts the values from 2^i to 2^(i+1), the last
+ * of the N counters also takes anything above
+ */
+void hist_log2_counts(const histogram *h, uint32_t *dest, unsigned int n);
+
+/**
+ * Distribution-free confidence interval of the value at percentile P, from the
+ * ranks n*p/100 -/+ Z*sqrt(n*p/100*(1-p/100)). Can't be narrower than a bucket.
+ * Returns 0 while there are too few samples for the ranks to be within the data.
+ */
+int hist_percentile_ci(const histogram *h, double p, double z, uint64_t *lower, uint64_t *upper);
+
+/**
+ * Reset M to its empty state
+ */
+void moments_init(moments *m);
+
+/**
+ * Add a sample to M
+ */
+void moments_add(moments *m, double value);
+
+/**
+ * Sample variance, 0 with less than two samples
+ */
+double moments_variance(const moments *m);
+
+/**
+ * Half width of the confidence interval of the mean, Z standard errors.
+ * Infinite with less than two samples.
+ */
+double moments_ci(const moments *m, double z);
+
+/**
+ * Add all the samples of SRC to DEST
+ */
+void moments_merge(moments *dest, const moments *src);
+
+void jitter_tracker_init(jitter_tracker *t);
+
+void jitter_stats_init(jitter_stats *s);
+
+/**
+ * Add the delay (nanoseconds) of a probe that made it to T and S.
+ * It ends the loss run going on, if any. Across a run IPDV is taken from
+ * the delay of the last probe before it.
+ */
+void jitter_record(jitter_tracker *t, jitter_stats *s, uint64_t delay);
+
+/**
+ * Count N more probes lost in a row, the run is added to the statistics
+ * when it ends
+ */
+void jitter_lost(jitter_tracker *t, uint64_t n);
+
+/**
+ * Add all the samples of SRC to DEST
+ */
+void jitter_stats_merge(jitter_stats *dest, const jitter_stats *src);
+
+#endif
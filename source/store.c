@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include "store.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * The header takes a page, blocks are page aligned after it
+ */
+#define STORE_HEADER_SIZE 4096
+#define STORE_BLOCK_SIZE ((STORE_BLOCK_RECORDS + 1) * sizeof(struct store_record))
+
+static int check_header(const struct store_header *header);
+static int map_block(struct store *st, uint64_t idx);
+static off_t block_offset(uint64_t idx);
+
+int store_open(struct store *st, const char *path, char writable) {
+    struct store_header header;
+    struct stat info;
+    int ok = 1;
+
+    memset(st, 0, sizeof(struct store));
+    st->writable = writable;
+    st->block_idx = -1;
+    st->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+    if (st->fd == -1) {
+        log_perror("Cannot open results store");
+        return 0;
+    }
+
+    if (writable) {
+        flock(st->fd, LOCK_EX);
+    }
+
+    if (fstat(st->fd, &info) == -1) {
+        log_perror("Cannot stat results store");
+        ok = 0;
+    } else if (info.st_size == 0 && writable) {
+        memset(&header, 0, sizeof(struct store_header));
+        memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+        header.version = STORE_VERSION;
+        header.record_size = sizeof(struct store_record);
+        header.block_records = STORE_BLOCK_RECORDS;
+
+        if (ftruncate(st->fd, STORE_HEADER_SIZE) == -1
+            || pwrite(st->fd, &header, sizeof(header), 0) != sizeof(header)
+        ) {
+            log_perror("Cannot initialize results store");
+            ok = 0;
+        }
+    } else if (pread(st->fd, &header, sizeof(header), 0) != sizeof(header) || !check_header(&header)) {
+        log_error("Not a results store, or from another version");
+        ok = 0;
+    }
+
+    if (writable) {
+        flock(st->fd, LOCK_UN);
+    }
+
+    if (!ok) {
+        close(st->fd);
+        return 0;
+    }
+
+    // Writers only need the header, blocks are mapped as they're written
+    st->map_len = writable ? STORE_HEADER_SIZE : (size_t)info.st_size;
+    st->map = mmap(NULL, st->map_len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, st->fd, 0);
+
+    if (st->map == MAP_FAILED) {
+        log_perror("Cannot map results store");
+        close(st->fd);
+        return 0;
+    }
+
+    st->n_records = __atomic_load_n(&(((struct store_header *)st->map)->n_records), __ATOMIC_ACQUIRE);
+
+    // A writer may have advanced the count past what was mapped
+    if (!writable && block_offset((st->n_records + STORE_BLOCK_RECORDS - 1) / STORE_BLOCK_RECORDS) > info.st_size) {
+        st->n_records = (info.st_size - STORE_HEADER_SIZE) / STORE_BLOCK_SIZE * STORE_BLOCK_RECORDS;
+    }
+
+    return 1;
+}
+
+int store_append(struct store *st, const struct store_record *rec) {
+    struct store_header *header = (struct store_header *)st->map;
+    struct store_block *block;
+    uint64_t n;
+
+    if (flock(st->fd, LOCK_EX) == -1) {
+        log_perror("Cannot lock results store");
+        return 0;
+    }
+
+    // Another process may have appended meanwhile
+    n = header->n_records;
+
+    if ((int64_t)(n / STORE_BLOCK_RECORDS) != st->block_idx && !map_block(st, n / STORE_BLOCK_RECORDS)) {
+        flock(st->fd, LOCK_UN);
+        return 0;
+    }
+
+    block = (struct store_block *)st->block_map;
+    memcpy(st->block_map + (n % STORE_BLOCK_RECORDS + 1) * sizeof(struct store_record), rec, sizeof(struct store_record));
+
+    if (block->n_records == 0 || rec->time_ns < block->min_time_ns) block->min_time_ns = rec->time_ns;
+    if (block->n_records == 0 || rec->time_ns > block->max_time_ns) block->max_time_ns = rec->time_ns;
+    block->n_records += 1;
+
+    // Only now readers get to see it, the record lands first
+    __atomic_store_n(&(header->n_records), n + 1, __ATOMIC_RELEASE);
+    st->n_records = n + 1;
+
+    flock(st->fd, LOCK_UN);
+    return 1;
+}
+
+const struct store_block *store_block(struct store *st, uint64_t idx) {
+    if (idx * STORE_BLOCK_RECORDS >= st->n_records) {
+        return NULL;
+    }
+
+    return (const struct store_block *)(st->map + block_offset(idx));
+}
+
+const struct store_record *store_get(struct store *st, uint64_t idx) {
+    return (const struct store_record *)(st->map + block_offset(idx / STORE_BLOCK_RECORDS)
+        + (idx % STORE_BLOCK_RECORDS + 1) * sizeof(struct store_record));
+}
+
+void store_close(struct store *st) {
+    if (st->block_map != NULL) {
+        munmap(st->block_map, STORE_BLOCK_SIZE);
+    }
+
+    munmap(st->map, st->map_len);
+    close(st->fd);
+}
+
+void store_init_record(struct store_record *rec, const struct sockaddr_in *addr, const char *label) {
+    struct timespec now;
+
+    memset(rec, 0, sizeof(struct store_record));
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    rec->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    rec->addr = addr->sin_addr.s_addr;
+    rec->port = ntohs(addr->sin_port);
+
+    if (label != NULL) {
+        strncpy(rec->label, label, STORE_LABEL_SIZE - 1);
+    }
+}
+
+void store_fill(struct store_record *rec, const histogram *h) {
+    rec->count = h->count;
+    rec->min = h->count > 0 ? h->min : 0;
+    rec->max = h->max;
+    rec->mean = hist_mean(h);
+    rec->p50 = hist_percentile(h, 50);
+    rec->p90 = hist_percentile(h, 90);
+    rec->p99 = hist_percentile(h, 99);
+    rec->p999 = hist_percentile(h, 99.9);
+    hist_log2_counts(h, rec->buckets, STORE_BUCKETS);
+}
+
+static int check_header(const struct store_header *header) {
+    return memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == STORE_VERSION
+        && header->record_size == sizeof(struct store_record)
+        && header->block_records == STORE_BLOCK_RECORDS;
+}
+
+/**
+ * Map block IDX for writing, growing the file if it's not there yet.
+ * A block at a time, the file is sparse until records land in it.
+ */
+static int map_block(struct store *st, uint64_t idx) {
+    struct stat info;
+    char *map;
+
+    if (fstat(st->fd, &info) == -1
+        || (info.st_size < block_offset(idx + 1) && ftruncate(st->fd, block_offset(idx + 1)) == -1)
+    ) {
+        log_perror("Cannot grow results store");
+        return 0;
+    }
+
+    map = mmap(NULL, STORE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, block_offset(idx));
+
+    if (map == MAP_FAILED) {
+        log_perror("Cannot map results store");
+        return 0;
+    }
+
+    if (st->block_map != NULL) {
+        munmap(st->block_map, STORE_BLOCK_SIZE);
+    }
+
+    st->block_map = map;
+    st->block_idx = idx;
+    return 1;
+}
+
+static off_t block_offset(uint64_t idx) {
+    return STORE_HEADER_SIZE + idx * STORE_BLOCK_SIZE;
+}
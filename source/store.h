@@ -0,0 +1,127 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "stats.h"
+
+#define STORE_MAGIC "RTTSTORE"
+#define STORE_VERSION 1
+
+/**
+ * Records per block. Each block starts with the time range of its records,
+ * which makes for a sparse time index: a query only reads the blocks whose
+ * range overlaps the one it's after.
+ */
+#define STORE_BLOCK_RECORDS 1023
+
+/**
+ * Power of two buckets kept per run, from 1 ns to 2^(STORE_BUCKETS - 1) ns
+ * (~8.6 s), the last one takes anything above
+ */
+#define STORE_BUCKETS 34
+
+#define STORE_LABEL_SIZE 16
+
+/**
+ * A run: what was measured, against whom, and the RTT distribution.
+ * Fixed size, 256 bytes. Times are CLOCK_REALTIME nanoseconds.
+ */
+struct store_record {
+    uint64_t time_ns;
+    uint32_t addr;
+    uint16_t port;
+    uint8_t measure_type;
+    uint8_t reserved;
+    uint32_t n_probes;
+    uint32_t payload_size;
+    uint32_t server_delay;
+    uint32_t reserved2;
+    char label[STORE_LABEL_SIZE];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    double thput_bps;
+    uint32_t buckets[STORE_BUCKETS];
+};
+
+/**
+ * At the start of every block, 256 bytes like a record
+ */
+struct store_block {
+    uint64_t n_records;
+    uint64_t min_time_ns;
+    uint64_t max_time_ns;
+    char reserved[sizeof(struct store_record) - 3 * sizeof(uint64_t)];
+};
+
+/**
+ * At the start of the file, a page. N_RECORDS is only advanced once a
+ * record is fully written, readers never see half of one.
+ */
+struct store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t block_records;
+    uint32_t reserved;
+    uint64_t n_records;
+};
+
+/**
+ * An open store. Readers map the whole file, writers the header and the
+ * block being filled, BLOCK_IDX (-1 if none).
+ */
+struct store {
+    int fd;
+    char writable;
+    char *map;
+    size_t map_len;
+    uint64_t n_records;
+    char *block_map;
+    int64_t block_idx;
+};
+
+/**
+ * Open the store at PATH, creating it if WRITABLE.
+ * Returns 0 on failure.
+ */
+int store_open(struct store *st, const char *path, char writable);
+
+/**
+ * Append REC. Appends from several processes are serialized with a file lock.
+ * Returns 0 on failure.
+ */
+int store_append(struct store *st, const struct store_record *rec);
+
+/**
+ * Block number IDX of a store opened for reading, NULL past the last one.
+ * Its records follow it, only the first N_RECORDS of them are valid.
+ */
+const struct store_block *store_block(struct store *st, uint64_t idx);
+
+/**
+ * Record number IDX of a store opened for reading, IDX must be below N_RECORDS
+ */
+const struct store_record *store_get(struct store *st, uint64_t idx);
+
+void store_close(struct store *st);
+
+/**
+ * Fill the distribution fields of REC from H, the rest is left alone
+ */
+void store_fill(struct store_record *rec, const histogram *h);
+
+/**
+ * Fill the time and target fields of REC and clear the rest
+ */
+void store_init_record(struct store_record *rec, const struct sockaddr_in *addr, const char *label);
+
+#endif
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include "stream.h"
+#include "protocol.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+int stream_probes(int fd, char transmit, char receive, unsigned int n_probes, size_t msg_size, int timeout_sec,
+                  struct stream_counters *dest, char *leftover, size_t leftover_size, size_t *leftover_len) {
+    char *payload = NULL, *probe_str, *chunk;
+    size_t probe_len = 0, probe_sent = 0;
+    msg_probe probe;
+    probe_stream ps;
+    struct pollfd pfd;
+    ssize_t res, consumed;
+    int ok = 0;
+
+    memset(dest, 0, sizeof(struct stream_counters));
+    *leftover_len = 0;
+
+    probe_str = malloc(MAX_SIZE_PROBE);
+    chunk = malloc(STREAM_CHUNK_SIZE);
+
+    probe.protocol_phase = PHASE_MEASURE;
+    probe.probe_seq_num = 1;
+
+    if (transmit) {
+        payload = new_payload(msg_size);
+        probe.payload = payload;
+        probe_to_string(&probe, probe_str, &probe_len);
+    }
+
+    probe_stream_init(&ps, receive ? n_probes : 0);
+    pfd.fd = fd;
+
+    while (1) {
+        transmit = transmit && probe.probe_seq_num <= n_probes;
+        receive = receive && !probe_stream_done(&ps);
+
+        if (!transmit && !receive) {
+            ok = 1;
+            break;
+        }
+
+        pfd.events = (receive ? POLLIN : 0) | (transmit ? POLLOUT : 0);
+
+        if (poll(&pfd, 1, timeout_sec * 1000) <= 0) {
+            log_error("Stream timed out");
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            res = send(fd, probe_str + probe_sent, probe_len - probe_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("Stream send error");
+                break;
+            }
+
+            if (res > 0) {
+                stream_count_tx(dest, res, now_ns());
+                probe_sent += res;
+            }
+
+            if (probe_sent == probe_len) {
+                probe.probe_seq_num += 1;
+                probe_sent = 0;
+                probe_to_string(&probe, probe_str, &probe_len);
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            res = recv(fd, chunk, STREAM_CHUNK_SIZE, MSG_DONTWAIT);
+
+            if (res == 0) {
+                log_error("Connection closed while streaming");
+                break;
+            }
+
+            if (res == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                log_perror("Stream receive error");
+                break;
+            }
+
+            consumed = probe_stream_feed(&ps, chunk, res);
+            if (consumed == -1) {
+                log_error("Received invalid probe while streaming");
+                break;
+            }
+
+            stream_count_rx(dest, consumed, now_ns());
+
+            if (consumed < res) {
+                *leftover_len = res - consumed;
+                if (*leftover_len > leftover_size) *leftover_len = leftover_size;
+                memcpy(leftover, chunk + consumed, *leftover_len);
+            }
+        }
+    }
+
+    free(payload);
+    free(probe_str);
+    free(chunk);
+    return ok;
+}
+
+void stream_count_rx(struct stream_counters *counters, size_t len, uint64_t now) {
+    if (counters->rx_bytes == 0) {
+        counters->rx_first_ns = now;
+        counters->rx_first_len = len;
+    }
+
+    counters->rx_last_ns = now;
+    counters->rx_bytes += len;
+}
+
+void stream_count_tx(struct stream_counters *counters, size_t len, uint64_t now) {
+    if (counters->tx_bytes == 0) {
+        counters->tx_first_ns = now;
+        counters->tx_first_len = len;
+    }
+
+    counters->tx_last_ns = now;
+    counters->tx_bytes += len;
+}
+
+/**
+ * The first chunk was already in when the clock started, its bytes would
+ * inflate the rate. Timing the others and scaling to all keeps the Closing's
+ * bytes and duration consistent with each other.
+ */
+static unsigned long scaled_usec(uint64_t bytes, uint64_t first_len, uint64_t first_ns, uint64_t last_ns) {
+    if (bytes <= first_len) {
+        return 0;
+    }
+
+    return (unsigned long)((last_ns - first_ns) / 1000.0 * bytes / (bytes - first_len));
+}
+
+unsigned long stream_rx_usec(struct stream_counters *counters) {
+    return scaled_usec(counters->rx_bytes, counters->rx_first_len, counters->rx_first_ns, counters->rx_last_ns);
+}
+
+unsigned long stream_tx_usec(struct stream_counters *counters) {
+    return scaled_usec(counters->tx_bytes, counters->tx_first_len, counters->tx_first_ns, counters->tx_last_ns);
+}
@@ -0,0 +1,64 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Size of the chunks read from the socket while streaming
+ */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+/**
+ * What one end of a stream moved, times are CLOCK_MONOTONIC nanoseconds
+ * of the first and last chunk. The clock only starts once the first one,
+ * RX_FIRST_LEN or TX_FIRST_LEN bytes, is already moved.
+ */
+struct stream_counters {
+    uint64_t rx_bytes;
+    uint64_t rx_first_len;
+    uint64_t rx_first_ns;
+    uint64_t rx_last_ns;
+    uint64_t tx_bytes;
+    uint64_t tx_first_len;
+    uint64_t tx_first_ns;
+    uint64_t tx_last_ns;
+};
+
+/**
+ * Transmit and/or receive N_PROBES probes of MSG_SIZE bytes over FD at the same
+ * time, without waiting for echoes. Received probes are validated and discarded.
+ * Bytes received after the last probe are copied in LEFTOVER (up to LEFTOVER_SIZE)
+ * and their count written in LEFTOVER_LEN.
+ * Returns 0 on error or timeout.
+ */
+int stream_probes(int fd,
+                  char transmit,
+                  char receive,
+                  unsigned int n_probes,
+                  size_t msg_size,
+                  int timeout_sec,
+                  struct stream_counters *dest,
+                  char *leftover,
+                  size_t leftover_size,
+                  size_t *leftover_len);
+
+/**
+ * Count LEN bytes received, or transmitted, at NOW
+ */
+void stream_count_rx(struct stream_counters *counters, size_t len, uint64_t now);
+void stream_count_tx(struct stream_counters *counters, size_t len, uint64_t now);
+
+/**
+ * Duration in microseconds of the bytes received, so that RX_BYTES over it
+ * is the rate. The rate is timed from the first chunk to the last, by the
+ * bytes after the first, 0 if there's only one.
+ */
+unsigned long stream_rx_usec(struct stream_counters *counters);
+
+/**
+ * Same as stream_rx_usec() for the bytes transmitted
+ */
+unsigned long stream_tx_usec(struct stream_counters *counters);
+
+#endif
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+
+#include "sweep.h"
+#include "protocol.h"
+#include "stats.h"
+#include "utils.h"
+#include "tuning.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/**
+ * A session of a step
+ */
+struct sweep_conn {
+    int fd;
+    unsigned int queued;
+    unsigned int echoed;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+};
+
+static int try_rate(struct sweep_config *config, double rate, struct sweep_result *dest);
+static int run_step(struct sweep_config *config, double rate, struct sweep_step *dest);
+static int pace(struct sweep_config *config, struct sweep_conn *conns, unsigned int n_probes, double rate,
+    histogram *hist, size_t *echoed_bytes, uint64_t *elapsed_ns);
+static uint64_t due_ns(uint64_t start, double rate, int concurrency, int conn, unsigned int seq);
+static void judge(struct sweep_config *config, struct sweep_step *step, struct sweep_step *baseline);
+static int open_session(struct sweep_config *config, unsigned int n_probes);
+static void close_session(int fd);
+static int compare_rate(const void *a, const void *b);
+
+int sweep_run(struct sweep_config *config, struct sweep_result *dest) {
+    double rate = SWEEP_START_RATE, lo = 0, hi = 0;
+
+    memset(dest, 0, sizeof(struct sweep_result));
+    dest->best = -1;
+
+    // Ramp up until something gives
+    for (int i = 0; i < SWEEP_MAX_RAMP; i++, rate *= 2) {
+        if (!try_rate(config, rate, dest)) {
+            return 0;
+        }
+
+        if (!dest->steps[dest->n_steps - 1].ok) {
+            hi = rate;
+            break;
+        }
+
+        lo = rate;
+    }
+
+    // Then narrow it down
+    for (int i = 0; i < SWEEP_REFINE_STEPS && lo > 0 && hi > 0 && hi / lo > SWEEP_RESOLUTION; i++) {
+        rate = (lo + hi) / 2;
+
+        if (!try_rate(config, rate, dest)) {
+            return 0;
+        }
+
+        if (dest->steps[dest->n_steps - 1].ok) {
+            lo = rate;
+        } else {
+            hi = rate;
+        }
+    }
+
+    qsort(dest->steps, dest->n_steps, sizeof(struct sweep_step), compare_rate);
+
+    for (int i = 0; i < dest->n_steps; i++) {
+        if (dest->steps[i].ok) {
+            dest->best = i;
+        }
+    }
+
+    return 1;
+}
+
+void sweep_print(struct sweep_result *result) {
+    struct sweep_step *step;
+
+    printf("%12s %14s %14s %11s %11s %11s %7s  %s\n", "probes/sec", "offered Mb/s", "goodput Mb/s",
+        "p50 ms", "p99 ms", "p99.9 ms", "lost", "verdict");
+
+    for (int i = 0; i < result->n_steps; i++) {
+        step = &(result->steps[i]);
+        printf("%12.1f %14.3f %14.3f %11.6f %11.6f %11.6f %7lu  %s\n", step->rate,
+            step->offered_bps / 1000000, step->goodput_bps / 1000000,
+            step->p50 / 1000000.0, step->p99 / 1000000.0, step->p999 / 1000000.0,
+            step->lost, step->verdict);
+    }
+
+    if (result->best == -1) {
+        printf("\nNo sustainable load, even the first step failed\n\n");
+        return;
+    }
+
+    step = &(result->steps[result->best]);
+    printf("\nMax sustainable load = %.1f probes/sec (%.3f Mbits/sec), p99 = %.6f ms\n\n",
+        step->rate, step->goodput_bps / 1000000, step->p99 / 1000000.0);
+}
+
+/**
+ * Add a step at RATE to DEST. A step failing on latency alone is run again
+ * before believing it, a single scheduling hiccup is enough to move a p99
+ * and send the binary search the wrong way.
+ */
+static int try_rate(struct sweep_config *config, double rate, struct sweep_result *dest) {
+    struct sweep_step *step = &(dest->steps[dest->n_steps]), retry;
+
+    if (!run_step(config, rate, step)) {
+        return 0;
+    }
+
+    judge(config, step, &(dest->steps[0]));
+    dest->n_steps += 1;
+
+    if (step->ok || step->lost > 0 || step->goodput_bps < step->offered_bps * SWEEP_GOODPUT_RATIO) {
+        return 1;
+    }
+
+    log_info("  Running it again to confirm");
+
+    if (!run_step(config, rate, &retry)) {
+        return 0;
+    }
+
+    judge(config, &retry, &(dest->steps[0]));
+
+    if (retry.p99 < step->p99) {
+        *step = retry;
+    }
+
+    return 1;
+}
+
+/**
+ * Open the sessions, pace probes at RATE over them and measure what comes back
+ */
+static int run_step(struct sweep_config *config, double rate, struct sweep_step *dest) {
+    struct sweep_conn *conns;
+    histogram hist;
+    unsigned int n_probes;
+    size_t echoed_bytes = 0;
+    uint64_t elapsed_ns = 0;
+    int ok = 0, opened = 0;
+
+    n_probes = rate * SWEEP_STEP_SEC / config->concurrency;
+    if (n_probes < SWEEP_MIN_PROBES) n_probes = SWEEP_MIN_PROBES;
+
+    log_info("Step: %.1f probes/sec, %u probes x %d connections", rate, n_probes, config->concurrency);
+
+    conns = calloc(config->concurrency, sizeof(struct sweep_conn));
+
+    if (conns == NULL) {
+        log_error("Sweep: out of memory");
+        return 0;
+    }
+
+    for (opened = 0; opened < config->concurrency; opened++) {
+        conns[opened].fd = open_session(config, n_probes);
+        conns[opened].out = malloc(MAX_SIZE_PROBE);
+
+        if (conns[opened].fd == -1 || conns[opened].out == NULL) {
+            free(conns[opened].out);
+            break;
+        }
+    }
+
+    if (opened == config->concurrency) {
+        hist_init(&hist);
+        ok = pace(config, conns, n_probes, rate, &hist, &echoed_bytes, &elapsed_ns);
+    }
+
+    memset(dest, 0, sizeof(struct sweep_step));
+    dest->rate = rate;
+
+    for (int i = 0; i < opened; i++) {
+        dest->lost += n_probes - conns[i].echoed;
+
+        // A session with probes still in flight can't be closed cleanly
+        if (conns[i].echoed == n_probes) {
+            close_session(conns[i].fd);
+        } else {
+            close(conns[i].fd);
+        }
+
+        free(conns[i].out);
+    }
+
+    free(conns);
+
+    if (!ok) {
+        return 0;
+    }
+
+    dest->offered_bps = rate * (echoed_bytes / (double)hist.count) * 8;
+    dest->goodput_bps = elapsed_ns > 0 ? echoed_bytes * 8 / (elapsed_ns / 1000000000.0) : 0;
+    dest->p50 = hist_percentile(&hist, 50);
+    dest->p99 = hist_percentile(&hist, 99);
+    dest->p999 = hist_percentile(&hist, 99.9);
+
+    return 1;
+}
+
+/**
+ * Send each probe when it's due, whether or not earlier ones came back.
+ * Latency is taken from when the probe was due: if the client falls behind,
+ * the wait counts, otherwise an overloaded path would look faster than it is.
+ */
+static int pace(struct sweep_config *config, struct sweep_conn *conns, unsigned int n_probes, double rate,
+    histogram *hist, size_t *echoed_bytes, uint64_t *elapsed_ns
+) {
+    struct pollfd *pfds;
+    struct timespec timeout;
+    struct sweep_conn *c;
+    char *payload, recv_chunk[16 * 1024];
+    msg_probe probe;
+    uint64_t start, now, due, next_due, last_progress;
+    unsigned long total = (unsigned long)n_probes * config->concurrency, echoed = 0;
+    ssize_t res;
+    int ok = 1;
+
+    pfds = calloc(config->concurrency, sizeof(struct pollfd));
+    payload = new_payload(config->payload_size);
+
+    if (pfds == NULL || payload == NULL) {
+        log_error("Sweep: out of memory");
+        free(pfds);
+        free(payload);
+        return 0;
+    }
+
+    probe.protocol_phase = PHASE_MEASURE;
+    probe.payload = payload;
+
+    for (int i = 0; i < config->concurrency; i++) {
+        pfds[i].fd = conns[i].fd;
+    }
+
+    start = now_ns();
+    last_progress = start;
+
+    while (echoed < total) {
+        now = now_ns();
+        next_due = UINT64_MAX;
+
+        for (int i = 0; i < config->concurrency; i++) {
+            c = &(conns[i]);
+
+            // Catch up on every probe that's due, as long as the socket takes them
+            while (c->out_sent == c->out_len && c->queued < n_probes
+                && due_ns(start, rate, config->concurrency, i, c->queued + 1) <= now
+            ) {
+                probe.probe_seq_num = ++(c->queued);
+                probe_to_string(&probe, c->out, &(c->out_len));
+                c->out_sent = 0;
+
+                res = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (res > 0) c->out_sent = res;
+            }
+
+            if (c->out_sent == c->out_len && c->queued < n_probes) {
+                due = due_ns(start, rate, config->concurrency, i, c->queued + 1);
+                if (due < next_due) next_due = due;
+            }
+
+            pfds[i].events = POLLIN | (c->out_sent < c->out_len ? POLLOUT : 0);
+        }
+
+        if (now - last_progress > (uint64_t)config->timeout_sec * 1000000000) {
+            log_error("Sweep: timed out waiting for %lu echoes", total - echoed);
+            break;
+        }
+
+        // Sub-millisecond pacing, poll() wouldn't do
+        if (next_due == UINT64_MAX) {
+            timeout.tv_sec = config->timeout_sec;
+            timeout.tv_nsec = 0;
+        } else {
+            timeout.tv_sec = next_due > now ? (next_due - now) / 1000000000 : 0;
+            timeout.tv_nsec = next_due > now ? (next_due - now) % 1000000000 : 0;
+        }
+
+        if (ppoll(pfds, config->concurrency, &timeout, NULL) == -1) {
+            log_perror("Sweep: poll error");
+            ok = 0;
+            break;
+        }
+
+        for (int i = 0; i < config->concurrency; i++) {
+            c = &(conns[i]);
+
+            if (pfds[i].revents & POLLOUT) {
+                res = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                if (res == -1 && errno != EAGAIN) {
+                    log_perror("Sweep: send error");
+                    ok = 0;
+                    break;
+                }
+                if (res > 0) c->out_sent += res;
+            }
+
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                res = recv(c->fd, recv_chunk, sizeof(recv_chunk), MSG_DONTWAIT);
+
+                if (res == 0 || (res == -1 && errno != EAGAIN)) {
+                    log_error("Sweep: connection lost");
+                    ok = 0;
+                    break;
+                }
+
+                now = now_ns();
+
+                // Echoes come back in order, the Nth newline ends probe N
+                for (ssize_t j = 0; j < res; j++) {
+                    if (recv_chunk[j] == '\n') {
+                        c->echoed += 1;
+                        echoed += 1;
+                        hist_record(hist, now - due_ns(start, rate, config->concurrency, i, c->echoed));
+                    }
+                }
+
+                if (res > 0) {
+                    *echoed_bytes += res;
+                    *elapsed_ns = now - start;
+                    last_progress = now;
+                }
+            }
+        }
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    free(pfds);
+    free(payload);
+
+    return ok && hist->count > 0;
+}
+
+/**
+ * Connections take turns, so probes are evenly spread in time
+ */
+static uint64_t due_ns(uint64_t start, double rate, int concurrency, int conn, unsigned int seq) {
+    return start + (uint64_t)(((double)(seq - 1) * concurrency + conn) * 1000000000.0 / rate);
+}
+
+static void judge(struct sweep_config *config, struct sweep_step *step, struct sweep_step *baseline) {
+    step->ok = 0;
+
+    if (step->lost > 0) {
+        step->verdict = "probes lost";
+    } else if (step->goodput_bps < step->offered_bps * SWEEP_GOODPUT_RATIO) {
+        step->verdict = "goodput flat";
+    } else if (step != baseline && step->p99 > baseline->p99 * SWEEP_P99_INFLATION) {
+        step->verdict = "p99 inflated";
+    } else if (config->slo_ns > 0 && step->p99 > config->slo_ns) {
+        step->verdict = "SLO missed";
+    } else {
+        step->verdict = "ok";
+        step->ok = 1;
+    }
+
+    log_info("  p99 = %.6f ms, goodput = %.3f Mbits/sec: %s",
+        step->p99 / 1000000.0, step->goodput_bps / 1000000, step->verdict);
+}
+
+static int open_session(struct sweep_config *config, unsigned int n_probes) {
+    int fd;
+    struct timeval timeout;
+    msg_hello hello;
+    char hello_str[MAX_SIZE_HELLO];
+    char response[MAX_SIZE_READY];
+    size_t hello_len;
+
+    memset(&hello, 0, sizeof(msg_hello));
+    hello.protocol_phase = PHASE_HELLO;
+    hello.measure_type = MEASURE_RTT;
+    hello.n_probes = n_probes;
+    hello.msg_size = config->payload_size;
+    hello.server_delay = config->server_delay;
+    hello.tuning = config->tuning;
+
+    // Probes are pipelined, Nagle would hold each one until the previous is acked.
+    // Asking for tuning has the server set TCP_NODELAY for the echoes too.
+    hello.has_tuning = 1;
+
+    if (!hello_to_string(&hello, hello_str, &hello_len)) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        log_perror("Sweep: cannot create socket");
+        return -1;
+    }
+
+    timeout.tv_usec = 0;
+    timeout.tv_sec = config->timeout_sec;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (!tune_apply(fd, &(config->tuning))) {
+        log_error("Sweep: some socket options could not be applied");
+    }
+
+    if (connect(fd, (struct sockaddr *)config->server_addr, sizeof(struct sockaddr_in)) == -1) {
+        log_perror("Sweep: cannot connect host");
+        close(fd);
+        return -1;
+    }
+
+    bzero(response, sizeof(response));
+
+    if (send(fd, hello_str, hello_len, 0) == -1
+        || recv(fd, response, sizeof(response) - 1, 0) <= 0
+        || !response_is(response, RESP_READY)
+    ) {
+        log_error("Sweep: Hello failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void close_session(int fd) {
+    msg_bye bye;
+    char bye_str[MAX_SIZE_BYE];
+    char response[MAX_SIZE_CLOSING];
+    size_t bye_len;
+
+    bye.protocol_phase = PHASE_BYE;
+    bye_to_string(&bye, bye_str, &bye_len);
+
+    if (send(fd, bye_str, bye_len, 0) != -1) {
+        recv(fd, response, sizeof(response), 0);
+    }
+
+    close(fd);
+}
+
+static int compare_rate(const void *a, const void *b) {
+    const struct sweep_step *step_a = a, *step_b = b;
+
+    return (step_a->rate > step_b->rate) - (step_a->rate < step_b->rate);
+}
@@ -0,0 +1,93 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "tuning.h"
+
+/**
+ * Probe rate (probes/sec over all connections) of the first step
+ */
+#define SWEEP_START_RATE 100
+
+/**
+ * Each step lasts about this long, but sends at least SWEEP_MIN_PROBES per connection
+ */
+#define SWEEP_STEP_SEC 1
+#define SWEEP_MIN_PROBES 500
+
+/**
+ * Doubling steps tried before giving up on finding the knee
+ */
+#define SWEEP_MAX_RAMP 24
+
+/**
+ * Binary search steps between the last good and the first bad rate,
+ * stopping early once they're closer than SWEEP_RESOLUTION
+ */
+#define SWEEP_REFINE_STEPS 6
+#define SWEEP_RESOLUTION 1.1
+
+#define SWEEP_MAX_STEPS (SWEEP_MAX_RAMP + SWEEP_REFINE_STEPS)
+
+/**
+ * A step is past the knee when its p99 is this many times the one of the first step...
+ */
+#define SWEEP_P99_INFLATION 3.0
+
+/**
+ * ...or when the echoed goodput falls below this fraction of the offered load
+ */
+#define SWEEP_GOODPUT_RATIO 0.9
+
+struct sweep_config {
+    struct sockaddr_in *server_addr;
+    size_t payload_size;
+    int concurrency;
+    unsigned int server_delay;
+    uint64_t slo_ns;
+    int timeout_sec;
+    struct sock_tuning tuning;
+};
+
+/**
+ * Offered and achieved load of a step, in bits/sec. Latencies are in
+ * nanoseconds from when a probe was due, not from when it could be sent.
+ */
+struct sweep_step {
+    double rate;
+    double offered_bps;
+    double goodput_bps;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    unsigned long lost;
+    const char *verdict;
+    char ok;
+};
+
+struct sweep_result {
+    struct sweep_step steps[SWEEP_MAX_STEPS];
+    int n_steps;
+    int best;
+};
+
+/**
+ * Ramp the probe rate against SERVER_ADDR, doubling it at every step until
+ * p99 latency inflates, goodput flattens or the SLO (if any) is missed,
+ * then binary search between the last good and the first bad rate.
+ * Probes are paced open loop over CONCURRENCY connections, with TUNING
+ * and TCP_NODELAY on both ends.
+ * BEST is the index of the highest rate that held, -1 if none did.
+ * Returns 0 on failure.
+ */
+int sweep_run(struct sweep_config *config, struct sweep_result *dest);
+
+/**
+ * Print the latency/throughput curve and the max sustainable load to stdout
+ */
+void sweep_print(struct sweep_result *result);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * USDT probes of provider "rtt_tester", for bpftrace scripts like the ones in trace/.
+ * When no tracer is attached a probe is a single nop and its arguments are
+ * only what's already at hand, no extra work is done to compute them.
+ * Without sys/sdt.h (HAVE_SDT is set by the Makefile) they compile to nothing.
+ *
+ * Server probes:
+ *   session_state(id, state)                 session ID entered STATE (enum server_states)
+ *   probe_received(id, size, received_ns)    a whole probe of SIZE bytes is in the buffer
+ *   probe_validated(id, seq, size)           its header was parsed and the sequence number matched
+ *   probe_echoed(id, seq, size, echoed_ns)   it was handed to the socket
+ *
+ * Client probes:
+ *   client_state(state, msg_size)            entered STATE (enum client_states)
+ *   probe_sent(seq, size, sent_ns)
+ *   probe_received(seq, size, received_ns)
+ *   probe_validated(seq, rtt_ns)
+ *
+ * Timestamps are CLOCK_MONOTONIC nanoseconds, the same clock as bpftrace's nsecs.
+ */
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define TRACE2(name, a, b) DTRACE_PROBE2(rtt_tester, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(rtt_tester, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(rtt_tester, name, a, b, c, d)
+
+#else
+
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#define TRACE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+#endif
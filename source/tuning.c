@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include "tuning.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+// Not exposed by older libc headers
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+int tune_low_latency(int fd) {
+    int flags;
+    int busy_poll = BUSY_POLL_USEC;
+    int one = 1;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_perror("Cannot make socket non-blocking");
+        return 0;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1) {
+        log_perror("Warning: cannot set SO_BUSY_POLL");
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == -1) {
+        log_perror("Warning: cannot set SO_PREFER_BUSY_POLL");
+    }
+
+    tune_nodelay(fd);
+    tune_quickack(fd);
+
+    return 1;
+}
+
+void tune_quickack(int fd) {
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+void tune_nodelay(int fd) {
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        log_perror("Warning: cannot set TCP_NODELAY");
+    }
+}
+
+int tune_pin_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        log_perror("Cannot pin to CPU");
+        return 0;
+    }
+
+    return 1;
+}
+
+int tune_mlock(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        log_perror("Cannot lock memory");
+        return 0;
+    }
+
+    return 1;
+}
+
+void tune_fd_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        return;
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        log_perror("Warning: cannot raise open files limit");
+    }
+}
+
+int tune_fastopen_listen(int fd, int qlen) {
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1) {
+        log_perror("Cannot enable TCP Fast Open");
+        return 0;
+    }
+
+    return 1;
+}
+
+int tune_apply(int fd, const struct sock_tuning *tuning) {
+    int one = 1;
+    int ok = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        log_perror("Cannot set TCP_NODELAY");
+        ok = 0;
+    }
+
+    if (tuning->sndbuf > 0
+        && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(tuning->sndbuf), sizeof(tuning->sndbuf)) == -1
+    ) {
+        log_perror("Cannot set SO_SNDBUF");
+        ok = 0;
+    }
+
+    if (tuning->rcvbuf > 0
+        && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(tuning->rcvbuf), sizeof(tuning->rcvbuf)) == -1
+    ) {
+        log_perror("Cannot set SO_RCVBUF");
+        ok = 0;
+    }
+
+    if (tuning->notsent_lowat > 0
+        && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &(tuning->notsent_lowat), sizeof(tuning->notsent_lowat)) == -1
+    ) {
+        log_perror("Cannot set TCP_NOTSENT_LOWAT");
+        ok = 0;
+    }
+
+    if (tuning->congestion[0] != '\0'
+        && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, tuning->congestion, strlen(tuning->congestion)) == -1
+    ) {
+        log_perror("Cannot set TCP_CONGESTION");
+        ok = 0;
+    }
+
+    return ok;
+}
+
+void tune_effective(int fd, struct sock_tuning *dest) {
+    socklen_t len;
+
+    memset(dest, 0, sizeof(struct sock_tuning));
+
+    len = sizeof(dest->sndbuf);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(dest->sndbuf), &len);
+
+    len = sizeof(dest->rcvbuf);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(dest->rcvbuf), &len);
+
+    len = sizeof(dest->notsent_lowat);
+    getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &(dest->notsent_lowat), &len);
+
+    len = TUNE_CC_MAX - 1;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, dest->congestion, &len) == -1) {
+        strcpy(dest->congestion, "?");
+    }
+}
+
+int tune_path_info(int fd, struct path_info *dest) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    memset(dest, 0, sizeof(struct path_info));
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return 0;
+    }
+
+    // Older kernels return a shorter struct, missing fields stay zeroed
+    dest->min_rtt_usec = info.tcpi_min_rtt;
+    dest->srtt_usec = info.tcpi_rtt;
+    dest->snd_cwnd = info.tcpi_snd_cwnd;
+    dest->delivery_rate = info.tcpi_delivery_rate;
+    dest->syn_data = (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+
+    return 1;
+}
+
+int tune_buf_for_bdp(double rate, double rtt_sec) {
+    // Twice the BDP, so a full window fits while the previous one is being acked
+    double buf = 2 * rate * rtt_sec;
+
+    if (buf < TUNE_MIN_BUF) return TUNE_MIN_BUF;
+    if (buf > TUNE_MAX_BUF) return TUNE_MAX_BUF;
+    return buf;
+}
@@ -0,0 +1,113 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdint.h>
+
+/**
+ * Microseconds the kernel is allowed to busy poll the device queue
+ * on a blocking receive when low-latency mode is enabled.
+ */
+#define BUSY_POLL_USEC 50
+
+/**
+ * Max length of a congestion control algorithm name, including terminator
+ */
+#define TUNE_CC_MAX 16
+
+/**
+ * Bounds for socket buffer sizes computed from the bandwidth-delay product
+ */
+#define TUNE_MIN_BUF (64 * 1024)
+#define TUNE_MAX_BUF (64 * 1024 * 1024)
+
+/**
+ * Socket options to apply to a connection.
+ * Zero sizes and an empty congestion name mean "leave the kernel default".
+ */
+struct sock_tuning {
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    char congestion[TUNE_CC_MAX];
+};
+
+/**
+ * Path properties as seen by the kernel (TCP_INFO)
+ */
+struct path_info {
+    uint32_t min_rtt_usec;
+    uint32_t srtt_usec;
+    uint32_t snd_cwnd;
+    uint64_t delivery_rate;
+    char syn_data;
+};
+
+/**
+ * Put FD in low-latency mode: non-blocking, SO_BUSY_POLL / SO_PREFER_BUSY_POLL,
+ * TCP_NODELAY and TCP_QUICKACK.
+ * Options requiring privileges are skipped with a warning.
+ * Returns 0 if the socket could not be made non-blocking.
+ */
+int tune_low_latency(int fd);
+
+/**
+ * Re-arm TCP_QUICKACK, which the kernel clears on its own after some time
+ */
+void tune_quickack(int fd);
+
+/**
+ * Set TCP_NODELAY, so small writes go out without waiting for the ACK of
+ * the previous ones. Failure is only warned about.
+ */
+void tune_nodelay(int fd);
+
+/**
+ * Pin the calling thread to CPU.
+ * Returns 0 on failure.
+ */
+int tune_pin_cpu(int cpu);
+
+/**
+ * Lock current and future pages in memory.
+ * Returns 0 on failure.
+ */
+int tune_mlock(void);
+
+/**
+ * Raise the open files limit to the hard limit, to hold as many connections as allowed
+ */
+void tune_fd_limit(void);
+
+/**
+ * Enable TCP Fast Open on listening socket FD, with a queue of QLEN pending requests.
+ * Returns 0 on failure.
+ */
+int tune_fastopen_listen(int fd, int qlen);
+
+/**
+ * Apply TUNING to FD, along with TCP_NODELAY.
+ * Buffer sizes must be set before connect() to affect window scaling.
+ * Returns 0 if any of the requested options could not be set.
+ */
+int tune_apply(int fd, const struct sock_tuning *tuning);
+
+/**
+ * Read back the settings actually in effect on FD.
+ * Buffer sizes are reported as the kernel sees them (double of the requested value).
+ */
+void tune_effective(int fd, struct sock_tuning *dest);
+
+/**
+ * Read RTT, congestion window and delivery rate estimates from TCP_INFO,
+ * and whether data was carried by the SYN (TCP Fast Open).
+ * Returns 0 if not available.
+ */
+int tune_path_info(int fd, struct path_info *dest);
+
+/**
+ * Socket buffer size fitting the bandwidth-delay product of a path
+ * with RATE bytes/sec and RTT_SEC round trip time.
+ */
+int tune_buf_for_bdp(double rate, double rtt_sec);
+
+#endif
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+
+#include "udp.h"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static void on_datagrams(void *ctx, uint32_t events);
+
+int udp_reflector_open(struct udp_reflector *r, struct evloop *loop, int port) {
+    struct sockaddr_in addr;
+    int fd;
+
+    memset(r, 0, sizeof(struct udp_reflector));
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+
+    if (fd == -1) {
+        log_perror("Cannot create UDP socket");
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_perror("Cannot bind UDP socket");
+        close(fd);
+        return 0;
+    }
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        r->iovs[i].iov_base = r->bufs[i];
+        r->msgs[i].msg_hdr.msg_iov = &(r->iovs[i]);
+        r->msgs[i].msg_hdr.msg_iovlen = 1;
+        r->msgs[i].msg_hdr.msg_name = &(r->addrs[i]);
+    }
+
+    if (!evloop_io_add(loop, &(r->io), fd, EPOLLIN, on_datagrams, r)) {
+        close(fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_datagrams(void *ctx, uint32_t events) {
+    struct udp_reflector *r = ctx;
+    int received, sent;
+
+    while (1) {
+        // recvmmsg() overwrites lengths, reset them for every batch
+        for (int i = 0; i < UDP_BATCH; i++) {
+            r->iovs[i].iov_len = UDP_MAX_DATAGRAM;
+            r->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        received = recvmmsg(r->io.fd, r->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+
+        if (received == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("UDP receive error");
+            }
+            return;
+        }
+
+        // Send back exactly what was received, to whoever sent it
+        for (int i = 0; i < received; i++) {
+            r->iovs[i].iov_len = r->msgs[i].msg_len;
+        }
+
+        sent = sendmmsg(r->io.fd, r->msgs, received, MSG_DONTWAIT);
+
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("UDP send error");
+            }
+            sent = 0;
+        }
+
+        r->packets += sent;
+
+        if (received < UDP_BATCH) {
+            return;
+        }
+    }
+}
+#pragma GCC diagnostic pop
@@ -0,0 +1,39 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include "evloop.h"
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/**
+ * Datagrams handled per recvmmsg()/sendmmsg() call
+ */
+#define UDP_BATCH 64
+
+/**
+ * Largest datagram reflected, bigger ones are truncated by the kernel
+ */
+#define UDP_MAX_DATAGRAM 2048
+
+/**
+ * Reflects every datagram back to its sender through a regular UDP socket.
+ * Probes are not parsed, this is the baseline for the AF_XDP reflector.
+ */
+struct udp_reflector {
+    struct ev_io io;
+    uint64_t packets;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char bufs[UDP_BATCH][UDP_MAX_DATAGRAM];
+};
+
+/**
+ * Bind a UDP socket on PORT and start reflecting from LOOP.
+ * Returns 0 on failure.
+ */
+int udp_reflector_open(struct udp_reflector *r, struct evloop *loop, int port);
+
+#endif
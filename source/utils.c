@@ -1,17 +1,98 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include "utils.h"
+#include "tuning.h"
 
-#include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <sys/socket.h>
 
-void print_recv(const char *msg) {
-    printf("<< %s\n", msg);
+static char recv_spin = 0;
+static uint64_t recv_spin_timeout_ns = 0;
+
+void set_recv_spin(char enabled, unsigned int timeout_sec) {
+    recv_spin = enabled;
+    recv_spin_timeout_ns = (uint64_t)timeout_sec * 1000000000;
 }
 
-void print_send(const char *msg) {
-    printf(">> %s\n", msg);
+/**
+ * Plain recv() unless spinning is enabled, in which case the socket is
+ * expected to be non-blocking and we poll it until data arrives or the
+ * timeout expires (reported as EAGAIN, like SO_RCVTIMEO does).
+ */
+ssize_t sock_recv(int fd, void *buf, size_t len, int flags) {
+    ssize_t res;
+    uint64_t deadline;
+
+    if (!recv_spin) {
+        return recv(fd, buf, len, flags);
+    }
+
+    deadline = now_ns() + recv_spin_timeout_ns;
+
+    while (1) {
+        res = recv(fd, buf, len, flags | MSG_DONTWAIT);
+
+        if (res >= 0) {
+            tune_quickack(fd);
+            return res;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        if (now_ns() > deadline) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Send the whole buffer, retrying on partial writes.
+ * Needed as soon as the socket is non-blocking, harmless otherwise.
+ */
+ssize_t sock_send(int fd, const void *buf, size_t len) {
+    size_t sent = 0;
+    ssize_t res;
+    uint64_t deadline = now_ns() + recv_spin_timeout_ns;
+
+    while (sent < len) {
+        res = send(fd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+
+        if (res == -1) {
+            if (recv_spin && (errno == EAGAIN || errno == EWOULDBLOCK) && now_ns() < deadline) {
+                continue;
+            }
+            return -1;
+        }
+
+        sent += res;
+    }
+
+    return sent;
+}
+
+/**
+ * Responses are NUL terminated and may be immediately followed by streamed data,
+ * so peek first and only consume up to the terminator.
+ */
+ssize_t recv_response(int fd, char *buf, size_t len) {
+    ssize_t res;
+    char *end;
+
+    res = sock_recv(fd, buf, len - 1, MSG_PEEK);
+    if (res <= 0) {
+        return res;
+    }
+
+    buf[res] = '\0';
+    end = memchr(buf, '\0', res);
+
+    return sock_recv(fd, buf, end != NULL ? (size_t)(end - buf) + 1 : (size_t)res, 0);
 }
 
 int recv_until(int fd, char *recv_buf, size_t recv_size, size_t *recv_idx, char *temp_buf, size_t temp_size, char sep) {
@@ -24,7 +105,7 @@ int recv_until(int fd, char *recv_buf, size_t recv_size, size_t *recv_idx, char
         if (*recv_idx == 0) {
             bzero(recv_buf, recv_size);
 
-            recv_res = recv(fd, recv_buf, recv_size, 0);
+            recv_res = sock_recv(fd, recv_buf, recv_size, 0);
 
             if (recv_res == -1) {
                 return -1;
@@ -65,6 +146,13 @@ double get_diff_ms(struct timeval *before, struct timeval *after) {
     + 0.001 * (after->tv_usec - before->tv_usec);
 }
 
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 double double_min(double a, double b) {
     return a < b ? a : b;
 }
@@ -2,10 +2,14 @@
 #define UTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/time.h>
 
-void print_recv(const char *msg);
-void print_send(const char *msg);
+void set_recv_spin(char enabled, unsigned int timeout_sec);
+ssize_t sock_recv(int fd, void *buf, size_t len, int flags);
+ssize_t recv_response(int fd, char *buf, size_t len);
+ssize_t sock_send(int fd, const void *buf, size_t len);
 
 int recv_until(int fd,
                char *recv_buf,
@@ -16,6 +20,7 @@ int recv_until(int fd,
                char sep);
 
 double get_diff_ms(struct timeval *before, struct timeval *after);
+uint64_t now_ns(void);
 
 double double_min(double a, double b);
 double double_max(double a, double b);
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+
+#include "xdp.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/**
+ * Ethernet + IPv4 without options + UDP headers
+ */
+#define HEADERS_SIZE 42
+
+#define INSN(code, dst, src, off, imm) ((struct bpf_insn){code, dst, src, off, imm})
+
+static int load_program(struct xdp_reflector *r, int port);
+static int attach_program(struct xdp_reflector *r);
+static int queue_open(struct xdp_reflector *r, struct xdp_queue *q, int id, struct evloop *loop);
+static int ring_map(int fd, struct xdp_ring *ring, struct xdp_ring_offset *off, uint32_t size,
+    size_t desc_size, off_t pgoff);
+static void on_packets(void *ctx, uint32_t events);
+static void reclaim(struct xdp_queue *q);
+static int reflect(char *pkt, uint32_t len);
+static long bpf(int cmd, union bpf_attr *attr);
+
+int xdp_reflector_open(struct xdp_reflector *r, struct evloop *loop, const char *ifname, int port, int n_queues) {
+    union bpf_attr attr;
+
+    memset(r, 0, sizeof(struct xdp_reflector));
+    r->n_queues = n_queues;
+    r->link_fd = -1;
+    r->ifindex = if_nametoindex(ifname);
+
+    if (r->ifindex == 0) {
+        log_perror("Cannot find XDP interface");
+        return 0;
+    }
+
+    // Queue index -> AF_XDP socket, used by the program to pick where to redirect
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = n_queues;
+
+    r->map_fd = bpf(BPF_MAP_CREATE, &attr);
+
+    if (r->map_fd == -1) {
+        log_perror("Cannot create XSKMAP");
+        return 0;
+    }
+
+    if (!load_program(r, port)) {
+        return 0;
+    }
+
+    // Sockets are bound before attaching, so that no datagram is redirected to an empty slot
+    for (int i = 0; i < n_queues; i++) {
+        if (!queue_open(r, &(r->queues[i]), i, loop)) {
+            return 0;
+        }
+    }
+
+    return attach_program(r);
+}
+
+void xdp_reflector_reclaim(struct xdp_reflector *r) {
+    for (int i = 0; i < r->n_queues; i++) {
+        reclaim(&(r->queues[i]));
+    }
+}
+
+/**
+ * Hand assembled, there's no BPF compiler around:
+ *
+ *   if (eth->proto != IPv4 || ip->ihl != 5 || ip->proto != UDP || udp->dest != PORT)
+ *       return XDP_PASS;
+ *   return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ */
+static int load_program(struct xdp_reflector *r, int port) {
+    struct bpf_insn prog[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, HEADERS_SIZE),
+        INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 14, 0),
+        INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 12, htons(0x0800)),
+        INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 14, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 10, 0x45),
+        INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 23, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 8, IPPROTO_UDP),
+        INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 36, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 6, htons(port)),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, r->map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+    char verifier_log[4096];
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uint64_t)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    attr.log_buf = (uint64_t)(unsigned long)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+    verifier_log[0] = '\0';
+
+    r->prog_fd = bpf(BPF_PROG_LOAD, &attr);
+
+    if (r->prog_fd == -1) {
+        log_perror("Cannot load XDP program");
+        log_error("%s", verifier_log);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Through a BPF link, so the program goes away with the process
+ * even if it doesn't exit cleanly.
+ */
+static int attach_program(struct xdp_reflector *r) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.link_create.prog_fd = r->prog_fd;
+    attr.link_create.target_ifindex = r->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+
+    r->link_fd = bpf(BPF_LINK_CREATE, &attr);
+
+    if (r->link_fd == -1) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        r->link_fd = bpf(BPF_LINK_CREATE, &attr);
+        r->generic = 1;
+    }
+
+    if (r->link_fd == -1) {
+        log_perror("Cannot attach XDP program");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int queue_open(struct xdp_reflector *r, struct xdp_queue *q, int id, struct evloop *loop) {
+    struct xdp_umem_reg umem_reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    union bpf_attr attr;
+    socklen_t off_len = sizeof(off);
+    uint32_t fill_size = XDP_NUM_FRAMES, ring_size = XDP_RING_SIZE;
+    uint32_t key = id;
+    int fd;
+
+    q->id = id;
+    fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        log_perror("Cannot create AF_XDP socket");
+        return 0;
+    }
+
+    q->io.fd = fd;
+    q->umem = mmap(NULL, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (q->umem == MAP_FAILED) {
+        log_perror("Cannot allocate UMEM");
+        return 0;
+    }
+
+    memset(&umem_reg, 0, sizeof(struct xdp_umem_reg));
+    umem_reg.addr = (uint64_t)(unsigned long)q->umem;
+    umem_reg.len = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) == -1
+        || setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) == -1
+        || setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &fill_size, sizeof(fill_size)) == -1
+        || setsockopt(fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) == -1
+        || setsockopt(fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) == -1
+    ) {
+        log_perror("Cannot set up UMEM and rings");
+        return 0;
+    }
+
+    if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) == -1) {
+        log_perror("Cannot get AF_XDP ring offsets");
+        return 0;
+    }
+
+    if (!ring_map(fd, &(q->fill), &(off.fr), fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)
+        || !ring_map(fd, &(q->completion), &(off.cr), fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)
+        || !ring_map(fd, &(q->rx), &(off.rx), ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)
+        || !ring_map(fd, &(q->tx), &(off.tx), ring_size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)
+    ) {
+        return 0;
+    }
+
+    // Every frame starts out waiting for a packet, it comes back here after being sent
+    for (uint32_t i = 0; i < XDP_NUM_FRAMES; i++) {
+        ((uint64_t *)q->fill.descs)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(q->fill.producer, XDP_NUM_FRAMES, __ATOMIC_RELEASE);
+
+    memset(&addr, 0, sizeof(struct sockaddr_xdp));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = r->ifindex;
+    addr.sxdp_queue_id = id;
+    addr.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    r->zerocopy = 1;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        addr.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        r->zerocopy = 0;
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            log_perror("Cannot bind AF_XDP socket");
+            return 0;
+        }
+    }
+
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_fd = r->map_fd;
+    attr.key = (uint64_t)(unsigned long)&key;
+    attr.value = (uint64_t)(unsigned long)&fd;
+
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        log_perror("Cannot add AF_XDP socket to XSKMAP");
+        return 0;
+    }
+
+    return evloop_io_add(loop, &(q->io), fd, EPOLLIN, on_packets, q);
+}
+
+static int ring_map(int fd, struct xdp_ring *ring, struct xdp_ring_offset *off, uint32_t size,
+    size_t desc_size, off_t pgoff
+) {
+    char *map;
+
+    ring->map_len = off->desc + size * desc_size;
+    map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+    if (map == MAP_FAILED) {
+        log_perror("Cannot map AF_XDP ring");
+        return 0;
+    }
+
+    ring->map = map;
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->flags = (uint32_t *)(map + off->flags);
+    ring->descs = map + off->desc;
+    ring->size = size;
+
+    return 1;
+}
+
+/**
+ * Received frames go straight to the TX ring after swapping addresses in place.
+ * When TX is full the frame is given back to the fill ring, dropping the datagram.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void on_packets(void *ctx, uint32_t events) {
+    struct xdp_queue *q = ctx;
+    struct xdp_desc *rx_descs = q->rx.descs, *tx_descs = q->tx.descs, *desc;
+    uint64_t *fill_descs = q->fill.descs;
+    uint32_t rx_cons, rx_avail, tx_prod, tx_free, fill_prod, sent = 0;
+
+    reclaim(q);
+
+    rx_cons = *(q->rx.consumer);
+    rx_avail = __atomic_load_n(q->rx.producer, __ATOMIC_ACQUIRE) - rx_cons;
+    if (rx_avail > XDP_BATCH) rx_avail = XDP_BATCH;
+    tx_prod = *(q->tx.producer);
+    tx_free = q->tx.size - (tx_prod - __atomic_load_n(q->tx.consumer, __ATOMIC_ACQUIRE));
+    fill_prod = *(q->fill.producer);
+
+    for (uint32_t i = 0; i < rx_avail; i++) {
+        desc = &(rx_descs[(rx_cons + i) & (q->rx.size - 1)]);
+
+        if (tx_free > 0 && reflect(q->umem + desc->addr, desc->len)) {
+            tx_descs[tx_prod & (q->tx.size - 1)] = *desc;
+            tx_prod++;
+            tx_free--;
+            sent++;
+        } else {
+            fill_descs[fill_prod & (q->fill.size - 1)] = desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+            fill_prod++;
+            q->dropped++;
+        }
+    }
+
+    __atomic_store_n(q->rx.consumer, rx_cons + rx_avail, __ATOMIC_RELEASE);
+    __atomic_store_n(q->tx.producer, tx_prod, __ATOMIC_RELEASE);
+    __atomic_store_n(q->fill.producer, fill_prod, __ATOMIC_RELEASE);
+
+    if (sent > 0 && (__atomic_load_n(q->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+        sendto(q->io.fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    q->packets += sent;
+
+    // In copy mode the frames were sent by the kick above, recycle them right away
+    reclaim(q);
+
+    if (__atomic_load_n(q->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+        recvfrom(q->io.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+#pragma GCC diagnostic pop
+
+static void reclaim(struct xdp_queue *q) {
+    uint64_t *comp_descs = q->completion.descs, *fill_descs = q->fill.descs;
+    uint32_t comp_cons, comp_avail, fill_prod;
+
+    comp_cons = *(q->completion.consumer);
+    comp_avail = __atomic_load_n(q->completion.producer, __ATOMIC_ACQUIRE) - comp_cons;
+
+    if (comp_avail == 0) {
+        return;
+    }
+
+    fill_prod = *(q->fill.producer);
+
+    for (uint32_t i = 0; i < comp_avail; i++) {
+        fill_descs[fill_prod & (q->fill.size - 1)] =
+            comp_descs[(comp_cons + i) & (q->completion.size - 1)] & ~((uint64_t)XDP_FRAME_SIZE - 1);
+        fill_prod++;
+    }
+
+    __atomic_store_n(q->completion.consumer, comp_cons + comp_avail, __ATOMIC_RELEASE);
+    __atomic_store_n(q->fill.producer, fill_prod, __ATOMIC_RELEASE);
+}
+
+/**
+ * Turn the datagram around by swapping MAC addresses, IP addresses and ports.
+ * The IP checksum is a sum of 16 bit words, swapping doesn't change it. The
+ * UDP one is cleared instead, which IPv4 allows: a local sender on a veth
+ * may have left a partial one to be offloaded, which would get the echo
+ * dropped by the receiver.
+ */
+static int reflect(char *pkt, uint32_t len) {
+    char tmp[6];
+
+    // Already checked by the XDP program, but cheap enough to not trust it blindly
+    if (len < HEADERS_SIZE || pkt[12] != 0x08 || pkt[13] != 0x00 || pkt[14] != 0x45 || pkt[23] != IPPROTO_UDP) {
+        return 0;
+    }
+
+    memcpy(tmp, pkt, 6);
+    memcpy(pkt, pkt + 6, 6);
+    memcpy(pkt + 6, tmp, 6);
+
+    memcpy(tmp, pkt + 26, 4);
+    memcpy(pkt + 26, pkt + 30, 4);
+    memcpy(pkt + 30, tmp, 4);
+
+    memcpy(tmp, pkt + 34, 2);
+    memcpy(pkt + 34, pkt + 36, 2);
+    memcpy(pkt + 36, tmp, 2);
+
+    memset(pkt + 40, 0, 2);
+
+    return 1;
+}
+
+static long bpf(int cmd, union bpf_attr *attr) {
+    return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
@@ -0,0 +1,88 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include "evloop.h"
+
+#include <stdint.h>
+#include <linux/if_xdp.h>
+
+/**
+ * Max queues of an interface served by the reflector
+ */
+#define XDP_MAX_QUEUES 16
+
+/**
+ * UMEM frames per queue and their size. Each frame holds a whole packet.
+ */
+#define XDP_NUM_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+
+/**
+ * Descriptors in the RX and TX rings. Fill and completion rings hold all frames.
+ */
+#define XDP_RING_SIZE 2048
+
+/**
+ * Descriptors handled per wakeup. Those left over keep the socket readable
+ * and are handled on the next round of the event loop, after the other
+ * sockets had their turn.
+ */
+#define XDP_BATCH 64
+
+/**
+ * A ring shared with the kernel, mapped from the AF_XDP socket.
+ * Descriptors are struct xdp_desc for RX/TX and UMEM offsets for fill/completion.
+ */
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t size;
+    void *map;
+    size_t map_len;
+};
+
+/**
+ * An AF_XDP socket bound to a single queue, with its own UMEM
+ */
+struct xdp_queue {
+    int id;
+    struct ev_io io;
+    char *umem;
+    struct xdp_ring fill;
+    struct xdp_ring completion;
+    struct xdp_ring rx;
+    struct xdp_ring tx;
+    uint64_t packets;
+    uint64_t dropped;
+};
+
+struct xdp_reflector {
+    int ifindex;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    char generic;
+    char zerocopy;
+    int n_queues;
+    struct xdp_queue queues[XDP_MAX_QUEUES];
+};
+
+/**
+ * Divert IPv4 UDP datagrams to PORT arriving on IFNAME queues 0 to N_QUEUES - 1
+ * to AF_XDP sockets, and send them back from the same UMEM frame with swapped
+ * addresses. Native XDP and zero-copy are tried first, falling back to generic
+ * (skb) mode and copies, so it works on a veth too.
+ * The XDP program is detached when the process exits.
+ * Returns 0 on failure.
+ */
+int xdp_reflector_open(struct xdp_reflector *r, struct evloop *loop, const char *ifname, int port, int n_queues);
+
+/**
+ * Return transmitted frames to the fill ring. Also done on every RX wakeup,
+ * call it now and then so that frames don't sit in the completion ring.
+ */
+void xdp_reflector_reclaim(struct xdp_reflector *r);
+
+#endif